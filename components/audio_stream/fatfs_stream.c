@@ -63,6 +63,18 @@ typedef struct fatfs_stream {
     int file;
     wr_stream_type_t w_type;
     bool write_header;
+    fatfs_stream_event_handle_t event_handle;
+    void *user_data;
+    /* gapless playback of a reader */
+    uint32_t format;            /* frame format of the current file, 0 if it cannot be spliced */
+    int64_t file_pos;
+    int64_t file_end;           /* end of the audio data, without a trailing ID3v1 tag */
+    bool next_checked;
+    int next_file;              /* pre-opened next track, -1 if none */
+    int64_t next_start;
+    int64_t next_end;
+    int64_t next_size;
+    char *next_uri;
 } fatfs_stream_t;
 
 
@@ -104,6 +116,189 @@ static char* get_mount_path(char* uri)
     return skip_scheme;
 }
 
+/* Size of the Xing, Info or VBRI frame starting an MPEG audio layer III file, 0 if there is none */
+static int _mp3_info_frame_size(const uint8_t *frame, int len)
+{
+    static const uint16_t kbps[2][15] = {
+        { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },     // MPEG 2 and 2.5
+        { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 }, // MPEG 1
+    };
+    static const uint16_t rates[3] = { 44100, 48000, 32000 };
+    int version = (frame[1] >> 3) & 0x03; // 3 MPEG 1, 2 MPEG 2, 0 MPEG 2.5
+    int bitrate = frame[2] >> 4;
+    int rate = (frame[2] >> 2) & 0x03;
+    if (((frame[1] >> 1) & 0x03) != 0x01 || version == 1 || bitrate == 0 || bitrate == 15 || rate == 3) {
+        return 0;
+    }
+    bool mpeg1 = version == 3;
+    bool mono = (frame[3] >> 6) == 0x03;
+    // the tag follows the side information, VBRI is at a fixed offset
+    int tag = 4 + ((frame[1] & 0x01) ? 0 : 2) + (mpeg1 ? (mono ? 17 : 32) : (mono ? 9 : 17));
+    bool xing = len >= tag + 4 && (memcmp(frame + tag, "Xing", 4) == 0 || memcmp(frame + tag, "Info", 4) == 0);
+    bool vbri = len >= 36 + 4 && memcmp(frame + 36, "VBRI", 4) == 0;
+    if (!xing && !vbri) {
+        return 0;
+    }
+    int sample_rate = rates[rate] >> (mpeg1 ? 0 : version == 2 ? 1 : 2);
+    return (mpeg1 ? 144000 : 72000) * kbps[mpeg1][bitrate] / sample_rate + ((frame[2] >> 1) & 0x01);
+}
+
+/* Format of a PCM WAV file and the range of its samples, 0 if it is another kind of WAV file */
+static uint32_t _wav_probe(int file, int64_t size, int64_t *start, int64_t *end)
+{
+    uint8_t chunk[24];
+    int64_t pos = 12;
+    uint32_t format = 0;
+    int len;
+    while (pos + 8 <= size && lseek(file, pos, SEEK_SET) >= 0 && (len = read(file, chunk, sizeof(chunk))) >= 8) {
+        uint32_t chunk_size = chunk[4] | chunk[5] << 8 | chunk[6] << 16 | (uint32_t)chunk[7] << 24;
+        if (memcmp(chunk, "fmt ", 4) == 0) {
+            int tag = chunk[8] | chunk[9] << 8;
+            int channels = chunk[10] | chunk[11] << 8;
+            uint32_t rate = chunk[12] | chunk[13] << 8 | chunk[14] << 16 | (uint32_t)chunk[15] << 24;
+            int bits = chunk[22] | chunk[23] << 8;
+            if (len < (int)sizeof(chunk) || chunk_size < 16 || tag != 1 || channels < 1 || channels > 2
+                || rate == 0 || rate >= (1 << 18) || bits < 8 || bits > 32 || bits % 8) {
+                return 0;
+            }
+            // sample size, channels and rate
+            format = 0x03000000 | (bits / 8 - 1) << 20 | (channels - 1) << 18 | rate;
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            if (format) {
+                *start = pos + 8;
+                *end = *start + chunk_size < size ? *start + chunk_size : size;
+            }
+            return format;
+        }
+        pos += 8 + chunk_size + (chunk_size & 1);
+    }
+    return 0;
+}
+
+/*
+ * Frame format of an MP3 or ADTS AAC file and the range of its audio data, without ID3 tags and
+ * the Xing or Info frame, or the sample format of a PCM WAV file and the range of its samples.
+ * Files of the same format can be decoded back to back as one stream. Returns 0 for other files.
+ */
+static uint32_t _gapless_probe(int file, int64_t size, int64_t *start, int64_t *end)
+{
+    uint8_t head[64];
+    *start = 0;
+    *end = size;
+    if (lseek(file, 0, SEEK_SET) < 0 || read(file, head, 12) != 12) {
+        return 0;
+    }
+    if (memcmp(head, "RIFF", 4) == 0 && memcmp(head + 8, "WAVE", 4) == 0) {
+        return _wav_probe(file, size, start, end);
+    }
+    if (memcmp(head, "ID3", 3) == 0) {
+        *start = 10 + ((head[6] & 0x7f) << 21 | (head[7] & 0x7f) << 14 | (head[8] & 0x7f) << 7 | (head[9] & 0x7f));
+        if (head[5] & 0x10) {
+            *start += 10; // footer
+        }
+    }
+    int len;
+    if (lseek(file, *start, SEEK_SET) < 0 || (len = read(file, head, sizeof(head))) < 4) {
+        return 0;
+    }
+    uint32_t format = 0;
+    if (head[0] == 0xFF && (head[1] & 0xF6) == 0xF0) {
+        // ADTS: profile, sampling frequency and channel configuration
+        format = 0x02000000 | (head[2] & 0xFD) << 8 | (head[3] & 0xC0);
+    } else if (head[0] == 0xFF && (head[1] & 0xE0) == 0xE0 && (head[1] & 0x06) && ((head[2] >> 2) & 0x03) != 0x03) {
+        // MPEG audio: version, layer, sampling frequency and mono or not
+        format = 0x01000000 | (head[1] & 0xFE) << 8 | ((head[2] >> 2) & 0x03) << 4 | ((head[3] >> 6) == 0x03);
+        // the encoder info frame decodes to a frame of silence in the middle of the stream
+        *start += _mp3_info_frame_size(head, len);
+    } else {
+        return 0;
+    }
+    if (size - 128 > *start && lseek(file, size - 128, SEEK_SET) >= 0 && read(file, head, 3) == 3 && memcmp(head, "TAG", 3) == 0) {
+        *end = size - 128;
+    }
+    return format;
+}
+
+static void _fatfs_next_close(fatfs_stream_t *fatfs)
+{
+    if (fatfs->next_file != -1) {
+        close(fatfs->next_file);
+        fatfs->next_file = -1;
+    }
+    if (fatfs->next_uri) {
+        audio_free(fatfs->next_uri);
+        fatfs->next_uri = NULL;
+    }
+}
+
+/* Ask for the next track and open it if it can be spliced to the current one */
+static void _fatfs_next_open(audio_element_handle_t self)
+{
+    fatfs_stream_t *fatfs = (fatfs_stream_t *)audio_element_getdata(self);
+    char *uri = audio_calloc(1, FATFS_STREAM_URI_MAX_LENGTH);
+    AUDIO_MEM_CHECK(TAG, uri, return);
+    fatfs_stream_event_msg_t msg = {
+        .event_id = FATFS_STREAM_NEXT_TRACK,
+        .buffer = uri,
+        .buffer_len = FATFS_STREAM_URI_MAX_LENGTH,
+        .user_data = fatfs->user_data,
+        .el = self,
+    };
+    char *path = NULL;
+    if (fatfs->event_handle(&msg) != ESP_OK || (path = get_mount_path(uri)) == NULL) {
+        goto _next_open_exit;
+    }
+    int file = open(path, O_RDONLY);
+    if (file == -1) {
+        ESP_LOGW(TAG, "Failed to open next track %s, error message: %s", path, strerror(errno));
+        goto _next_open_exit;
+    }
+    struct stat siz = { 0 };
+    stat(path, &siz);
+    int64_t start, end;
+    if (_gapless_probe(file, siz.st_size, &start, &end) != fatfs->format || lseek(file, start, SEEK_SET) < 0) {
+        ESP_LOGI(TAG, "Next track %s has another format, no gapless playback", path);
+        close(file);
+        goto _next_open_exit;
+    }
+    ESP_LOGI(TAG, "Next track pre-opened: %s", path);
+    fatfs->next_file = file;
+    fatfs->next_start = start;
+    fatfs->next_end = end;
+    fatfs->next_size = siz.st_size;
+    fatfs->next_uri = uri;
+    uri = NULL;
+_next_open_exit:
+    if (uri) {
+        audio_free(uri);
+    }
+}
+
+/* Continue with the pre-opened next track, the decoder sees one stream */
+static void _fatfs_next_splice(audio_element_handle_t self)
+{
+    fatfs_stream_t *fatfs = (fatfs_stream_t *)audio_element_getdata(self);
+    close(fatfs->file);
+    fatfs->file = fatfs->next_file;
+    fatfs->next_file = -1;
+    fatfs->file_pos = fatfs->next_start;
+    fatfs->file_end = fatfs->next_end;
+    fatfs->next_checked = false;
+    audio_element_set_uri(self, fatfs->next_uri);
+    audio_element_set_byte_pos(self, fatfs->next_start);
+    audio_element_set_total_bytes(self, fatfs->next_size);
+    ESP_LOGI(TAG, "Gapless switch to %s", fatfs->next_uri);
+    fatfs_stream_event_msg_t msg = {
+        .event_id = FATFS_STREAM_TRACK_CHANGED,
+        .buffer = fatfs->next_uri,
+        .buffer_len = strlen(fatfs->next_uri),
+        .user_data = fatfs->user_data,
+        .el = self,
+    };
+    fatfs->event_handle(&msg);
+    _fatfs_next_close(fatfs);
+}
+
 static esp_err_t _fatfs_open(audio_element_handle_t self)
 {
     fatfs_stream_t *fatfs = (fatfs_stream_t *)audio_element_getdata(self);
@@ -138,6 +333,18 @@ static esp_err_t _fatfs_open(audio_element_handle_t self)
         stat(path, &siz);
         info.total_bytes = siz.st_size;
         ESP_LOGI(TAG, "File size: %d byte, file position: %d", (int)siz.st_size, (int)info.byte_pos);
+        fatfs->format = 0;
+        fatfs->file_pos = info.byte_pos;
+        fatfs->file_end = siz.st_size;
+        fatfs->next_checked = false;
+        if (fatfs->event_handle) {
+            int64_t start;
+            fatfs->format = _gapless_probe(fatfs->file, siz.st_size, &start, &fatfs->file_end);
+            if (lseek(fatfs->file, info.byte_pos, SEEK_SET) < 0) {
+                ESP_LOGE(TAG, "Error seek file. Error message: %s, line: %d", strerror(errno), __LINE__);
+                return ESP_FAIL;
+            }
+        }
         if (info.byte_pos > 0) {
             if (lseek(fatfs->file, info.byte_pos, SEEK_SET) < 0) {
                 ESP_LOGE(TAG, "Error seek file. Error message: %s, line: %d", strerror(errno), __LINE__);
@@ -178,6 +385,19 @@ static int _fatfs_read(audio_element_handle_t self, char *buffer, int len, TickT
     audio_element_getinfo(self, &info);
 
     ESP_LOGD(TAG, "read len=%d, pos=%d/%d", len, (int)info.byte_pos, (int)info.total_bytes);
+    if (fatfs->format && !fatfs->next_checked && fatfs->file_end - fatfs->file_pos <= FATFS_STREAM_PREOPEN_BYTES) {
+        fatfs->next_checked = true;
+        _fatfs_next_open(self);
+    }
+    if (fatfs->next_file != -1) {
+        if (fatfs->file_pos >= fatfs->file_end) {
+            _fatfs_next_splice(self);
+        }
+        // a trailing tag is not passed to the decoder
+        if (fatfs->file_end - fatfs->file_pos < len) {
+            len = fatfs->file_end - fatfs->file_pos;
+        }
+    }
     /* use file descriptors to access files */
     int rlen = read(fatfs->file, buffer, len);
     if (rlen == 0) {
@@ -185,6 +405,7 @@ static int _fatfs_read(audio_element_handle_t self, char *buffer, int len, TickT
     } else if (rlen == -1) {
         ESP_LOGE(TAG, "The error is happened in reading data. Error message: %s", strerror(errno));
     } else {
+        fatfs->file_pos += rlen;
         audio_element_update_byte_pos(self, rlen);
     }
     return rlen;
@@ -246,6 +467,7 @@ static esp_err_t _fatfs_close(audio_element_handle_t self)
         close(fatfs->file);
         fatfs->is_open = false;
     }
+    _fatfs_next_close(fatfs);
     if (AEL_STATE_PAUSED != audio_element_get_state(self)) {
         audio_element_report_info(self);
         audio_element_set_byte_pos(self, 0);
@@ -285,6 +507,9 @@ audio_element_handle_t fatfs_stream_init(fatfs_stream_cfg_t *config)
     cfg.tag = "file";
     fatfs->type = config->type;
     fatfs->write_header = config->write_header;
+    fatfs->event_handle = config->type == AUDIO_STREAM_READER ? config->event_handle : NULL;
+    fatfs->user_data = config->user_data;
+    fatfs->next_file = -1;
 
     if (config->type == AUDIO_STREAM_WRITER) {
         cfg.write = _fatfs_write;
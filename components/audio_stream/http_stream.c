@@ -44,6 +44,8 @@
 #include "hls_playlist.h"
 #include "audio_idf_version.h"
 #include "gzip_miniz.h"
+#include "audio_trace.h"
+#include "audio_thread.h"
 #if (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 3, 0))
 #include "aes/esp_aes.h"
 #elif (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 1, 0))
@@ -62,6 +64,9 @@ static const char *TAG = "HTTP_STREAM";
 #define MAX_PLAYLIST_LINE_SIZE (512)
 #define HTTP_STREAM_BUFFER_SIZE (2048)
 #define HTTP_MAX_CONNECT_TIMES  (5)
+#define HTTP_TIMEOUT_MS         (30 * 1000)
+#define HTTP_ICY_META_MAX_SIZE  (255 * 16)      /* the length byte counts 16 byte blocks */
+#define HTTP_NEXT_TASK_STACK    (6 * 1024)
 
 #define HLS_PREFER_BITRATE      (200*1024)
 #define HLS_KEY_CACHE_SIZE      (32)
@@ -76,6 +81,27 @@ typedef struct {
     bool             aes_used;
 } http_stream_hls_key_t;
 
+typedef enum {
+    HTTP_NEXT_OPENING,
+    HTTP_NEXT_READY,
+    HTTP_NEXT_FAILED,
+} http_next_state_t;
+
+/* Next track pre-opened by a helper task, only the helper touches it while it is opening */
+typedef struct {
+    http_next_state_t               state;
+    bool                            abandoned;         /* let go by the reader, freed by the helper task */
+    esp_http_client_handle_t        client;
+    char                            *uri;
+    int64_t                         total_bytes;
+    esp_codec_type_t                codec_fmt;         /* from the headers of the next track */
+    esp_codec_type_t                expected_fmt;      /* of the current track */
+    char                            *prefill;          /* first bytes of the next track */
+    int                             prefill_len;
+} http_next_t;
+
+static portMUX_TYPE next_lock = portMUX_INITIALIZER_UNLOCKED;
+
 typedef struct http_stream {
     audio_stream_type_t             type;
     bool                            is_open;
@@ -103,8 +129,18 @@ typedef struct http_stream {
     int64_t                         request_range_end;
     bool                            is_last_range;
     const char                      *user_agent;
-    int icy_metaint;
-    int64_t icy_byte_pos;
+    int                             icy_metaint;       /* audio bytes between two metadata blocks, 0 without in-band metadata */
+    int                             icy_byte_pos;      /* audio bytes since the last metadata block */
+    char                            *icy_meta;         /* metadata block being read */
+    int                             icy_meta_len;
+    int                             icy_meta_left;
+    /* gapless playback of a reader */
+    bool                            next_checked;      /* next track asked for */
+    http_next_t                     *next;
+    char                            *prefill;          /* prefilled bytes not read yet */
+    int                             prefill_len;
+    int                             prefill_pos;
+    int                             skip_len;          /* bytes at the start of a spliced track the decoder must not see */
 } http_stream_t;
 
 static esp_err_t http_stream_auto_connect_next_track(audio_element_handle_t el);
@@ -150,6 +186,26 @@ static esp_codec_type_t get_audio_type(const char *content_type)
     return ESP_CODEC_TYPE_UNKNOW;
 }
 
+static esp_http_client_handle_t _http_client_init(http_stream_t *http, const char *uri, http_event_handle_cb event_handler, void *user_data)
+{
+    esp_http_client_config_t http_cfg = {
+        .url = uri,
+        .event_handler = event_handler,
+        .user_data = user_data,
+        .timeout_ms = HTTP_TIMEOUT_MS,
+        .buffer_size = HTTP_STREAM_BUFFER_SIZE,
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 1, 0)
+        .buffer_size_tx = 1024,
+#endif
+        .cert_pem = http->cert_pem,
+#if  (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 3, 0)) && defined CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
+        .crt_bundle_attach = http->crt_bundle_attach,
+#endif //  (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 3, 0)) && defined CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
+        .user_agent = http->user_agent,
+    };
+    return esp_http_client_init(&http_cfg);
+}
+
 static int _gzip_read_data(uint8_t *data, int size, void *ctx)
 {
     http_stream_t *http = (http_stream_t *) ctx;
@@ -269,6 +325,19 @@ static int _hls_uri_cb(char *uri, void *ctx)
 
 static int _http_read_data(http_stream_t *http, char *buffer, int len)
 {
+    if (http->prefill) {
+        int rlen = http->prefill_len - http->prefill_pos;
+        if (rlen > len) {
+            rlen = len;
+        }
+        memcpy(buffer, http->prefill + http->prefill_pos, rlen);
+        http->prefill_pos += rlen;
+        if (http->prefill_pos == http->prefill_len) {
+            audio_free(http->prefill);
+            http->prefill = NULL;
+        }
+        return rlen;
+    }
     if (http->gzip_encoding == false) {
         return esp_http_client_read(http->client, buffer, len);
     }
@@ -276,6 +345,72 @@ static int _http_read_data(http_stream_t *http, char *buffer, int len)
     return gzip_miniz_read(http->gzip, (uint8_t*) buffer, len);
 }
 
+/* Move the audio of the read to the front of the buffer and dispatch the metadata blocks in between */
+static int _icy_demux(audio_element_handle_t self, char *buffer, int len)
+{
+    http_stream_t *http = (http_stream_t *)audio_element_getdata(self);
+    int out = 0;
+    int i = 0;
+    while (i < len) {
+        if (http->icy_meta_left > 0) {
+            int n = len - i < http->icy_meta_left ? len - i : http->icy_meta_left;
+            if (http->icy_meta) {
+                memcpy(http->icy_meta + http->icy_meta_len, buffer + i, n);
+            }
+            http->icy_meta_len += n;
+            http->icy_meta_left -= n;
+            i += n;
+            if (http->icy_meta_left == 0 && http->icy_meta) {
+                http->icy_meta[http->icy_meta_len] = 0; // padded with zeros, the string ends before
+                if (http->icy_meta[0]) {
+                    dispatch_hook(self, HTTP_STREAM_ICY_METADATA, http->icy_meta, strlen(http->icy_meta));
+                }
+            }
+        } else if (http->icy_byte_pos < http->icy_metaint) {
+            int n = len - i < http->icy_metaint - http->icy_byte_pos ? len - i : http->icy_metaint - http->icy_byte_pos;
+            memmove(buffer + out, buffer + i, n);
+            out += n;
+            i += n;
+            http->icy_byte_pos += n;
+        } else {
+            // length byte, a zero length means no change
+            http->icy_byte_pos = 0;
+            http->icy_meta_len = 0;
+            http->icy_meta_left = (uint8_t)buffer[i++] * 16;
+            if (http->icy_meta_left > 0 && http->icy_meta == NULL) {
+                // without memory the block is skipped
+                http->icy_meta = audio_malloc(HTTP_ICY_META_MAX_SIZE + 1);
+            }
+        }
+    }
+    return out;
+}
+
+/* Read audio of the current track, in-band ICY metadata and a skipped tag are taken out */
+static int _http_read_audio(audio_element_handle_t self, char *buffer, int len)
+{
+    http_stream_t *http = (http_stream_t *)audio_element_getdata(self);
+    while (true) {
+        int rlen = _http_read_data(http, buffer, len);
+        if (rlen <= 0) {
+            return rlen;
+        }
+        if (http->icy_metaint > 0) {
+            rlen = _icy_demux(self, buffer, rlen);
+        }
+        if (http->skip_len > 0 && rlen > 0) {
+            int n = rlen < http->skip_len ? rlen : http->skip_len;
+            memmove(buffer, buffer + n, rlen - n);
+            rlen -= n;
+            http->skip_len -= n;
+        }
+        if (rlen != 0) {
+            return rlen;
+        }
+        // the whole read was metadata or skipped, 0 would end the track
+    }
+}
+
 static esp_err_t _resolve_hls_key(http_stream_t *http)
 {
     int ret = _http_read_data(http, (char*)http->hls_key->key_cache, sizeof(http->hls_key->key_cache));
@@ -504,12 +639,19 @@ static esp_err_t _http_load_uri(audio_element_handle_t self, audio_element_info_
     char *buffer = NULL;
     int post_len = esp_http_client_get_post_field(http->client, &buffer);
 _stream_redirect:
+    // set again by the icy-metaint header of the response
+    http->icy_metaint = 0;
+    http->icy_byte_pos = 0;
+    http->icy_meta_left = 0;
+    http->skip_len = 0;
     if (http->gzip_encoding) {
         gzip_miniz_deinit(http->gzip);
         http->gzip = NULL;
         http->gzip_encoding = false;
     }
-    if ((err = esp_http_client_open(http->client, post_len)) != ESP_OK) {
+    err = esp_http_client_open(http->client, post_len);
+    audio_trace_mark(AUDIO_TRACE_HTTP_CONNECTED, err);
+    if (err != ESP_OK) {
         ESP_LOGE(TAG, "Failed to open http stream");
         return err;
     }
@@ -543,7 +685,9 @@ _stream_redirect:
         audio_element_set_total_bytes(self, info->total_bytes);
     }
     int status_code = esp_http_client_get_status_code(http->client);
+    audio_trace_mark(AUDIO_TRACE_HTTP_HEADERS, status_code);
     if (status_code == 301 || status_code == 302) {
+        audio_trace_mark(AUDIO_TRACE_HTTP_REDIRECT, status_code);
         esp_http_client_set_redirection(http->client);
         goto _stream_redirect;
     }
@@ -560,6 +704,233 @@ _stream_redirect:
     return err;
 }
 
+/* Only the codec of the next track is of interest, its other headers must not change the current one */
+static esp_err_t _http_next_event_handle(esp_http_client_event_t *evt)
+{
+    http_next_t *next = (http_next_t *)evt->user_data;
+    if (evt->event_id == HTTP_EVENT_ON_HEADER && strcasecmp(evt->header_key, "Content-Type") == 0) {
+        next->codec_fmt = get_audio_type(evt->header_value);
+    } else if (evt->event_id == HTTP_EVENT_ON_HEADER && strcasecmp(evt->header_key, "Content-Encoding") == 0) {
+        next->codec_fmt = ESP_CODEC_TYPE_UNKNOW;
+    }
+    return ESP_OK;
+}
+
+static void _http_next_free(http_next_t *next)
+{
+    if (next->client) {
+        esp_http_client_close(next->client);
+        esp_http_client_cleanup(next->client);
+    }
+    if (next->uri) {
+        audio_free(next->uri);
+    }
+    if (next->prefill) {
+        audio_free(next->prefill);
+    }
+    audio_free(next);
+}
+
+/* Let go of the next track, if the helper task is still opening it, it frees it when done */
+static void _http_next_close(http_stream_t *http)
+{
+    http_next_t *next = http->next;
+    if (next == NULL) {
+        return;
+    }
+    http->next = NULL;
+    portENTER_CRITICAL(&next_lock);
+    bool opening = next->state == HTTP_NEXT_OPENING;
+    next->abandoned = opening;
+    portEXIT_CRITICAL(&next_lock);
+    if (!opening) {
+        _http_next_free(next);
+    }
+}
+
+/* Ask for the next track, uri has HTTP_STREAM_URI_MAX_LENGTH bytes */
+static bool _http_next_get(audio_element_handle_t self, char *uri)
+{
+    http_stream_t *http = (http_stream_t *)audio_element_getdata(self);
+    uri[0] = 0;
+    return http->hook && dispatch_hook(self, HTTP_STREAM_NEXT_TRACK, uri, HTTP_STREAM_URI_MAX_LENGTH) == ESP_OK && uri[0];
+}
+
+/* Limit the next blocking call to what is left of the pre-open time, false if it is used up */
+static bool _http_next_time_left(http_next_t *next, TickType_t deadline)
+{
+    TickType_t now = xTaskGetTickCount();
+    if ((int32_t)(deadline - now) <= 0) {
+        return false;
+    }
+    esp_http_client_set_timeout_ms(next->client, (deadline - now) * portTICK_PERIOD_MS);
+    return true;
+}
+
+/* Connect, follow the redirects, fetch the headers and prefill, within HTTP_STREAM_NEXT_OPEN_TIMEOUT_MS */
+static bool _http_next_connect(http_next_t *next)
+{
+    const char *uri = next->uri;
+    TickType_t deadline = xTaskGetTickCount() + pdMS_TO_TICKS(HTTP_STREAM_NEXT_OPEN_TIMEOUT_MS);
+    int status_code = 0;
+    for (int i = 0; i < HTTP_MAX_CONNECT_TIMES; i++) {
+        if (!_http_next_time_left(next, deadline)) {
+            ESP_LOGW(TAG, "Next track %s too slow to connect, no gapless playback", uri);
+            return false;
+        }
+        if (esp_http_client_open(next->client, 0) != ESP_OK) {
+            ESP_LOGW(TAG, "Failed to open next track %s", uri);
+            return false;
+        }
+        if (!_http_next_time_left(next, deadline)) {
+            ESP_LOGW(TAG, "Next track %s too slow to connect, no gapless playback", uri);
+            return false;
+        }
+        next->total_bytes = esp_http_client_fetch_headers(next->client);
+        status_code = esp_http_client_get_status_code(next->client);
+        if (status_code != 301 && status_code != 302) {
+            break;
+        }
+        esp_http_client_set_redirection(next->client);
+    }
+    if (status_code != 200) {
+        ESP_LOGW(TAG, "Next track %s not available, status code = %d", uri, status_code);
+        return false;
+    }
+    if (next->codec_fmt != next->expected_fmt) {
+        ESP_LOGI(TAG, "Next track %s has another format, no gapless playback", uri);
+        return false;
+    }
+    next->prefill = audio_malloc(HTTP_STREAM_PREFILL_SIZE);
+    AUDIO_MEM_CHECK(TAG, next->prefill, return false);
+    // a slow host fills less of the prefill, the rest is read after the switch
+    if (!_http_next_time_left(next, deadline)) {
+        ESP_LOGW(TAG, "Next track %s too slow to respond, no gapless playback", uri);
+        return false;
+    }
+    next->prefill_len = esp_http_client_read(next->client, next->prefill, HTTP_STREAM_PREFILL_SIZE);
+    if (next->prefill_len <= 0) {
+        ESP_LOGW(TAG, "No data from next track %s", uri);
+        return false;
+    }
+    // the connection stays open until the switch, the reads of the track use the usual timeout
+    esp_http_client_set_timeout_ms(next->client, HTTP_TIMEOUT_MS);
+    ESP_LOGI(TAG, "Next track pre-opened, %d bytes prefilled: %s", next->prefill_len, uri);
+    return true;
+}
+
+static void _http_next_task(void *arg)
+{
+    http_next_t *next = (http_next_t *)arg;
+    bool ready = _http_next_connect(next);
+    portENTER_CRITICAL(&next_lock);
+    bool abandoned = next->abandoned;
+    next->state = ready ? HTTP_NEXT_READY : HTTP_NEXT_FAILED;
+    portEXIT_CRITICAL(&next_lock);
+    if (abandoned) {
+        _http_next_free(next);
+    }
+    vTaskDelete(NULL);
+}
+
+/*
+ * Have the next track connected and prefilled by a helper task if it can be spliced to the current one.
+ * The reader goes on with the current track meanwhile, the name lookup and handshake cannot stall it.
+ * There is no gapless playback if the next track is not ready when the current one ends.
+ */
+static void _http_next_open(audio_element_handle_t self)
+{
+    http_stream_t *http = (http_stream_t *)audio_element_getdata(self);
+    audio_element_info_t info;
+    audio_element_getinfo(self, &info);
+    // only plain single file streams of a frame based codec can continue in the same decoder
+    if (http->is_playlist_resolved || http->hls_key || http->request_range_size || http->gzip_encoding || http->icy_metaint
+        || (info.codec_fmt != ESP_CODEC_TYPE_MP3 && info.codec_fmt != ESP_CODEC_TYPE_AAC)) {
+        return;
+    }
+    http_next_t *next = audio_calloc(1, sizeof(http_next_t));
+    AUDIO_MEM_CHECK(TAG, next, return);
+    next->uri = audio_calloc(1, HTTP_STREAM_URI_MAX_LENGTH);
+    AUDIO_MEM_CHECK(TAG, next->uri, goto _next_open_fail);
+    if (!_http_next_get(self, next->uri)) {
+        goto _next_open_fail;
+    }
+    next->state = HTTP_NEXT_OPENING;
+    next->codec_fmt = ESP_CODEC_TYPE_UNKNOW;
+    next->expected_fmt = info.codec_fmt;
+    next->client = _http_client_init(http, next->uri, _http_next_event_handle, next);
+    AUDIO_MEM_CHECK(TAG, next->client, goto _next_open_fail);
+    if (audio_thread_create(NULL, "http_next", _http_next_task, next, HTTP_NEXT_TASK_STACK,
+                            uxTaskPriorityGet(NULL), true, xPortGetCoreID()) != ESP_OK) {
+        ESP_LOGW(TAG, "Cannot create http_next task, no gapless playback");
+        goto _next_open_fail;
+    }
+    http->next = next;
+    return;
+_next_open_fail:
+    _http_next_free(next);
+}
+
+/* Size of the ID3v2 tag at the start of a track, 0 if there is none */
+static int _id3v2_size(const uint8_t *head, int len)
+{
+    if (len < 10 || memcmp(head, "ID3", 3) != 0 || ((head[6] | head[7] | head[8] | head[9]) & 0x80)) {
+        return 0;
+    }
+    int size = 10 + (head[6] << 21 | head[7] << 14 | head[8] << 7 | head[9]);
+    if (head[5] & 0x10) {
+        size += 10; // footer
+    }
+    return size;
+}
+
+/* Continue with the pre-opened next track, the decoder sees one stream */
+static bool _http_next_splice(audio_element_handle_t self)
+{
+    http_stream_t *http = (http_stream_t *)audio_element_getdata(self);
+    http_next_t *next = http->next;
+    portENTER_CRITICAL(&next_lock);
+    bool ready = next->state == HTTP_NEXT_READY;
+    portEXIT_CRITICAL(&next_lock);
+    if (!ready) {
+        ESP_LOGW(TAG, "Next track not pre-opened in time, no gapless playback");
+        _http_next_close(http);
+        return false;
+    }
+    // the controller may have replaced the next track since it was pre-opened
+    char *uri = audio_calloc(1, HTTP_STREAM_URI_MAX_LENGTH);
+    AUDIO_MEM_CHECK(TAG, uri, return false);
+    bool same = _http_next_get(self, uri) && strcmp(uri, next->uri) == 0;
+    audio_free(uri);
+    if (!same) {
+        ESP_LOGI(TAG, "Next track changed since it was pre-opened, no gapless playback");
+        _http_next_close(http);
+        return false;
+    }
+    esp_http_client_close(http->client);
+    esp_http_client_cleanup(http->client);
+    http->client = next->client;
+    next->client = NULL;
+    if (http->prefill) {
+        audio_free(http->prefill);
+    }
+    http->prefill = next->prefill;
+    http->prefill_len = next->prefill_len;
+    http->prefill_pos = 0;
+    next->prefill = NULL;
+    http->next_checked = false;
+    http->icy_metaint = 0;
+    // the tag of the next track would reach the decoder in the middle of the stream
+    http->skip_len = _id3v2_size((uint8_t *)http->prefill, http->prefill_len);
+    audio_element_set_uri(self, next->uri);
+    audio_element_set_byte_pos(self, http->skip_len);
+    audio_element_set_total_bytes(self, next->total_bytes);
+    ESP_LOGI(TAG, "Gapless switch to %s, %d bytes of ID3v2 tag skipped", next->uri, http->skip_len);
+    dispatch_hook(self, HTTP_STREAM_TRACK_CHANGED, next->uri, strlen(next->uri));
+    _http_next_close(http);
+    return true;
+}
+
 static esp_err_t _http_open(audio_element_handle_t self)
 {
     http_stream_t *http = (http_stream_t *)audio_element_getdata(self);
@@ -572,6 +943,7 @@ static esp_err_t _http_open(audio_element_handle_t self)
         return ESP_OK;
     }
     http->_errno = 0;
+    http->next_checked = false;
     audio_element_getinfo(self, &info);
 _stream_open_begin:
     if (http->hls_key && http->hls_key->key_loaded == false) {
@@ -598,25 +970,15 @@ _stream_open_begin:
     }
     
     ESP_LOGD(TAG, "URI=%s", uri);
+    audio_trace_mark(AUDIO_TRACE_HTTP_OPEN, 0);
     // if not initialize http client, initial it
     if (http->client == NULL) {
-        esp_http_client_config_t http_cfg = {
-            .url = uri,
-            .event_handler = _http_event_handle,
-            .user_data = self,
-            .timeout_ms = 30 * 1000,
-            .buffer_size = HTTP_STREAM_BUFFER_SIZE,
-#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 1, 0)
-            .buffer_size_tx = 1024,
-#endif
-            .cert_pem = http->cert_pem,
-#if  (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 3, 0)) && defined CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
-            .crt_bundle_attach = http->crt_bundle_attach,
-#endif //  (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 3, 0)) && defined CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
-            .user_agent = http->user_agent,
-        };
-        http->client = esp_http_client_init(&http_cfg);
+        http->client = _http_client_init(http, uri, _http_event_handle, self);
         AUDIO_MEM_CHECK(TAG, http->client, return ESP_ERR_NO_MEM);
+        if (http->stream_type == AUDIO_STREAM_READER) {
+            // the titles of a radio stream come in-band, the pre-opened next track does not ask for them
+            esp_http_client_set_header(http->client, "Icy-MetaData", "1");
+        }
     } else {
         esp_http_client_set_url(http->client, uri);
     }
@@ -636,7 +998,10 @@ _stream_open_begin:
             return ESP_OK;
         }
 
-        if (_resolve_playlist(self, uri) == ESP_OK) {
+        audio_trace_mark(AUDIO_TRACE_PLAYLIST_START, 0);
+        esp_err_t playlist_err = _resolve_playlist(self, uri);
+        audio_trace_mark(AUDIO_TRACE_PLAYLIST_DONE, playlist_err);
+        if (playlist_err == ESP_OK) {
             http->is_playlist_resolved = true;
             goto _stream_open_begin;
         }
@@ -644,7 +1009,9 @@ _stream_open_begin:
     // Load key and parse key
     if (http->hls_key) {
         if (http->hls_key->key_loaded == false) {
-            if (_resolve_hls_key(http) != ESP_OK) {
+            esp_err_t key_err = _resolve_hls_key(http);
+            audio_trace_mark(AUDIO_TRACE_HLS_KEY, key_err);
+            if (key_err != ESP_OK) {
                 return ESP_FAIL;
             }
             // Load media url after key loaded
@@ -656,6 +1023,7 @@ _stream_open_begin:
         }
     }
     http->is_open = true;
+    audio_trace_mark(AUDIO_TRACE_HTTP_OPENED, 0);
     audio_element_report_codec_fmt(self);
     return ESP_OK;
 }
@@ -697,6 +1065,16 @@ static esp_err_t _http_close(audio_element_handle_t self)
         gzip_miniz_deinit(http->gzip);
         http->gzip = NULL;
     }
+    _http_next_close(http);
+    if (http->prefill) {
+        audio_free(http->prefill);
+        http->prefill = NULL;
+    }
+    if (http->icy_meta) {
+        audio_free(http->icy_meta);
+        http->icy_meta = NULL;
+    }
+    http->icy_metaint = 0;
     if (http->client) {
         esp_http_client_close(http->client);
         esp_http_client_cleanup(http->client);
@@ -735,19 +1113,26 @@ static int _http_read(audio_element_handle_t self, char *buffer, int len, TickTy
     http_stream_t *http = (http_stream_t *)audio_element_getdata(self);
     audio_element_info_t info;
     audio_element_getinfo(self, &info);
+    if (!http->next_checked && info.total_bytes > 0 && info.total_bytes - info.byte_pos <= HTTP_STREAM_PREOPEN_BYTES) {
+        http->next_checked = true;
+        _http_next_open(self);
+    }
     int wrlen = dispatch_hook(self, HTTP_STREAM_ON_RESPONSE, buffer, len);
     int rlen = wrlen;
     if (rlen == 0) {
-        rlen = _http_read_data(http, buffer, len);
+        rlen = _http_read_audio(self, buffer, len);
+    }
+    if (rlen == 0 && http->next && esp_http_client_get_errno(http->client) == 0 && _http_next_splice(self)) {
+        rlen = _http_read_audio(self, buffer, len);
     }
     if (rlen <= 0 && http->request_range_size) {
         if (_check_range_done(self) == false) {
-            rlen = _http_read_data(http, buffer, len);
+            rlen = _http_read_audio(self, buffer, len);
         }
     }
     if (rlen <= 0 && http->auto_connect_next_track) {
         if (http_stream_auto_connect_next_track(self) == ESP_OK) {
-            rlen = _http_read_data(http, buffer, len);
+            rlen = _http_read_audio(self, buffer, len);
         }
     }
     if (rlen <= 0) {
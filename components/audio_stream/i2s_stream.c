@@ -64,6 +64,13 @@ typedef struct i2s_stream {
     int                 volume;
     bool                uninstall_drv;
     int                 data_bit_width;
+    bool                has_output;     /* decoded data written since open, a later input timeout is an underrun */
+    uint32_t            underruns;
+    i2s_stream_prefill_cb_t prefill_cb;
+    void               *prefill_ctx;
+    int                 prefill_max_wait_ms;
+    bool                prefilling;     /* silence is played until prefill_cb reports enough buffered data */
+    TickType_t          prefill_start;
 } i2s_stream_t;
 #ifdef SOC_I2S_SUPPORTS_ADC_DAC
 static esp_err_t i2s_mono_fix(int bits, uint8_t *sbuff, uint32_t len)
@@ -182,6 +189,9 @@ static esp_err_t _i2s_open(audio_element_handle_t self)
         ESP_LOGI(TAG, "AUDIO_STREAM_WRITER");
     }
     i2s->is_open = true;
+    i2s->has_output = false;
+    i2s->prefilling = i2s->prefill_cb != NULL;
+    i2s->prefill_start = xTaskGetTickCount();
     if (i2s->use_alc) {
         i2s->volume_handle = alc_volume_setup_open();
         if (i2s->volume_handle == NULL) {
@@ -277,13 +287,43 @@ static int _i2s_write(audio_element_handle_t self, char *buffer, int len, TickTy
     return bytes_written;
 }
 
+static bool _i2s_prefill_done(audio_element_handle_t self, i2s_stream_t *i2s)
+{
+    if (i2s->prefill_cb(self, i2s->prefill_ctx)
+        || (xTaskGetTickCount() - i2s->prefill_start) >= pdMS_TO_TICKS(i2s->prefill_max_wait_ms)) {
+        i2s->prefilling = false;
+    }
+    return !i2s->prefilling;
+}
+
 static int _i2s_process(audio_element_handle_t self, char *in_buffer, int in_len)
 {
+    i2s_stream_t *i2s = (i2s_stream_t *)audio_element_getdata(self);
+    if (i2s->prefilling && !_i2s_prefill_done(self, i2s)) {
+        // the input is not read, it keeps filling up meanwhile
+#if SOC_I2S_SUPPORTS_ADC_DAC
+        if ((i2s->config.i2s_config.mode & I2S_MODE_DAC_BUILT_IN) != 0) {
+            memset(in_buffer, 0x80, in_len);
+        } else
+#endif
+        {
+            memset(in_buffer, 0x00, in_len);
+        }
+        return audio_element_output(self, in_buffer, in_len);
+    }
     int r_size = audio_element_input(self, in_buffer, in_len);
     int w_size = 0;
-    i2s_stream_t *i2s = (i2s_stream_t *)audio_element_getdata(self);
     audio_element_info_t i2s_info = {0};
     if (r_size == AEL_IO_TIMEOUT) {
+        if (i2s->has_output) {
+            i2s->underruns++;
+            if (i2s->prefill_cb) {
+                // rebuffer before playing again
+                i2s->has_output = false;
+                i2s->prefilling = true;
+                i2s->prefill_start = xTaskGetTickCount();
+            }
+        }
 #if SOC_I2S_SUPPORTS_ADC_DAC
         if ((i2s->config.i2s_config.mode & I2S_MODE_DAC_BUILT_IN) != 0) {
             memset(in_buffer, 0x80, in_len);
@@ -303,6 +343,9 @@ static int _i2s_process(audio_element_handle_t self, char *in_buffer, int in_len
         audio_element_multi_output(self, in_buffer, r_size, 0);
         w_size = audio_element_output(self, in_buffer, r_size);
         audio_element_update_byte_pos(self, w_size);
+        if (w_size > 0) {
+            i2s->has_output = true;
+        }
     } else {
         esp_err_t ret = i2s_stream_clear_dma_buffer(self);
         if (ret != ESP_OK) {
@@ -477,6 +520,24 @@ audio_element_handle_t i2s_stream_init(i2s_stream_cfg_t *config)
     return el;
 }
 
+esp_err_t i2s_stream_set_prefill_cb(audio_element_handle_t i2s_stream, i2s_stream_prefill_cb_t cb, void *ctx, int max_wait_ms)
+{
+    i2s_stream_t *i2s = (i2s_stream_t *)audio_element_getdata(i2s_stream);
+    if (i2s->type != AUDIO_STREAM_WRITER) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    i2s->prefill_ctx = ctx;
+    i2s->prefill_max_wait_ms = max_wait_ms;
+    i2s->prefill_cb = cb;
+    return ESP_OK;
+}
+
+uint32_t i2s_stream_get_underruns(audio_element_handle_t i2s_stream)
+{
+    i2s_stream_t *i2s = (i2s_stream_t *)audio_element_getdata(i2s_stream);
+    return i2s->underruns;
+}
+
 esp_err_t i2s_stream_sync_delay(audio_element_handle_t i2s_stream, int delay_ms)
 {
     char *in_buffer = NULL;
@@ -33,6 +33,30 @@
 extern "C" {
 #endif
 
+/**
+ * @brief      FATFS Stream hook type
+ */
+typedef enum {
+    FATFS_STREAM_NEXT_TRACK = 0x01, /*!< Called by a reader near the end of the file, the handler copies the uri of the next track
+                                     * into buffer (buffer_len bytes) and returns ESP_OK to continue with it without closing the stream.
+                                     * The next file is only spliced if it is MP3, ADTS AAC or PCM WAV with the same format as the current one.
+                                     */
+    FATFS_STREAM_TRACK_CHANGED,     /*!< The reader continued with the next track, buffer is its uri */
+} fatfs_stream_event_id_t;
+
+/**
+ * @brief      Stream event message
+ */
+typedef struct {
+    fatfs_stream_event_id_t event_id;       /*!< Event ID */
+    void                    *buffer;        /*!< Event buffer */
+    int                     buffer_len;     /*!< Length of buffer */
+    void                    *user_data;     /*!< User data context, from `fatfs_stream_cfg_t` */
+    audio_element_handle_t  el;             /*!< Audio element context */
+} fatfs_stream_event_msg_t;
+
+typedef int (*fatfs_stream_event_handle_t)(fatfs_stream_event_msg_t *msg);
+
 /**
  * @brief   FATFS Stream configurations, if any entry is zero then the configuration will be set to default values
  */
@@ -45,6 +69,8 @@ typedef struct {
     int                     task_prio;      /*!< Task priority (based on freeRTOS priority) */
     bool                    ext_stack;      /*!< Allocate stack on extern ram */
     bool                    write_header;   /*!< Choose to write amrnb/amrwb header in fatfs whether or not (true or false, true means choose to write amrnb header) */
+    fatfs_stream_event_handle_t event_handle; /*!< The hook function of a reader, enables gapless playback */
+    void                    *user_data;     /*!< User data context */
 } fatfs_stream_cfg_t;
 
 
@@ -53,6 +79,8 @@ typedef struct {
 #define FATFS_STREAM_TASK_CORE           (0)
 #define FATFS_STREAM_TASK_PRIO           (4)
 #define FATFS_STREAM_RINGBUFFER_SIZE     (8 * 1024)
+#define FATFS_STREAM_PREOPEN_BYTES       (64 * 1024)   /* the next track is opened when less is left of the current one */
+#define FATFS_STREAM_URI_MAX_LENGTH      (1024)
 
 #define FATFS_STREAM_CFG_DEFAULT() {             \
     .type = AUDIO_STREAM_NONE,                   \
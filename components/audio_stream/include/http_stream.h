@@ -53,8 +53,13 @@ typedef enum {
     HTTP_STREAM_RESOLVE_ALL_TRACKS,
     HTTP_STREAM_FINISH_TRACK,
     HTTP_STREAM_FINISH_PLAYLIST,
-    HTTP_STREAM_ICY_METADATA,
+    HTTP_STREAM_ICY_METADATA,       /*!< An in-band metadata block of a radio stream, buffer holds it as a string */
     HTTP_STREAM_ICY_HEADER,
+    HTTP_STREAM_NEXT_TRACK,         /*!< Near the end of a track, the handler copies the uri of the following one to the buffer
+                                     * and returns ESP_OK to have it pre-opened. It is asked again before the switch,
+                                     * the pre-opened track is dropped if the uri changed meanwhile
+                                     */
+    HTTP_STREAM_TRACK_CHANGED,      /*!< The reader continued with the pre-opened track, buffer holds its uri */
 } http_stream_event_id_t;
 
 /**
@@ -103,6 +108,10 @@ typedef struct {
 #define HTTP_STREAM_TASK_CORE           (0)
 #define HTTP_STREAM_TASK_PRIO           (4)
 #define HTTP_STREAM_RINGBUFFER_SIZE     (20 * 1024)
+#define HTTP_STREAM_PREOPEN_BYTES       (256 * 1024)
+#define HTTP_STREAM_PREFILL_SIZE        (16 * 1024)
+#define HTTP_STREAM_NEXT_OPEN_TIMEOUT_MS (5000)  /* a helper task gives up pre-opening the next track after this */
+#define HTTP_STREAM_URI_MAX_LENGTH      (1024)
 
 #define HTTP_STREAM_CFG_DEFAULT() {              \
     .type = AUDIO_STREAM_READER,                 \
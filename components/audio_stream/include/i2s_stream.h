@@ -47,6 +47,11 @@ extern "C" {
 #define I2S_STREAM_TASK_CORE            (0)
 #define I2S_STREAM_RINGBUFFER_SIZE      (8 * 1024)
 
+/**
+ * @brief      Prefill callback of a writer stream, returns true when enough data is buffered to start playing
+ */
+typedef bool (*i2s_stream_prefill_cb_t)(audio_element_handle_t self, void *ctx);
+
 #if (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 2, 0) && ESP_IDF_VERSION < ESP_IDF_VERSION_VAL(5, 0, 0))
 
 /**
@@ -386,6 +391,35 @@ esp_err_t i2s_alc_volume_get(audio_element_handle_t i2s_stream, int *volume);
  */
 esp_err_t i2s_stream_sync_delay(audio_element_handle_t i2s_stream, int delay_ms);
 
+/**
+ * @brief      Get the number of underruns of a writer stream
+ *
+ *             An underrun is an input timeout after decoded data has already been written since the stream was opened,
+ *             silence is played instead.
+ *
+ * @param[in]  i2s_stream   The i2s element handle
+ *
+ * @return     The number of underruns since the stream was created
+ */
+uint32_t i2s_stream_get_underruns(audio_element_handle_t i2s_stream);
+
+/**
+ * @brief      Set the prefill callback of a writer stream
+ *
+ *             After open and after every underrun silence is played, without reading the input,
+ *             until the callback returns true or max_wait_ms elapsed. Set cb to NULL to play as soon as data arrives.
+ *
+ * @param[in]  i2s_stream   The i2s element handle
+ * @param[in]  cb           The prefill callback, called from the i2s task
+ * @param[in]  ctx          User context of the callback
+ * @param[in]  max_wait_ms  Playback starts after this even if the callback did not return true
+ *
+ * @return
+ *     - ESP_OK
+ *     - ESP_ERR_INVALID_ARG
+ */
+esp_err_t i2s_stream_set_prefill_cb(audio_element_handle_t i2s_stream, i2s_stream_prefill_cb_t cb, void *ctx, int max_wait_ms);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,202 @@
+#include "audio_trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#define ONCE_ALL UINT32_MAX
+
+static const char *TAG = "AUDIO_TRACE";
+
+static const char *stage_names[AUDIO_TRACE_STAGE_COUNT] = {
+    "TAP",
+    "URL_RESOLVED",
+    "PLAYER_SOURCE_SET",
+    "PLAYER_PLAY",
+    "ESP_AUDIO_PLAY",
+    "HTTP_OPEN",
+    "HTTP_CONNECTED",
+    "HTTP_HEADERS",
+    "HTTP_REDIRECT",
+    "PLAYLIST_START",
+    "PLAYLIST_DONE",
+    "HLS_KEY",
+    "HTTP_OPENED",
+    "DECODER_FIRST_OUTPUT",
+    "I2S_FIRST_WRITE",
+};
+
+static audio_trace_entry_t ring[AUDIO_TRACE_SIZE];
+static uint32_t head = 0;             // entries written so far, seq of the next entry - 1
+static uint32_t session = 0;
+static bool session_open = false;
+static int64_t session_start = 0;
+static uint32_t once_mask = ONCE_ALL; // stages already recorded by audio_trace_mark_once()
+static esp_timer_handle_t dump_timer = NULL;
+
+static void dump(bool last_session_only);
+
+static void dump_timer_cb(void *arg)
+{
+    dump(true);
+}
+
+static void record(audio_trace_stage_t stage, int32_t arg)
+{
+    uint32_t seq = __atomic_add_fetch(&head, 1, __ATOMIC_RELAXED);
+    audio_trace_entry_t *entry = &ring[(seq - 1) & (AUDIO_TRACE_SIZE - 1)];
+    __atomic_store_n(&entry->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    entry->session = __atomic_load_n(&session, __ATOMIC_RELAXED);
+    entry->stage = stage;
+    entry->arg = arg;
+    entry->time_us = esp_timer_get_time();
+    __atomic_store_n(&entry->seq, seq, __ATOMIC_RELEASE);
+}
+
+// a session which never reached the I2S is closed after a while
+static bool session_active(void)
+{
+    if (!__atomic_load_n(&session_open, __ATOMIC_ACQUIRE))
+        return false;
+    if (esp_timer_get_time() - session_start > AUDIO_TRACE_SESSION_TIMEOUT_US)
+    {
+        __atomic_store_n(&session_open, false, __ATOMIC_RELEASE);
+        __atomic_store_n(&once_mask, ONCE_ALL, __ATOMIC_RELAXED);
+        return false;
+    }
+    return true;
+}
+
+void audio_trace_start(audio_trace_stage_t stage, int32_t arg)
+{
+    if (dump_timer == NULL)
+    {
+        const esp_timer_create_args_t timer_args = {
+            .callback = dump_timer_cb,
+            .name = "audio_trace",
+        };
+        if (esp_timer_create(&timer_args, &dump_timer) != ESP_OK)
+            dump_timer = NULL;
+    }
+    session_start = esp_timer_get_time();
+    __atomic_add_fetch(&session, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&once_mask, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&session_open, true, __ATOMIC_RELEASE);
+    record(stage, arg);
+}
+
+void audio_trace_begin(audio_trace_stage_t stage, int32_t arg)
+{
+    if (session_active())
+        record(stage, arg);
+    else
+        audio_trace_start(stage, arg);
+}
+
+void audio_trace_mark(audio_trace_stage_t stage, int32_t arg)
+{
+    if (session_active())
+        record(stage, arg);
+}
+
+void audio_trace_mark_once(audio_trace_stage_t stage, int32_t arg)
+{
+    uint32_t bit = 1UL << stage;
+    if (__atomic_load_n(&once_mask, __ATOMIC_RELAXED) & bit)
+        return;
+    if (__atomic_fetch_or(&once_mask, bit, __ATOMIC_RELAXED) & bit)
+        return;
+    if (!session_active())
+        return;
+    record(stage, arg);
+    if (stage == AUDIO_TRACE_I2S_FIRST_WRITE)
+    {
+        __atomic_store_n(&once_mask, ONCE_ALL, __ATOMIC_RELAXED);
+        __atomic_store_n(&session_open, false, __ATOMIC_RELEASE);
+        // not printed from the audio task
+        if (dump_timer != NULL)
+            esp_timer_start_once(dump_timer, 0);
+    }
+}
+
+const char *audio_trace_stage_name(audio_trace_stage_t stage)
+{
+    return stage < AUDIO_TRACE_STAGE_COUNT ? stage_names[stage] : "UNKNOWN";
+}
+
+/* Copy the consistent entries of the ring, oldest first, the caller has to free them */
+static int snapshot(audio_trace_entry_t **entries)
+{
+    *entries = (audio_trace_entry_t *)malloc(AUDIO_TRACE_SIZE * sizeof(audio_trace_entry_t));
+    if (*entries == NULL)
+        return 0;
+    uint32_t last = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    uint32_t first = last > AUDIO_TRACE_SIZE ? last - AUDIO_TRACE_SIZE + 1 : 1;
+    int count = 0;
+    for (uint32_t seq = first; seq <= last; seq++)
+    {
+        audio_trace_entry_t *entry = &ring[(seq - 1) & (AUDIO_TRACE_SIZE - 1)];
+        audio_trace_entry_t copy;
+        if (__atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE) != seq)
+            continue;
+        memcpy(&copy, entry, sizeof(copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        // skip the entries overwritten while they were copied
+        if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+        (*entries)[count++] = copy;
+    }
+    return count;
+}
+
+static void dump(bool last_session_only)
+{
+    audio_trace_entry_t *entries;
+    int count = snapshot(&entries);
+    int from = 0;
+    if (last_session_only)
+    {
+        for (from = count; from > 0 && entries[from - 1].session == entries[count - 1].session; from--)
+            ;
+    }
+    int64_t start = 0;
+    for (int i = from; i < count; i++)
+    {
+        if (i == from || entries[i].session != entries[i - 1].session)
+        {
+            start = entries[i].time_us;
+            ESP_LOGI(TAG, "Session %u", entries[i].session);
+        }
+        ESP_LOGI(TAG, "  %8.3f ms  %-20s %ld", (entries[i].time_us - start) / 1000.0, audio_trace_stage_name(entries[i].stage), entries[i].arg);
+    }
+    if (entries != NULL)
+        free(entries);
+}
+
+void audio_trace_dump(void)
+{
+    dump(false);
+}
+
+int audio_trace_json(char *buffer, int buffer_size)
+{
+    audio_trace_entry_t *entries;
+    int count = snapshot(&entries);
+    int len = snprintf(buffer, buffer_size, "[");
+    int64_t start = 0;
+    for (int i = 0; i < count && len < buffer_size; i++)
+    {
+        if (i == 0 || entries[i].session != entries[i - 1].session)
+            start = entries[i].time_us;
+        len += snprintf(buffer + len, buffer_size - len, "%s{\"session\":%u,\"stage\":\"%s\",\"time_us\":%lld,\"offset_us\":%lld,\"arg\":%ld}",
+                        i > 0 ? "," : "", entries[i].session, audio_trace_stage_name(entries[i].stage), entries[i].time_us, entries[i].time_us - start, entries[i].arg);
+    }
+    if (len < buffer_size)
+        len += snprintf(buffer + len, buffer_size - len, "]");
+    if (entries != NULL)
+        free(entries);
+    return len < buffer_size ? len : -1;
+}
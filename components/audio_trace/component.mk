@@ -0,0 +1,2 @@
+COMPONENT_ADD_INCLUDEDIRS := include
+COMPONENT_SRCDIRS :=  .
\ No newline at end of file
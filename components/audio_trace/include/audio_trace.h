@@ -0,0 +1,81 @@
+#ifndef AUDIO_TRACE_H
+#define AUDIO_TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define AUDIO_TRACE_SIZE 128                    // entries in the ring, must be a power of 2
+#define AUDIO_TRACE_SESSION_TIMEOUT_US 30000000 // an unfinished session is abandoned after this
+
+/*
+ * Start-up stages of a playback, from the user action to the first samples sent to I2S.
+ * The arg of the entry is stage specific, see the comments.
+ */
+typedef enum
+{
+    AUDIO_TRACE_TAP,                  // user action in the GUI
+    AUDIO_TRACE_URL_RESOLVED,         // stream url of a station known, arg: 1 if it was cached
+    AUDIO_TRACE_PLAYER_SOURCE_SET,    // player_source_set()
+    AUDIO_TRACE_PLAYER_PLAY,          // player_play()
+    AUDIO_TRACE_ESP_AUDIO_PLAY,       // esp_audio_play() returned, arg: its result
+    AUDIO_TRACE_HTTP_OPEN,            // _http_open() of the http stream
+    AUDIO_TRACE_HTTP_CONNECTED,       // connection established (DNS, TCP and TLS), arg: result
+    AUDIO_TRACE_HTTP_HEADERS,         // response headers received, arg: status code
+    AUDIO_TRACE_HTTP_REDIRECT,        // 301/302 followed, arg: status code
+    AUDIO_TRACE_PLAYLIST_START,       // playlist (m3u, pls, HLS) resolution started
+    AUDIO_TRACE_PLAYLIST_DONE,        // playlist resolved, arg: result
+    AUDIO_TRACE_HLS_KEY,              // HLS key loaded, arg: result
+    AUDIO_TRACE_HTTP_OPENED,          // _http_open() finished, the stream is readable
+    AUDIO_TRACE_DECODER_FIRST_OUTPUT, // first decoded samples reached the I2S stream
+    AUDIO_TRACE_I2S_FIRST_WRITE,      // first decoded samples written to I2S, ends the session
+    AUDIO_TRACE_STAGE_COUNT,
+} audio_trace_stage_t;
+
+typedef struct
+{
+    uint32_t seq;     // 0 while the entry is being written
+    uint16_t session;
+    uint16_t stage;
+    int32_t arg;
+    int64_t time_us;  // esp_timer time
+} audio_trace_entry_t;
+
+/**
+ * @brief Start a new session and record its first stage
+ */
+void audio_trace_start(audio_trace_stage_t stage, int32_t arg);
+
+/**
+ * @brief Record the stage in the current session, a new session is started if there is no open one
+ *
+ * Used for the stages which can be the first of a playback, like player_source_set() without a GUI tap.
+ */
+void audio_trace_begin(audio_trace_stage_t stage, int32_t arg);
+
+/**
+ * @brief Record a stage in the current session, lock-free, can be called from any task
+ */
+void audio_trace_mark(audio_trace_stage_t stage, int32_t arg);
+
+/**
+ * @brief Record a stage only the first time it happens in the current session
+ *
+ * Cheap enough to be called for every audio buffer.
+ */
+void audio_trace_mark_once(audio_trace_stage_t stage, int32_t arg);
+
+/**
+ * @brief Print the entries of the last sessions to the serial console
+ */
+void audio_trace_dump(void);
+
+/**
+ * @brief Write the entries of the last sessions as JSON
+ *
+ * @return Length of the JSON, without the terminating zero, or -1 if the buffer is too small
+ */
+int audio_trace_json(char *buffer, int buffer_size);
+
+const char *audio_trace_stage_name(audio_trace_stage_t stage);
+
+#endif
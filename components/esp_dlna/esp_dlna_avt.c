@@ -54,8 +54,8 @@ void esp_dlna_avt_register_service(upnp_handle_t upnp)
                 {/* 2 */ .name = "CurrentURI", .val = ATTR_CB(esp_dlna_upnp_attr_cb), .type = (ATTR_CALLBACK | ATTR_RESPONSE | AVT_GET_TRACK_URI)},
                 {/* 3 */ .name = "MediaDuration", .val = ATTR_CB(esp_dlna_upnp_attr_cb), .type = (ATTR_CALLBACK | ATTR_RESPONSE | AVT_GET_MEDIA_DURATION)},
                 {/* 4 */ .name = "CurrentURIMetaData", .val = ATTR_CB(esp_dlna_upnp_attr_cb), .type = (ATTR_CALLBACK | ATTR_RESPONSE | AVT_GET_TRACK_METADATA)},
-                {/* 5 */ .name = "NextURI", .val = CONST_STR(""), .type = (ATTR_TYPE_STR | ATTR_RESPONSE | ATTR_CONST)},
-                {/* 6 */ .name = "NextURIMetaData", .val = CONST_STR(""), .type = (ATTR_TYPE_STR | ATTR_RESPONSE | ATTR_CONST)},
+                {/* 5 */ .name = "NextURI", .val = ATTR_CB(esp_dlna_upnp_attr_cb), .type = (ATTR_CALLBACK | ATTR_RESPONSE | AVT_GET_NEXT_TRACK_URI)},
+                {/* 6 */ .name = "NextURIMetaData", .val = ATTR_CB(esp_dlna_upnp_attr_cb), .type = (ATTR_CALLBACK | ATTR_RESPONSE | AVT_GET_NEXT_TRACK_METADATA)},
                 {/* 7 */ .name = "PlayMedium", .val = CONST_STR("NONE"), .type = (ATTR_TYPE_STR | ATTR_RESPONSE | ATTR_CONST)},
                 {/* 8 */ .name = "WriteStatus", .val = CONST_STR("NOT_IMPLEMENTED"), .type = (ATTR_TYPE_STR | ATTR_RESPONSE | ATTR_CONST)},
                 {/* 9 */ .name = "RecordMedium", .val = CONST_STR("NOT_IMPLEMENTED"), .type = (ATTR_TYPE_STR | ATTR_RESPONSE | ATTR_CONST)},
@@ -92,6 +92,17 @@ void esp_dlna_avt_register_service(upnp_handle_t upnp)
             },
             .callback = NULL
         },
+        {
+            .name = "SetNextAVTransportURI",
+            .num_attrs = 4,
+            .attrs = (upnp_attr_t[]) {
+                {.name = "InstanceID",},
+                {.name = "NextURI", .val = ATTR_CB(esp_dlna_upnp_attr_cb), .type = (ATTR_CALLBACK | AVT_SET_NEXT_TRACK_URI)},
+                {.name = "NextURIMetaData", .val = ATTR_CB(esp_dlna_upnp_attr_cb), .type = (ATTR_CALLBACK | AVT_SET_NEXT_TRACK_METADATA)},
+                {.name = "Dummy", .val = CONST_STR(""), .type = (ATTR_TYPE_STR | ATTR_CONST | ATTR_RESPONSE)},
+            },
+            .callback = NULL
+        },
         {.name = "Play", ONE_ATTR_CB_TYPE("Speed", esp_dlna_upnp_attr_cb, AVT_PLAY), .callback = NULL},
         {.name = "Stop", ONE_ATTR_CB_TYPE("InstanceID", esp_dlna_upnp_attr_cb, AVT_STOP), .callback = NULL},
         {.name = "Pause", ONE_ATTR_CB_TYPE("InstanceID", esp_dlna_upnp_attr_cb, AVT_PAUSE), .callback = NULL},
@@ -150,10 +161,10 @@ void esp_dlna_avt_register_service(upnp_handle_t upnp)
         // {.name = "AbsoluteCounterPosition", ONE_ATTR_CB_TYPE("val", esp_dlna_upnp_attr_cb, AVT_GET_POS_ABSCOUNT)},
         {.name = "CurrentTrack", ONE_ATTR_CB_TYPE("val", esp_dlna_upnp_attr_cb, AVT_GET_TRACK_NO)},
         // {.name = "LastChange", ONE_ATTR_CONST("val", "NOT_IMPLEMENTED")},
-        // {.name = "NextAVTransportURI", ONE_ATTR_CONST("val", "")},
+        {.name = "NextAVTransportURI", ONE_ATTR_CB_TYPE("val", esp_dlna_upnp_attr_cb, AVT_GET_NEXT_TRACK_URI)},
         // {.name = "CurrentRecordQualityMode", ONE_ATTR_CONST("val", "NOT_IMPLEMENTED")},
         // {.name = "PossibleRecordQualityModes", ONE_ATTR_CONST("val", "NOT_IMPLEMENTED")},
-        // {.name = "NextAVTransportURIMetaData", ONE_ATTR_CONST("val", "")},
+        {.name = "NextAVTransportURIMetaData", ONE_ATTR_CB_TYPE("val", esp_dlna_upnp_attr_cb, AVT_GET_NEXT_TRACK_METADATA)},
         // {.name = "PlaybackStorageMedium", ONE_ATTR_CONST("val", "NONE")},
         // {.name = "RecordMediumWriteStatus", ONE_ATTR_CONST("val", "NOT_IMPLEMENTED")},
         // {.name = "RecordStorageMedium", ONE_ATTR_CONST("val", "NOT_IMPLEMENTED")},
@@ -60,6 +60,10 @@ typedef enum {
     AVT_GET_POS_ABSTIME,        /* reqquest get track absolute time, format "hh:mm:ss" */
     AVT_GET_POS_RELCOUNT,       /* reqquest get track relative bytes count */
     AVT_GET_POS_ABSCOUNT,       /* reqquest get track absolute bytes count */
+    AVT_SET_NEXT_TRACK_URI,     /* Request set next track uri, empty to clear it */
+    AVT_SET_NEXT_TRACK_METADATA,/* Request set next track metadata */
+    AVT_GET_NEXT_TRACK_URI,     /* Request get next track uri */
+    AVT_GET_NEXT_TRACK_METADATA,/* Request get next track metadata */
 } renderer_request_type_t;
 
 typedef struct esp_dlna* esp_dlna_handle_t;
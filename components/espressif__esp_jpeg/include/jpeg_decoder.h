@@ -6,6 +6,8 @@
 
 #pragma once
 
+#include <stdint.h>
+#include <stdbool.h>
 #include "esp_err.h"
 
 #ifdef __cplusplus
@@ -77,6 +79,78 @@ typedef struct esp_jpeg_image_output_s {
  */
 esp_err_t esp_jpeg_decode(esp_jpeg_image_cfg_t *cfg, esp_jpeg_image_output_t *img);
 
+/**
+ * @brief JPEG stream input callback
+ *
+ * @param ctx: User context passed to esp_jpeg_stream_open()
+ * @param buf: Destination buffer, if NULL then len bytes have to be skipped
+ * @param len: Number of bytes requested
+ *
+ * @return Number of bytes read (or skipped), less than len only at the end of the stream
+ */
+typedef uint32_t (*esp_jpeg_read_cb_t)(void *ctx, uint8_t *buf, uint32_t len);
+
+/**
+ * @brief Streaming JPEG decoder handle
+ *
+ */
+typedef struct esp_jpeg_stream_s *esp_jpeg_stream_handle_t;
+
+/**
+ * @brief Open a streaming JPEG decoder and parse the image header
+ *
+ * @note Only the header is read from the stream, the image data is pulled by esp_jpeg_stream_decode().
+ *
+ * @param read_cb: Input callback, called from this function and from esp_jpeg_stream_decode()
+ * @param ctx: User context for read_cb
+ * @param img: Size of the source image
+ * @param handle: Decoder handle, must be closed by esp_jpeg_stream_close()
+ *
+ * @return
+ *      - ESP_OK            on success
+ *      - ESP_ERR_NO_MEM    if there is no memory for the decoder
+ *      - ESP_FAIL          if the stream is not a supported JPEG image
+ */
+esp_err_t esp_jpeg_stream_open(esp_jpeg_read_cb_t read_cb, void *ctx, esp_jpeg_image_output_t *img, esp_jpeg_stream_handle_t *handle);
+
+/**
+ * @brief Largest decoder descaling which still covers the box
+ *
+ * @param width: Width of the source image
+ * @param height: Height of the source image
+ * @param box_width: Width of the target box
+ * @param box_height: Height of the target box
+ *
+ * @return Scale to use, JPEG_IMAGE_SCALE_0 if the source is not bigger than twice the box
+ */
+esp_jpeg_image_scale_t esp_jpeg_scale_for_box(uint16_t width, uint16_t height, uint16_t box_width, uint16_t box_height);
+
+/**
+ * @brief Decode the image and scale it into an RGB565 output buffer
+ *
+ * @note The image is decoded with the largest 1/2, 1/4 or 1/8 descaling which still covers the output size
+ *       (see esp_jpeg_scale_for_box()), the remaining resize is done by a nearest neighbour scaler
+ *       straight into outbuf, no full size image is allocated.
+ *
+ * @param handle: Decoder handle from esp_jpeg_stream_open()
+ * @param outbuf: Output buffer, at least out_width * out_height * 2 bytes
+ * @param out_width: Width of the output image
+ * @param out_height: Height of the output image
+ * @param swap_color_bytes: Swap first and last color bytes
+ *
+ * @return
+ *      - ESP_OK            on success
+ *      - ESP_FAIL          if there is an error in decoding JPEG
+ */
+esp_err_t esp_jpeg_stream_decode(esp_jpeg_stream_handle_t handle, uint8_t *outbuf, uint16_t out_width, uint16_t out_height, bool swap_color_bytes);
+
+/**
+ * @brief Close the streaming JPEG decoder
+ *
+ * @param handle: Decoder handle, NULL is ignored
+ */
+void esp_jpeg_stream_close(esp_jpeg_stream_handle_t handle);
+
 #ifdef __cplusplus
 }
 #endif
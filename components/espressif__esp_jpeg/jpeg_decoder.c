@@ -76,6 +76,24 @@ static uint8_t jpeg_get_color_bytes(esp_jpeg_image_format_t format);
 
 static unsigned int jpeg_decode_in_cb(JDEC *jd, uint8_t *buff, unsigned int nbyte);
 static jpeg_decode_out_t jpeg_decode_out_cb(JDEC *jd, void *bitmap, JRECT *rect);
+static unsigned int jpeg_stream_in_cb(JDEC *jd, uint8_t *buff, unsigned int nbyte);
+static jpeg_decode_out_t jpeg_stream_out_cb(JDEC *jd, void *bitmap, JRECT *rect);
+
+/* Streaming decoder, the output is scaled straight into the caller's buffer */
+struct esp_jpeg_stream_s {
+    JDEC jdec;                  /* TJPGD decoder, jdec.device points back to this struct */
+    uint8_t *workbuf;           /* TJPGD work buffer */
+    esp_jpeg_read_cb_t read_cb; /* Input callback */
+    void *read_ctx;             /* Input callback context */
+    uint16_t *outbuf;           /* RGB565 output buffer */
+    uint16_t out_width;         /* Output image width */
+    uint16_t out_height;        /* Output image height */
+    uint16_t src_width;         /* Descaled source image width */
+    uint16_t src_height;        /* Descaled source image height */
+    uint16_t *x_map;            /* Source (descaled) column of each output column */
+    uint16_t *y_map;            /* Source (descaled) row of each output row */
+    bool swap_color_bytes;      /* Swap first and last color bytes */
+};
 /*******************************************************************************
  * Public API functions
  *******************************************************************************/
@@ -136,6 +154,118 @@ err:
     return ret;
 }
 
+esp_err_t esp_jpeg_stream_open(esp_jpeg_read_cb_t read_cb, void *ctx, esp_jpeg_image_output_t *img, esp_jpeg_stream_handle_t *handle)
+{
+    esp_err_t ret = ESP_OK;
+    JRESULT res;
+
+    assert(read_cb != NULL);
+    assert(img != NULL);
+    assert(handle != NULL);
+
+    struct esp_jpeg_stream_s *stream = calloc(1, sizeof(struct esp_jpeg_stream_s));
+    ESP_GOTO_ON_FALSE(stream, ESP_ERR_NO_MEM, err, TAG, "no mem for JPEG stream");
+    stream->workbuf = heap_caps_malloc(JPEG_WORK_BUF_SIZE, MALLOC_CAP_DEFAULT);
+    ESP_GOTO_ON_FALSE(stream->workbuf, ESP_ERR_NO_MEM, err, TAG, "no mem for JPEG work buffer");
+    stream->read_cb = read_cb;
+    stream->read_ctx = ctx;
+
+    /* Prepare image, only the header is consumed from the stream */
+    res = jd_prepare(&stream->jdec, jpeg_stream_in_cb, stream->workbuf, JPEG_WORK_BUF_SIZE, stream);
+    ESP_LOGD(TAG, "Prepare image result: %s", jpeg_prepare_result_names[res]);
+    ESP_GOTO_ON_FALSE((res == JDR_OK), ESP_FAIL, err, TAG, "Error in preparing JPEG image!");
+
+    img->width = stream->jdec.width;
+    img->height = stream->jdec.height;
+    *handle = stream;
+    return ESP_OK;
+
+err:
+    esp_jpeg_stream_close(stream);
+    *handle = NULL;
+    return ret;
+}
+
+esp_jpeg_image_scale_t esp_jpeg_scale_for_box(uint16_t width, uint16_t height, uint16_t box_width, uint16_t box_height)
+{
+    esp_jpeg_image_scale_t scale = JPEG_IMAGE_SCALE_0;
+#if !defined(JD_USE_SCALE) || JD_USE_SCALE
+    /* Largest TJPGD descaling which still covers the box, the rest is done by the output scaler */
+    while (scale < JPEG_IMAGE_SCALE_1_8 &&
+            (width >> (scale + 1)) >= box_width &&
+            (height >> (scale + 1)) >= box_height)
+    {
+        scale++;
+    }
+#endif
+    return scale;
+}
+
+/* Size of the image produced by TJPGD with descaling, each MCU is rounded down separately */
+static uint16_t jpeg_descaled_size(uint16_t size, uint16_t mcu_size, esp_jpeg_image_scale_t scale)
+{
+    return (size / mcu_size) * (mcu_size >> scale) + ((size % mcu_size) >> scale);
+}
+
+esp_err_t esp_jpeg_stream_decode(esp_jpeg_stream_handle_t handle, uint8_t *outbuf, uint16_t out_width, uint16_t out_height, bool swap_color_bytes)
+{
+    esp_err_t ret = ESP_OK;
+
+    assert(handle != NULL);
+    assert(outbuf != NULL);
+    ESP_RETURN_ON_FALSE(out_width > 0 && out_height > 0, ESP_ERR_INVALID_ARG, TAG, "Invalid output size");
+
+    esp_jpeg_image_scale_t scale = esp_jpeg_scale_for_box(handle->jdec.width, handle->jdec.height, out_width, out_height);
+    uint16_t src_width = jpeg_descaled_size(handle->jdec.width, handle->jdec.msx * 8, scale);
+    uint16_t src_height = jpeg_descaled_size(handle->jdec.height, handle->jdec.msy * 8, scale);
+    ESP_RETURN_ON_FALSE(src_width > 0 && src_height > 0, ESP_FAIL, TAG, "Invalid JPEG size");
+    ESP_LOGD(TAG, "Stream decode %dx%d -> 1/%d -> %dx%d", handle->jdec.width, handle->jdec.height,
+             jpeg_get_div_by_scale(scale), out_width, out_height);
+
+    handle->outbuf = (uint16_t *)outbuf;
+    handle->out_width = out_width;
+    handle->out_height = out_height;
+    handle->src_width = src_width;
+    handle->src_height = src_height;
+    handle->swap_color_bytes = swap_color_bytes;
+
+    /* Separable nearest neighbour scaler, the source index of each output row / column is computed only once */
+    handle->x_map = (uint16_t *)malloc(out_width * sizeof(uint16_t));
+    handle->y_map = (uint16_t *)malloc(out_height * sizeof(uint16_t));
+    ESP_GOTO_ON_FALSE(handle->x_map && handle->y_map, ESP_ERR_NO_MEM, err, TAG, "No mem for scaler tables");
+    for (uint32_t x = 0; x < out_width; x++)
+    {
+        handle->x_map[x] = x * src_width / out_width;
+    }
+    for (uint32_t y = 0; y < out_height; y++)
+    {
+        handle->y_map[y] = y * src_height / out_height;
+    }
+
+    JRESULT res = jd_decomp(&handle->jdec, jpeg_stream_out_cb, scale);
+    ESP_GOTO_ON_FALSE((res == JDR_OK), ESP_FAIL, err, TAG, "Error in decoding JPEG image!");
+
+err:
+    free(handle->x_map);
+    free(handle->y_map);
+    handle->x_map = NULL;
+    handle->y_map = NULL;
+    return ret;
+}
+
+void esp_jpeg_stream_close(esp_jpeg_stream_handle_t handle)
+{
+    if (handle == NULL)
+    {
+        return;
+    }
+    if (handle->workbuf)
+    {
+        free(handle->workbuf);
+    }
+    free(handle);
+}
+
 /*******************************************************************************
  * Private API functions
  *******************************************************************************/
@@ -236,6 +366,62 @@ static jpeg_decode_out_t jpeg_decode_out_cb(JDEC *dec, void *bitmap, JRECT *rect
     return 1;
 }
 
+static unsigned int jpeg_stream_in_cb(JDEC *dec, uint8_t *buff, unsigned int nbyte)
+{
+    assert(dec != NULL);
+
+    struct esp_jpeg_stream_s *stream = (struct esp_jpeg_stream_s *)dec->device;
+    assert(stream != NULL);
+
+    return stream->read_cb(stream->read_ctx, buff, nbyte);
+}
+
+static inline uint16_t jpeg_pixel_to_rgb565(const uint8_t *in, bool swap)
+{
+    uint16_t color;
+#if (JD_FORMAT == 1)
+    color = in[0] | (in[1] << 8);
+#else
+    color = ((in[0] & 0xF8) << 8);
+    color |= ((in[1] & 0xFC) << 3);
+    color |= (in[2] >> 3);
+#endif
+    return swap ? (color >> 8) | (color << 8) : color;
+}
+
+static jpeg_decode_out_t jpeg_stream_out_cb(JDEC *dec, void *bitmap, JRECT *rect)
+{
+    assert(dec != NULL);
+
+    struct esp_jpeg_stream_s *stream = (struct esp_jpeg_stream_s *)dec->device;
+    assert(stream != NULL);
+    assert(bitmap != NULL);
+    assert(rect != NULL);
+
+    const uint16_t *x_map = stream->x_map;
+    const uint16_t *y_map = stream->y_map;
+    uint32_t out_w = stream->out_width;
+    uint32_t out_h = stream->out_height;
+    uint32_t rect_w = rect->right - rect->left + 1;
+    const uint8_t *in = (const uint8_t *)bitmap;
+
+    /* First output row / column which samples from this block */
+    uint32_t dx_start = (rect->left * out_w + stream->src_width - 1) / stream->src_width;
+    uint32_t dy = (rect->top * out_h + stream->src_height - 1) / stream->src_height;
+
+    for (; dy < out_h && y_map[dy] <= rect->bottom; dy++)
+    {
+        uint16_t *dst = stream->outbuf + dy * out_w;
+        const uint8_t *row = in + (y_map[dy] - rect->top) * rect_w * ESP_JPEG_COLOR_BYTES;
+        for (uint32_t dx = dx_start; dx < out_w && x_map[dx] <= rect->right; dx++)
+        {
+            dst[dx] = jpeg_pixel_to_rgb565(row + (x_map[dx] - rect->left) * ESP_JPEG_COLOR_BYTES, stream->swap_color_bytes);
+        }
+    }
+
+    return 1;
+}
+
 static uint8_t jpeg_get_div_by_scale(esp_jpeg_image_scale_t scale)
 {
     switch (scale)
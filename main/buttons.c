@@ -1,5 +1,6 @@
 #include "buttons.h"
 #include "board_def.h"
+#include "player.h"
 
 #include "esp_log.h"
 #include "input_key_service.h"
@@ -20,30 +21,25 @@ static esp_err_t input_key_service_cb(periph_service_handle_t handle, periph_ser
         {
         case INPUT_KEY_USER_ID_PLAY:
             ESP_LOGD(TAG, "[ * ] [Play] KEY %s", key_types[evt->type]);
-            esp_audio_state_t state = {0};
-            esp_audio_state_get(player, &state);
-            if (state.status == AUDIO_STATUS_PAUSED)
+            player_state_t state = player_state_get();
+            if (state == MP_STATE_PAUSED)
             {
-                esp_audio_resume(player);
-                // esp_dlna_notify_avt_by_action(dlna_handle, "TransportState");
+                player_play();
             }
-            else if (state.status == AUDIO_STATUS_RUNNING)
+            else if (state == MP_STATE_PLAYING)
             {
-                esp_audio_pause(player);
-                // esp_dlna_notify_avt_by_action(dlna_handle, "TransportState");
+                player_pause();
             }
             break;
         case INPUT_KEY_USER_ID_VOLDOWN:
             ESP_LOGD(TAG, "[ * ] [Vol-] KEY %s", key_types[evt->type]);
-            esp_audio_vol_get(player, &volume);
-            volume = volume - 5 < 0 ? 0 : volume - 5;
-            esp_audio_vol_set(player, volume);
+            player_volume_get(&volume);
+            player_volume_set(volume - 5 < 0 ? 0 : volume - 5);
             break;
         case INPUT_KEY_USER_ID_VOLUP:
             ESP_LOGD(TAG, "[ * ] [Vol+] KEY %s", key_types[evt->type]);
-            esp_audio_vol_get(player, &volume);
-            volume = volume + 5 > 100 ? 100 : volume + 5;
-            esp_audio_vol_set(player, volume);
+            player_volume_get(&volume);
+            player_volume_set(volume + 5 > 100 ? 100 : volume + 5);
             break;
         case INPUT_KEY_USER_ID_MUTE:
             ESP_LOGD(TAG, "[ * ] [MUTE] KEY %s", key_types[evt->type]);
@@ -0,0 +1,308 @@
+#include "didl_parser.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include "esp_log.h"
+#include "esp_check.h"
+
+#define DURATION_MAX_HOURS ((INT_MAX / 1000 - 3599) / 3600) // the duration is returned in ms
+
+typedef enum
+{
+    FIELD_NONE = -1,
+    FIELD_TITLE,
+    FIELD_ALBUM,
+    FIELD_ARTIST,
+    FIELD_ALBUM_ART_URI,
+    FIELD_DURATION,
+    FIELD_RES,
+    FIELD_COUNT,
+} field_t;
+
+/* local names, the namespace prefixes vary between the control points */
+static const char *field_names[FIELD_COUNT] = {
+    "title",
+    "album",
+    "artist",
+    "albumArtURI",
+    "duration",
+    "res",
+};
+
+typedef struct
+{
+    char *out; // next free byte of the arena
+    char *end;
+    const char *values[FIELD_COUNT];
+    bool res_seen;
+    didl_item_t *item;
+} parser_t;
+
+static const char *TAG = "DIDL_PARSER";
+static const char *SPACES = " \t\r\n";
+
+static field_t field_find(const char *name, int len)
+{
+    const char *colon = memchr(name, ':', len);
+    if (colon != NULL)
+    {
+        len -= colon + 1 - name;
+        name = colon + 1;
+    }
+    for (int i = 0; i < FIELD_COUNT; i++)
+    {
+        if (strncmp(field_names[i], name, len) == 0 && field_names[i][len] == 0)
+            return i;
+    }
+    return FIELD_NONE;
+}
+
+static void out_append(parser_t *parser, char c)
+{
+    if (parser->out < parser->end)
+        *parser->out++ = c;
+}
+
+static void out_append_utf8(parser_t *parser, uint32_t code)
+{
+    if (code < 0x80)
+    {
+        out_append(parser, code);
+    }
+    else if (code < 0x800)
+    {
+        out_append(parser, 0xC0 | (code >> 6));
+        out_append(parser, 0x80 | (code & 0x3F));
+    }
+    else if (code < 0x10000)
+    {
+        out_append(parser, 0xE0 | (code >> 12));
+        out_append(parser, 0x80 | ((code >> 6) & 0x3F));
+        out_append(parser, 0x80 | (code & 0x3F));
+    }
+    else if (code < 0x110000)
+    {
+        out_append(parser, 0xF0 | (code >> 18));
+        out_append(parser, 0x80 | ((code >> 12) & 0x3F));
+        out_append(parser, 0x80 | ((code >> 6) & 0x3F));
+        out_append(parser, 0x80 | (code & 0x3F));
+    }
+}
+
+// p points to '&', returns the position after the entity, unknown ones are copied as they are
+static const char *entity_decode(parser_t *parser, const char *p)
+{
+    static const struct
+    {
+        const char *name;
+        char c;
+    } entities[] = {{"amp;", '&'}, {"lt;", '<'}, {"gt;", '>'}, {"quot;", '"'}, {"apos;", '\''}};
+
+    if (p[1] == '#')
+    {
+        char *end;
+        bool hex = p[2] == 'x' || p[2] == 'X';
+        uint32_t code = strtoul(p + (hex ? 3 : 2), &end, hex ? 16 : 10);
+        if (*end == ';' && end > p + (hex ? 3 : 2))
+        {
+            out_append_utf8(parser, code);
+            return end + 1;
+        }
+    }
+    else
+    {
+        for (int i = 0; i < sizeof(entities) / sizeof(entities[0]); i++)
+        {
+            int len = strlen(entities[i].name);
+            if (strncmp(p + 1, entities[i].name, len) == 0)
+            {
+                out_append(parser, entities[i].c);
+                return p + 1 + len;
+            }
+        }
+    }
+    out_append(parser, '&');
+    return p + 1;
+}
+
+/*
+ * Copies the decoded text up to the next tag, or the attribute value up to quote, into the arena.
+ * Returns the position of the terminator.
+ */
+static const char *value_copy(parser_t *parser, const char *p, char quote, const char **value)
+{
+    *value = parser->out;
+    while (*p != 0)
+    {
+        if (quote == '<' && strncmp(p, "<![CDATA[", 9) == 0)
+        {
+            const char *end = strstr(p + 9, "]]>");
+            if (end == NULL)
+                end = p + strlen(p);
+            for (p += 9; p < end; p++)
+                out_append(parser, *p);
+            p = *end == 0 ? end : end + 3;
+        }
+        else if (*p == quote)
+        {
+            break;
+        }
+        else if (*p == '&')
+        {
+            p = entity_decode(parser, p);
+        }
+        else
+        {
+            out_append(parser, *p++);
+        }
+    }
+    out_append(parser, 0);
+    return p;
+}
+
+// "H+:MM:SS[.F+]" in ms, -1 if invalid
+static int duration_parse(const char *value)
+{
+    char *end;
+    long hours = strtol(value, &end, 10);
+    if (end == value || *end != ':' || hours < 0 || hours > DURATION_MAX_HOURS)
+        return -1;
+    long minutes = strtol(end + 1, &end, 10);
+    if (*end != ':' || minutes < 0 || minutes > 59)
+        return -1;
+    long seconds = strtol(end + 1, &end, 10);
+    if (seconds < 0 || seconds > 59)
+        return -1;
+    int ms = 0;
+    if (*end == '.')
+    {
+        // only the first three digits of the fraction count
+        int scale = 100;
+        for (end++; *end >= '0' && *end <= '9' && scale > 0; end++, scale /= 10)
+            ms += (*end - '0') * scale;
+    }
+    return ((hours * 60 + minutes) * 60 + seconds) * 1000 + ms;
+}
+
+static void res_attribute_set(parser_t *parser, const char *name, int len, const char *value)
+{
+    didl_item_t *item = parser->item;
+    if (len == 12 && strncmp(name, "protocolInfo", len) == 0)
+        item->protocol_info = value;
+    else if (len == 8 && strncmp(name, "duration", len) == 0)
+        item->duration = duration_parse(value);
+    else if (len == 7 && strncmp(name, "bitrate", len) == 0)
+        item->bitrate = atoi(value);
+    else if (len == 4 && strncmp(name, "size", len) == 0)
+        item->size = strtoll(value, NULL, 10);
+}
+
+// p points after the element name, returns the position of '>' or '/>', NULL at the end of the document
+static const char *attributes_parse(parser_t *parser, const char *p, bool capture)
+{
+    while (true)
+    {
+        p += strspn(p, SPACES);
+        if (*p == '>' || *p == '/' || *p == 0)
+            return *p == 0 ? NULL : p;
+        const char *name = p;
+        p += strcspn(p, " \t\r\n=/>");
+        int len = p - name;
+        p += strspn(p, SPACES);
+        if (*p != '=')
+            continue; // attribute without value
+        p += 1 + strspn(p + 1, SPACES);
+        char quote = *p;
+        if (quote != '"' && quote != '\'')
+            continue;
+        p++;
+        if (capture)
+        {
+            const char *value;
+            p = value_copy(parser, p, quote, &value);
+            res_attribute_set(parser, name, len, value);
+        }
+        else
+        {
+            const char *end = strchr(p, quote);
+            p = end == NULL ? p + strlen(p) : end;
+        }
+        if (*p == 0)
+            return NULL;
+        p++;
+    }
+}
+
+esp_err_t didl_parse(const char *xml, didl_item_t *item)
+{
+    memset(item, 0, sizeof(didl_item_t));
+    item->duration = -1;
+    item->bitrate = -1;
+    item->size = -1;
+    ESP_RETURN_ON_FALSE(xml != NULL, ESP_ERR_INVALID_ARG, TAG, "No DIDL-Lite document");
+
+    // decoded values are never longer than their source, with the terminators they fit into the document size
+    int size = strlen(xml) + 1;
+    item->arena = (char *)malloc(size);
+    ESP_RETURN_ON_FALSE(item->arena != NULL, ESP_ERR_NO_MEM, TAG, "Cannot allocate %d bytes for DIDL-Lite values", size);
+    parser_t parser = {
+        .out = item->arena,
+        .end = item->arena + size,
+        .item = item,
+    };
+
+    const char *p = xml;
+    while (p != NULL && (p = strchr(p, '<')) != NULL)
+    {
+        if (strncmp(p, "<!--", 4) == 0)
+        {
+            p = strstr(p + 4, "-->");
+            continue;
+        }
+        if (p[1] == '/' || p[1] == '?' || p[1] == '!')
+        {
+            // values are read after their start tag
+            p = strchr(p + 1, '>');
+            continue;
+        }
+
+        const char *name = ++p;
+        p += strcspn(p, " \t\r\n/>");
+        field_t field = field_find(name, p - name);
+        bool first_res = field == FIELD_RES && !parser.res_seen;
+        if (field == FIELD_RES)
+            parser.res_seen = true;
+        p = attributes_parse(&parser, p, first_res);
+        if (p == NULL)
+            break;
+        bool empty = *p == '/';
+        p = strchr(p, '>');
+        if (p == NULL)
+            break;
+        p++;
+        if (empty || field == FIELD_NONE || parser.values[field] != NULL || (field == FIELD_RES && !first_res))
+            continue;
+        p = value_copy(&parser, p, '<', &parser.values[field]);
+    }
+
+    item->title = parser.values[FIELD_TITLE];
+    item->album = parser.values[FIELD_ALBUM];
+    item->artist = parser.values[FIELD_ARTIST];
+    item->album_art_uri = parser.values[FIELD_ALBUM_ART_URI];
+    item->res = parser.values[FIELD_RES];
+    if (item->duration < 0 && parser.values[FIELD_DURATION] != NULL)
+        item->duration = duration_parse(parser.values[FIELD_DURATION]);
+    ESP_LOGD(TAG, "title = %s, album = %s, artist = %s, duration = %d ms, protocol info = %s, bitrate = %d, size = %lld",
+             item->title ? item->title : "", item->album ? item->album : "", item->artist ? item->artist : "",
+             item->duration, item->protocol_info ? item->protocol_info : "", item->bitrate, item->size);
+    return ESP_OK;
+}
+
+void didl_item_free(didl_item_t *item)
+{
+    if (item->arena != NULL)
+        free(item->arena);
+    memset(item, 0, sizeof(didl_item_t));
+}
@@ -7,7 +7,7 @@
 #include "driver/ledc.h"
 
 #include "http_client.h"
-#include "img_download.h"
+#include "img_loader.h"
 #include "player.h"
 #include "tunein_browser.h"
 #include "dlna.h"
@@ -31,6 +31,8 @@ static int32_t audio_time = 0;
 static lv_obj_t *home_tab;
 
 static char *album_art_url = NULL;
+static uint32_t album_art_generation = 0; // the loaded image is shown only if it is still the latest request
+static uint32_t metadata_version = 0;     // of the shown metadata snapshot
 static lv_obj_t *canvas;
 static void *canvas_buffer;
 
@@ -92,7 +94,7 @@ static void button_event_handler(lv_event_t *e)
         if (target == ctrl_btn_mtrx)
         {
             id = lv_btnmatrix_get_selected_btn(target);
-            if (id == 0 && player_source_get()->type == MP_SOURCE_TYPE_SD_CARD)
+            if (id == 0 && player_source_type_get() == MP_SOURCE_TYPE_SD_CARD)
                 sd_card_browser_prev();
             if (id == 1)
                 player_stop();
@@ -103,12 +105,50 @@ static void button_event_handler(lv_event_t *e)
                 else
                     player_play();
             }
-            if (id == 3 && player_source_get()->type == MP_SOURCE_TYPE_SD_CARD)
+            if (id == 3 && player_source_type_get() == MP_SOURCE_TYPE_SD_CARD)
                 sd_card_browser_next();
         }
     }
 }
 
+static void album_art_clear(void)
+{
+    if (canvas != NULL)
+    {
+        lv_obj_del(canvas);
+        canvas = NULL;
+    }
+    if (canvas_buffer != NULL)
+    {
+        free(canvas_buffer);
+        canvas_buffer = NULL;
+    }
+}
+
+// called from an image loader worker with the LVGL port locked
+static void album_art_loaded_cb(esp_err_t ret, lv_img_dsc_t *img, uint32_t group, void *user_data)
+{
+    if ((uint32_t)(uintptr_t)user_data != album_art_generation)
+    {
+        ESP_LOGD(TAG, "Album art superseded while it was downloaded");
+        if (ret == ESP_OK)
+            free((void *)img->data);
+        return;
+    }
+    if (ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Cannot download album art %s", album_art_url);
+        return;
+    }
+    // decoded image is already scaled to the canvas size
+    album_art_clear();
+    canvas_buffer = (void *)img->data;
+    canvas = lv_canvas_create(home_tab);
+    lv_canvas_set_buffer(canvas, canvas_buffer, img->header.w, img->header.h, LV_IMG_CF_TRUE_COLOR);
+    lv_obj_align(canvas, LV_ALIGN_TOP_MID, 0, 16);
+}
+
+/* Queue the download of the album art, a previous request still queued or being downloaded is superseded */
 static esp_err_t show_album_art(char *url)
 {
     // if not changed or still invalid, do nothing
@@ -128,41 +168,15 @@ static esp_err_t show_album_art(char *url)
     {
         album_art_url = strdup(url);
     }
-    esp_err_t ret = ESP_OK;
-    if (canvas != NULL)
-    {
-        lv_obj_del(canvas);
-        canvas = NULL;
-    }
-    if (canvas_buffer != NULL)
-    {
-        free(canvas_buffer);
-        canvas_buffer = NULL;
-    }
+    album_art_generation++;
+    img_loader_cancel(IMG_LOADER_GROUP_ALBUM_ART);
+    // the previous cover is not left with the new title
+    album_art_clear();
     ESP_RETURN_ON_FALSE(url != NULL && strlen(url) > 7, ESP_ERR_INVALID_ARG, TAG, "Invalid or NULL image URL");
 
-    lv_img_dsc_t cover_art_image = {
-        .data = NULL,
-    };
-    ret = download_image(url, &cover_art_image);
-    ESP_GOTO_ON_ERROR(ret, err, TAG, "Cannot download image");
-
-    int h_zoom = (UI_MEDIA_ALBUM_ART_WIDTH * LV_IMG_ZOOM_NONE) / cover_art_image.header.w;
-    int v_zoom = (UI_MEDIA_ALBUM_ART_HIGHT * LV_IMG_ZOOM_NONE) / cover_art_image.header.h;
-    uint16_t zoom = h_zoom < v_zoom ? h_zoom : v_zoom;
-    int h_size = (cover_art_image.header.w * zoom) / LV_IMG_ZOOM_NONE;
-    int v_size = (cover_art_image.header.h * zoom) / LV_IMG_ZOOM_NONE;
-
-    canvas_buffer = (void *)malloc(h_size * v_size * sizeof(uint16_t));
-    ESP_GOTO_ON_FALSE(canvas_buffer != NULL, ESP_ERR_NO_MEM, err, TAG, "Cannot allocate memmory for canvas buffer");
-
-    canvas = lv_canvas_create(home_tab);
-    lv_canvas_set_buffer(canvas, canvas_buffer, h_size, v_size, LV_IMG_CF_TRUE_COLOR);
-    lv_canvas_transform(canvas, &cover_art_image, 0, zoom, 0, 0, 0, 0, false);
-    lv_obj_align(canvas, LV_ALIGN_TOP_MID, 0, 16);
-err:
-    if (cover_art_image.data)
-        free(cover_art_image.data);
+    esp_err_t ret = img_loader_request(url, UI_MEDIA_ALBUM_ART_WIDTH, UI_MEDIA_ALBUM_ART_HIGHT, IMG_LOADER_PRIORITY_HIGH,
+                                       IMG_LOADER_GROUP_ALBUM_ART, album_art_loaded_cb, (void *)(uintptr_t)album_art_generation);
+    ESP_RETURN_ON_ERROR(ret, TAG, "Cannot queue album art download");
     return ret;
 }
 
@@ -174,7 +188,9 @@ static void mute_set(bool mute)
 static void set_audio_time(int32_t time)
 {
     audio_time = time;
-    lv_slider_set_value(audio_time_slider, time, LV_ANIM_ON);
+    // the seek is applied after the drag, the knob stays under the finger meanwhile
+    if (!lv_obj_has_state(audio_time_slider, LV_STATE_PRESSED))
+        lv_slider_set_value(audio_time_slider, time, LV_ANIM_ON);
     lv_label_set_text_fmt(audio_time_label, "%02ld:%02ld:%02ld", time / 3600, (time % 3600) / 60, time % 60);
 }
 
@@ -254,16 +270,39 @@ static void timer_handle(lv_timer_t *timer)
     }
 }
 
+/* Updates the fields of the labels which changed since the last shown version */
+static void metadata_show(void)
+{
+    const metadata_snapshot_t *snapshot = metadata_snapshot_get();
+    if (snapshot == NULL)
+        return;
+    uint32_t changes = metadata_snapshot_changes(snapshot, metadata_version);
+    metadata_version = snapshot->version;
+    if (METADATA_CHANGED(changes, METADATA_FIELD_TITLE))
+    {
+        lv_label_set_text(audio_title_label, snapshot->title == NULL ? "..." : snapshot->title);
+        // a gapless track change only shows up here
+        int time = 0;
+        player_audio_time_get(&time);
+        set_audio_time(time);
+    }
+    if (METADATA_CHANGED(changes, METADATA_FIELD_ARTIST))
+        lv_label_set_text(audio_artist_label, snapshot->artist == NULL ? "" : snapshot->artist);
+    if (METADATA_CHANGED(changes, METADATA_FIELD_ALBUM))
+        lv_label_set_text(audio_album_label, snapshot->album == NULL ? "" : snapshot->album);
+    if (METADATA_CHANGED(changes, METADATA_FIELD_DURATION))
+        set_audio_duration(snapshot->duration);
+    if (METADATA_CHANGED(changes, METADATA_FIELD_IMAGE_URL))
+        show_album_art((char *)snapshot->image_url);
+    metadata_snapshot_release(snapshot);
+}
+
 static void metadata_cb(metadata_event_t event, void *subject)
 {
     switch (event)
     {
     case METADATA_EVENT:
-        lv_label_set_text(audio_title_label, metadata_title_get() == NULL ? "..." : metadata_title_get());
-        lv_label_set_text(audio_artist_label, metadata_artist_get() == NULL ? "" : metadata_artist_get());
-        lv_label_set_text(audio_album_label, metadata_album_get() == NULL ? "" : metadata_album_get());
-        set_audio_duration(metadata_duration_get());
-        show_album_art(metadata_image_url_get());
+        metadata_show();
         break;
     default:
         break;
@@ -305,7 +344,7 @@ static void player_event_cb(player_event_t event, void *subject)
             break;
         case MP_STATE_FINISHED:
             handle_audio_stop();
-            if (player_source_get()->type == MP_SOURCE_TYPE_SD_CARD)
+            if (player_source_type_get() == MP_SOURCE_TYPE_SD_CARD)
                 sd_card_browser_next();
             break;
         case MP_STATE_TRANSITIONING:
@@ -350,6 +389,9 @@ static void player_event_cb(player_event_t event, void *subject)
         set_audio_duration(0);
         char *album_art_url = NULL;
         show_album_art(album_art_url);
+        // the metadata may have been set already, it is shown again in full
+        metadata_version = 0;
+        metadata_show();
         break;
     default:
         break;
@@ -501,10 +543,11 @@ void display_lvgl_start(void)
     lv_obj_align(media_source_image, LV_ALIGN_BOTTOM_RIGHT, 0, 0);
     lv_obj_set_size(media_source_image, 140, 40);
 
+    event_bus_lvgl_start();
     lvgl_port_unlock();
 
-    metadata_add_event_listener(metadata_cb);
-    player_add_event_listener(player_event_cb);
+    metadata_add_event_listener(metadata_cb, EVENT_BUS_LVGL);
+    player_add_event_listener(player_event_cb, EVENT_BUS_LVGL);
 }
 
 static void lcd_backlight_init()
@@ -2,7 +2,13 @@
 #include "metadata.h"
 #include "hescape.h"
 #include "player.h"
+#include "audio_trace.h"
 
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
 #include "esp_ssdp.h"
 #include "esp_log.h"
 
@@ -10,6 +16,194 @@ static const char *TAG = "DLNA";
 
 static esp_dlna_handle_t dlna_handle;
 static char *escaped_metadata = NULL;
+/* SetNextAVTransportURI, read by the http reader task for the gapless switch */
+static SemaphoreHandle_t next_lock = NULL;
+static char *next_url = NULL;
+static char *next_metadata = NULL;
+static char *escaped_next_metadata = NULL;
+
+/* evented AVTransport state variables, the changed ones are collected between two events */
+typedef enum
+{
+    AVT_VAR_TRANSPORT_STATE,
+    AVT_VAR_REL_TIME,
+    AVT_VAR_REL_COUNT,
+    AVT_VAR_TRANSPORT_URI,
+    AVT_VAR_TRACK_METADATA,
+    AVT_VAR_NEXT_URI,
+    AVT_VAR_COUNT,
+} avt_var_t;
+
+static const char *avt_var_names[AVT_VAR_COUNT] = {
+    "TransportState",
+    "RelativeTimePosition",
+    "RelativeCounterPosition",
+    "AVTransportURI",
+    "CurrentTrackMetaData",
+    "NextAVTransportURI",
+};
+
+static TaskHandle_t th_notify = NULL;
+static portMUX_TYPE notify_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t avt_changed = 0; // avt_var_t bits
+static bool rcs_changed = false;
+static dlna_notify_stats_t notify_stats = {0};
+
+static void notify_avt(uint32_t vars)
+{
+    taskENTER_CRITICAL(&notify_lock);
+    // counts the variables marked, not the calls
+    notify_stats.changes += __builtin_popcount(vars);
+    avt_changed |= vars;
+    taskEXIT_CRITICAL(&notify_lock);
+    if (th_notify != NULL)
+        xTaskNotifyGive(th_notify);
+}
+
+static void notify_rcs(void)
+{
+    taskENTER_CRITICAL(&notify_lock);
+    rcs_changed = true;
+    notify_stats.changes++;
+    taskEXIT_CRITICAL(&notify_lock);
+    if (th_notify != NULL)
+        xTaskNotifyGive(th_notify);
+}
+
+/*
+ * The LastChange event of a service is built by esp_dlna from its notify list. A single changed
+ * variable is sent alone, more of them in one event of the whole service.
+ */
+static void notify_flush(void)
+{
+    taskENTER_CRITICAL(&notify_lock);
+    uint32_t avt = avt_changed;
+    bool rcs = rcs_changed;
+    avt_changed = 0;
+    rcs_changed = false;
+    notify_stats.notifications += (avt != 0) + rcs;
+    taskEXIT_CRITICAL(&notify_lock);
+
+    if (avt != 0 && (avt & (avt - 1)) == 0)
+        esp_dlna_notify_avt_by_action(dlna_handle, avt_var_names[__builtin_ctz(avt)]);
+    else if (avt != 0)
+        esp_dlna_notify(dlna_handle, "AVTransport");
+    if (rcs)
+        esp_dlna_notify(dlna_handle, "RenderingControl");
+}
+
+static void notify_stats_log(void)
+{
+    dlna_notify_stats_t stats;
+    dlna_notify_stats_get(&stats);
+    ESP_LOGI(TAG, "%lu state variable changes sent in %lu events", stats.changes, stats.notifications);
+}
+
+static void notify_task(void *p)
+{
+    int64_t flushed_at = 0;
+    int64_t logged_at = 0;
+    while (true)
+    {
+        if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(DLNA_NOTIFY_STATS_PERIOD_MS)) > 0)
+        {
+            // the first change goes out right away, the following ones are collected until the interval passed
+            int64_t wait = flushed_at + DLNA_NOTIFY_INTERVAL_MS * 1000LL - esp_timer_get_time();
+            if (wait > 0)
+                vTaskDelay(pdMS_TO_TICKS(wait / 1000) + 1);
+            ulTaskNotifyTake(pdTRUE, 0);
+            notify_flush();
+            flushed_at = esp_timer_get_time();
+        }
+        if (flushed_at > logged_at && esp_timer_get_time() - logged_at >= DLNA_NOTIFY_STATS_PERIOD_MS * 1000LL)
+        {
+            notify_stats_log();
+            logged_at = esp_timer_get_time();
+        }
+    }
+}
+
+void dlna_notify_stats_get(dlna_notify_stats_t *stats)
+{
+    taskENTER_CRITICAL(&notify_lock);
+    *stats = notify_stats;
+    taskEXIT_CRITICAL(&notify_lock);
+}
+
+// copies a response value, returns its length in the buffer
+static int value_copy(char *buffer, int max_buffer_len, const char *value, int len)
+{
+    if (value == NULL || max_buffer_len <= 0)
+        return 0;
+    if (len >= max_buffer_len)
+        len = max_buffer_len - 1;
+    memcpy(buffer, value, len);
+    buffer[len] = 0;
+    return len;
+}
+
+/*
+ * GetPositionInfo is polled every second and asks for several position values, they are rendered
+ * together with one player query and copied into the responses until they expire.
+ * The httpd task serves the requests and the notify task renders the events, both use them.
+ */
+typedef enum
+{
+    POSITION_DURATION,
+    POSITION_REL_TIME,
+    POSITION_REL_COUNT,
+    POSITION_COUNT,
+} position_value_t;
+
+typedef struct
+{
+    char values[POSITION_COUNT][12];
+    int lens[POSITION_COUNT];
+    int64_t rendered_at;
+} position_values_t;
+
+static position_values_t position_values = {0};
+static SemaphoreHandle_t position_lock = NULL;
+static volatile bool position_stale = true;
+static uint32_t metadata_version = 0; // of the last metadata event
+
+static int time_render(char *buffer, int len, int sec)
+{
+    return snprintf(buffer, len, "%02d:%02d:%02d", sec / 3600, (sec % 3600) / 60, sec % 60);
+}
+
+// must be called with position_lock held
+static void position_values_render(void)
+{
+    position_values_t *values = &position_values;
+    int64_t now = esp_timer_get_time();
+    if (!position_stale && now - values->rendered_at < DLNA_POSITION_TTL_MS * 1000LL)
+        return;
+    position_stale = false;
+
+    int duration = 0, time = 0, count = 0;
+    player_audio_duration_get(&duration);
+    if (duration == 0)
+        duration = metadata_duration_get();
+    player_audio_time_get(&time);
+    player_audio_position_get(&count);
+    values->lens[POSITION_DURATION] = time_render(values->values[POSITION_DURATION], sizeof(values->values[0]), duration);
+    values->lens[POSITION_REL_TIME] = time_render(values->values[POSITION_REL_TIME], sizeof(values->values[0]), time);
+    values->lens[POSITION_REL_COUNT] = snprintf(values->values[POSITION_REL_COUNT], sizeof(values->values[0]), "%d", count);
+    values->rendered_at = now;
+    ESP_LOGD(TAG, "Position rendered, duration = %s, time = %s, counter = %s", values->values[POSITION_DURATION],
+             values->values[POSITION_REL_TIME], values->values[POSITION_REL_COUNT]);
+}
+
+// copies a position value into a response, rendered again if it expired
+static int position_value_copy(position_value_t value, char *buffer, int max_buffer_len)
+{
+    xSemaphoreTake(position_lock, portMAX_DELAY);
+    position_values_render();
+    int len = value_copy(buffer, max_buffer_len, position_values.values[value], position_values.lens[value]);
+    xSemaphoreGive(position_lock);
+    return len;
+}
 
 static char *player_state_to_trans_state(player_state_t player_state)
 {
@@ -32,6 +226,109 @@ static char *player_state_to_trans_state(player_state_t player_state)
     }
 }
 
+// hesc_escape_html() returns the source itself if there is nothing to escape
+static char *escape(const char *xml)
+{
+    char *escaped = NULL;
+    hesc_escape_html((uint8_t **)&escaped, (const uint8_t *)xml, strlen(xml));
+    return escaped == xml ? strdup(xml) : escaped;
+}
+
+static void next_clear(void)
+{
+    if (next_url != NULL)
+        free(next_url);
+    if (next_metadata != NULL)
+        free(next_metadata);
+    if (escaped_next_metadata != NULL)
+        free(escaped_next_metadata);
+    next_url = NULL;
+    next_metadata = NULL;
+    escaped_next_metadata = NULL;
+}
+
+/*
+ * The next track becomes the current one, must be called with next_lock held.
+ * Returns its metadata, set by next_metadata_set() after the lock is released as the listeners may need it.
+ */
+static char *next_promote(void)
+{
+    if (escaped_metadata != NULL)
+        free(escaped_metadata);
+    escaped_metadata = escaped_next_metadata;
+    escaped_next_metadata = NULL;
+    if (next_url != NULL)
+        free(next_url);
+    next_url = NULL;
+    char *xml = next_metadata;
+    next_metadata = NULL;
+    return xml;
+}
+
+static void next_metadata_set(char *xml)
+{
+    if (xml == NULL)
+        return;
+    metadata_set_dlna_xml(xml);
+    free(xml);
+}
+
+static void next_notify(void)
+{
+    notify_avt((1 << AVT_VAR_TRANSPORT_URI) | (1 << AVT_VAR_TRACK_METADATA) | (1 << AVT_VAR_NEXT_URI));
+}
+
+// plays the next track after a gap, if the reader could not continue with it
+static bool next_play(void)
+{
+    char *xml = NULL;
+    xSemaphoreTake(next_lock, portMAX_DELAY);
+    char *url = next_url;
+    next_url = NULL;
+    if (url != NULL)
+        xml = next_promote();
+    xSemaphoreGive(next_lock);
+    if (url == NULL)
+        return false;
+    ESP_LOGI(TAG, "Next track %s", url);
+    media_sourece_t source = {
+        .type = MP_SOURCE_TYPE_DLNA,
+        .url = url,
+    };
+    player_source_set(&source);
+    player_play();
+    free(url);
+    next_metadata_set(xml);
+    next_notify();
+    return true;
+}
+
+static bool gapless_next_track(char *url, int url_size)
+{
+    bool found = false;
+    xSemaphoreTake(next_lock, portMAX_DELAY);
+    if (next_url != NULL && strlen(next_url) < url_size)
+    {
+        strcpy(url, next_url);
+        found = true;
+    }
+    xSemaphoreGive(next_lock);
+    return found;
+}
+
+static void gapless_track_changed(const char *url)
+{
+    char *xml = NULL;
+    xSemaphoreTake(next_lock, portMAX_DELAY);
+    if (next_url != NULL && strcmp(next_url, url) == 0)
+        xml = next_promote();
+    else
+        ESP_LOGW(TAG, "Next track changed meanwhile, now playing %s", url);
+    xSemaphoreGive(next_lock);
+    next_metadata_set(xml);
+    next_notify();
+}
+
 static int dlna_renderer_request(esp_dlna_handle_t dlna, const upnp_attr_t *attr, int attr_num, char *buffer, int max_buffer_len)
 {
     int req_type;
@@ -78,8 +375,12 @@ static int dlna_renderer_request(esp_dlna_handle_t dlna, const upnp_attr_t *attr
         player_pause();
         return 0;
     case AVT_NEXT:
+        ESP_LOGD(TAG, "Next");
+        if (!next_play())
+            player_stop();
+        return 0;
     case AVT_PREV:
-        ESP_LOGD(TAG, "Next/Previous");
+        ESP_LOGD(TAG, "Previous");
         player_stop();
         return 0;
     case AVT_SEEK:
@@ -95,22 +396,51 @@ static int dlna_renderer_request(esp_dlna_handle_t dlna, const upnp_attr_t *attr
         };
         player_source_set(&source);
         //player_play();
+        // a new transport uri drops the queued next track
+        xSemaphoreTake(next_lock, portMAX_DELAY);
+        next_clear();
+        xSemaphoreGive(next_lock);
         return 0;
     case AVT_SET_TRACK_METADATA:
         ESP_LOGD(TAG, "SetAVTransportURI, CurrentURIMetaData = %s", buffer);
         metadata_set_dlna_xml(buffer);
+        xSemaphoreTake(next_lock, portMAX_DELAY);
         if (escaped_metadata != NULL)
             free(escaped_metadata);
-        hesc_escape_html((uint8_t **)&escaped_metadata, (uint8_t *)buffer, strlen(buffer));
+        escaped_metadata = escape(buffer);
+        xSemaphoreGive(next_lock);
         return 0;
-    case AVT_GET_TRACK_URI:
-        char *url = (player_source_get())->url;
-        ESP_LOGD(TAG, "GetMediaInfo or GetPositionInfo, CurrentTrackURI or AVTransportURI notify");
-        if (url != NULL)
+    case AVT_SET_NEXT_TRACK_URI:
+        ESP_LOGD(TAG, "SetNextAVTransportURI, NextURI = %s", buffer);
+        xSemaphoreTake(next_lock, portMAX_DELAY);
+        next_clear();
+        if (buffer[0] != 0)
+            next_url = strdup(buffer);
+        xSemaphoreGive(next_lock);
+        return 0;
+    case AVT_SET_NEXT_TRACK_METADATA:
+        ESP_LOGD(TAG, "SetNextAVTransportURI, NextURIMetaData = %s", buffer);
+        xSemaphoreTake(next_lock, portMAX_DELAY);
+        if (next_url != NULL && buffer[0] != 0)
         {
-            return snprintf(buffer, max_buffer_len, "%s", url);
+            next_metadata = strdup(buffer);
+            escaped_next_metadata = escape(buffer);
         }
+        xSemaphoreGive(next_lock);
         return 0;
+    case AVT_GET_NEXT_TRACK_URI:
+        xSemaphoreTake(next_lock, portMAX_DELAY);
+        tmp_data = next_url == NULL ? 0 : snprintf(buffer, max_buffer_len, "%s", next_url);
+        xSemaphoreGive(next_lock);
+        return tmp_data;
+    case AVT_GET_NEXT_TRACK_METADATA:
+        xSemaphoreTake(next_lock, portMAX_DELAY);
+        tmp_data = escaped_next_metadata == NULL ? 0 : snprintf(buffer, max_buffer_len, "%s", escaped_next_metadata);
+        xSemaphoreGive(next_lock);
+        return tmp_data;
+    case AVT_GET_TRACK_URI:
+        ESP_LOGD(TAG, "GetMediaInfo or GetPositionInfo, CurrentTrackURI or AVTransportURI notify");
+        return player_source_url_get(buffer, max_buffer_len);
     case AVT_GET_PLAY_SPEED:
         return snprintf(buffer, max_buffer_len, "%d", 1);
     case AVT_GET_PLAY_MODE:
@@ -125,28 +455,30 @@ static int dlna_renderer_request(esp_dlna_handle_t dlna, const upnp_attr_t *attr
         return snprintf(buffer, max_buffer_len, trans_state);
     case AVT_GET_TRACK_DURATION:
     case AVT_GET_MEDIA_DURATION:
-        player_audio_duration_get(&tmp_data);
-        if (tmp_data == 0 && metadata_duration_get() != 0)
-        {
-            tmp_data = metadata_duration_get();
-        }
-        ESP_LOGD(TAG, "GetMediaInfo or CurrentMediaDuration notify, reply = %02d:%02d:%02d", tmp_data / 3600, (tmp_data % 3600) / 60, tmp_data % 60);
-        return snprintf(buffer, max_buffer_len, "%02d:%02d:%02d", tmp_data / 3600, (tmp_data % 3600) / 60, tmp_data % 60);
+        return position_value_copy(POSITION_DURATION, buffer, max_buffer_len);
     case AVT_GET_TRACK_NO:
         return snprintf(buffer, max_buffer_len, "%d", 1);
     case AVT_GET_TRACK_METADATA:
         ESP_LOGD(TAG, "GetMediaInfo / GetPositionInfo or CurrentTrackMetaData / AVTransportURIMetaData notify");
-        return escaped_metadata == NULL ? 0 : snprintf(buffer, max_buffer_len, "%s", escaped_metadata);
+        if (player_source_type_get() != MP_SOURCE_TYPE_DLNA)
+        {
+            // generated from the metadata of the other sources, cached until it changes
+            metadata_lock();
+            const char *xml = metadata_get_dlna_xml_escaped(&tmp_data);
+            tmp_data = value_copy(buffer, max_buffer_len, xml, tmp_data);
+            metadata_unlock();
+            return tmp_data;
+        }
+        xSemaphoreTake(next_lock, portMAX_DELAY);
+        tmp_data = escaped_metadata == NULL ? 0 : value_copy(buffer, max_buffer_len, escaped_metadata, strlen(escaped_metadata));
+        xSemaphoreGive(next_lock);
+        return tmp_data;
     case AVT_GET_POS_ABSTIME:
     case AVT_GET_POS_RELTIME:
-        player_audio_time_get(&tmp_data);
-        ESP_LOGD(TAG, "GetPositionInfo or RelativeTimePosition notify, reply = %02d:%02d:%02d", tmp_data / 3600, tmp_data / 60, tmp_data % 60);
-        return snprintf(buffer, max_buffer_len, "%02d:%02d:%02d", tmp_data / 3600, (tmp_data % 3600) / 60, tmp_data % 60);
+        return position_value_copy(POSITION_REL_TIME, buffer, max_buffer_len);
     case AVT_GET_POS_ABSCOUNT:
     case AVT_GET_POS_RELCOUNT:
-        player_audio_position_get(&tmp_data);
-        ESP_LOGD(TAG, "GetPositionInfo or RelativeCounterPosition notify, reply = %d", tmp_data);
-        return snprintf(buffer, max_buffer_len, "%d", tmp_data);
+        return position_value_copy(POSITION_REL_COUNT, buffer, max_buffer_len);
     }
     return 0;
 }
@@ -156,20 +488,14 @@ static void metadata_cb(metadata_event_t event, void *subject)
     switch (event)
     {
     case METADATA_EVENT:
-        if (player_source_get()->type != MP_SOURCE_TYPE_DLNA)
-        {
-            if (escaped_metadata != NULL)
-                free(escaped_metadata);
-            char *xml;
-            if (metadata_get_dlna_xml(&xml) == ESP_OK)
-            {
-                ESP_LOGD(TAG, "XML metadata = %s", xml);
-                hesc_escape_html((uint8_t **)&escaped_metadata, (uint8_t *)xml, strlen(xml));
-                ESP_LOGD(TAG, "Escaped metadata = %s", escaped_metadata);
-                if (xml != NULL)
-                    free(xml);
-            }
-        }
+        const metadata_snapshot_t *snapshot = metadata_snapshot_get();
+        if (snapshot == NULL)
+            break;
+        // the DIDL-Lite is generated on request, only the rendered duration depends on the metadata
+        if (METADATA_CHANGED(metadata_snapshot_changes(snapshot, metadata_version), METADATA_FIELD_DURATION))
+            position_stale = true;
+        metadata_version = snapshot->version;
+        metadata_snapshot_release(snapshot);
         break;
     default:
         break;
@@ -181,25 +507,56 @@ static void player_cb(player_event_t event, void *subject)
     switch (event)
     {
     case MP_EVENT_STATE:
-        esp_dlna_notify_avt_by_action(dlna_handle, "TransportState");
+        // the reader could not continue with the next track without a gap
+        if (*(player_state_t *)subject == MP_STATE_FINISHED && player_source_type_get() == MP_SOURCE_TYPE_DLNA && next_play())
+            break;
+        position_stale = true;
+        notify_avt(1 << AVT_VAR_TRANSPORT_STATE);
         break;
     case MP_EVENT_VOLUME:
     case MP_EVENT_MUTE:
-        esp_dlna_notify(dlna_handle, "RenderingControl");
+        notify_rcs();
         break;
     case MP_EVENT_SOURCE:
+        position_stale = true;
         break;
     case MP_EVENT_POSITION:
-        esp_dlna_notify_avt_by_action(dlna_handle, "RelativeTimePosition");
-        esp_dlna_notify_avt_by_action(dlna_handle, "RelativeCounterPosition");
+        position_stale = true;
+        notify_avt((1 << AVT_VAR_REL_TIME) | (1 << AVT_VAR_REL_COUNT));
     default:
         break;
     }
 }
 
+// playback start-up trace of the last sessions as JSON
+static esp_err_t trace_get_handler(httpd_req_t *req)
+{
+    char *json = (char *)malloc(DLNA_TRACE_JSON_SIZE);
+    if (json == NULL)
+    {
+        ESP_LOGE(TAG, "Not enough memmory for trace");
+        return httpd_resp_send_500(req);
+    }
+    int len = audio_trace_json(json, DLNA_TRACE_JSON_SIZE);
+    esp_err_t ret = len >= 0 ? ESP_OK : ESP_FAIL;
+    if (ret == ESP_OK)
+    {
+        httpd_resp_set_type(req, "application/json");
+        ret = httpd_resp_send(req, json, len);
+    }
+    else
+    {
+        httpd_resp_send_500(req);
+    }
+    free(json);
+    return ret;
+}
+
 esp_dlna_handle_t dlna_start()
 {
     ESP_LOGI(TAG, "Starting DLNA...");
+    next_lock = xSemaphoreCreateMutex();
+    position_lock = xSemaphoreCreateMutex();
 
     const ssdp_service_t ssdp_service[] = {
         {DLNA_DEVICE_UUID, "upnp:rootdevice", NULL},
@@ -242,11 +599,22 @@ esp_dlna_handle_t dlna_start()
         .device_list = false};
 
     dlna_handle = esp_dlna_start(&dlna_config);
+    if (xTaskCreatePinnedToCore(&notify_task, "dlna_notify", 4 * 1024, NULL, 2, &th_notify, 0) != pdPASS)
+        ESP_LOGE(TAG, "Cannot create dlna_notify task, no events are sent");
+
+    const httpd_uri_t trace_uri = {
+        .uri = DLNA_TRACE_PATH,
+        .method = HTTP_GET,
+        .handler = trace_get_handler,
+    };
+    if (httpd_register_uri_handler(httpd, &trace_uri) != ESP_OK)
+        ESP_LOGW(TAG, "Cannot register %s", DLNA_TRACE_PATH);
 
     ESP_LOGI(TAG, "DLNA started");
 
-    player_add_event_listener(player_cb);
-    metadata_add_event_listener(metadata_cb);
+    player_add_event_listener(player_cb, EVENT_BUS_TASK);
+    metadata_add_event_listener(metadata_cb, EVENT_BUS_TASK);
+    player_gapless_set(MP_SOURCE_TYPE_DLNA, gapless_next_track, gapless_track_changed);
 
     return dlna_handle;
 }
\ No newline at end of file
@@ -0,0 +1,252 @@
+#include "event_bus.h"
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_check.h"
+#include "esp_timer.h"
+#include "lvgl.h"
+
+typedef struct
+{
+    uint8_t topic;
+    uint8_t event;
+    uint8_t size;
+    bool coalesced; // the subject is in the latest slot, not in the message
+    int64_t published_at;
+    union
+    {
+        uint8_t data[EVENT_BUS_DATA_SIZE];
+        void *pointer;
+    } subject;
+} event_msg_t;
+
+typedef struct
+{
+    event_bus_dispatch_t dispatch;
+    void *callback;
+} subscriber_t;
+
+typedef struct
+{
+    uint64_t latency_sum_us;
+    event_bus_stats_t stats;
+} event_stats_t;
+
+/* one per affinity */
+typedef struct
+{
+    QueueHandle_t queue;
+    subscriber_t subscribers[EVENT_BUS_TOPIC_COUNT][EVENT_BUS_MAX_SUBSCRIBERS];
+    int subscriber_count[EVENT_BUS_TOPIC_COUNT];
+    event_msg_t latest[EVENT_BUS_TOPIC_COUNT][EVENT_BUS_MAX_EVENTS];
+    bool pending[EVENT_BUS_TOPIC_COUNT][EVENT_BUS_MAX_EVENTS];
+    event_stats_t stats[EVENT_BUS_TOPIC_COUNT][EVENT_BUS_MAX_EVENTS];
+} delivery_t;
+
+static const char *TAG = "EVENT_BUS";
+static const char *affinity_names[EVENT_BUS_AFFINITY_COUNT] = {"task", "lvgl"};
+static const char *topic_names[EVENT_BUS_TOPIC_COUNT] = {"player", "metadata"};
+
+static delivery_t deliveries[EVENT_BUS_AFFINITY_COUNT];
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t th_event_bus = NULL;
+static lv_timer_t *lvgl_timer = NULL;
+
+static void delivery_publish(delivery_t *delivery, const event_msg_t *msg)
+{
+    event_stats_t *stats = &delivery->stats[msg->topic][msg->event];
+    if (msg->coalesced)
+    {
+        bool queued;
+        taskENTER_CRITICAL(&lock);
+        stats->stats.published++;
+        queued = delivery->pending[msg->topic][msg->event];
+        if (queued)
+        {
+            // the first publish time is kept, the queueing delay is what is measured
+            int64_t published_at = delivery->latest[msg->topic][msg->event].published_at;
+            delivery->latest[msg->topic][msg->event] = *msg;
+            delivery->latest[msg->topic][msg->event].published_at = published_at;
+            stats->stats.coalesced++;
+        }
+        else
+        {
+            delivery->latest[msg->topic][msg->event] = *msg;
+            delivery->pending[msg->topic][msg->event] = true;
+        }
+        taskEXIT_CRITICAL(&lock);
+        if (queued)
+            return;
+    }
+    else
+    {
+        taskENTER_CRITICAL(&lock);
+        stats->stats.published++;
+        taskEXIT_CRITICAL(&lock);
+    }
+    if (xQueueSend(delivery->queue, msg, 0) != pdTRUE)
+    {
+        taskENTER_CRITICAL(&lock);
+        if (msg->coalesced)
+            delivery->pending[msg->topic][msg->event] = false;
+        stats->stats.dropped++;
+        taskEXIT_CRITICAL(&lock);
+        ESP_LOGW(TAG, "Queue full, %s event %d dropped", topic_names[msg->topic], msg->event);
+    }
+}
+
+static void delivery_dispatch(delivery_t *delivery, event_msg_t *msg)
+{
+    if (msg->coalesced)
+    {
+        taskENTER_CRITICAL(&lock);
+        *msg = delivery->latest[msg->topic][msg->event];
+        delivery->pending[msg->topic][msg->event] = false;
+        taskEXIT_CRITICAL(&lock);
+    }
+    uint32_t latency = esp_timer_get_time() - msg->published_at;
+    void *subject = msg->size > 0 ? (void *)msg->subject.data : msg->subject.pointer;
+    for (int i = 0; i < delivery->subscriber_count[msg->topic]; i++)
+    {
+        subscriber_t *subscriber = &delivery->subscribers[msg->topic][i];
+        subscriber->dispatch(subscriber->callback, msg->event, subject);
+    }
+
+    event_stats_t *stats = &delivery->stats[msg->topic][msg->event];
+    taskENTER_CRITICAL(&lock);
+    stats->stats.delivered++;
+    stats->latency_sum_us += latency;
+    stats->stats.latency_avg_us = stats->latency_sum_us / stats->stats.delivered;
+    if (latency > stats->stats.latency_max_us)
+        stats->stats.latency_max_us = latency;
+    taskEXIT_CRITICAL(&lock);
+    if (latency > EVENT_BUS_SLOW_MS * 1000)
+        ESP_LOGW(TAG, "%s event %d dispatched on %s after %lu ms", topic_names[msg->topic], msg->event,
+                 affinity_names[delivery - deliveries], latency / 1000);
+    else
+        ESP_LOGD(TAG, "%s event %d dispatched on %s after %lu us", topic_names[msg->topic], msg->event,
+                 affinity_names[delivery - deliveries], latency);
+}
+
+static void stats_log(void)
+{
+    for (int affinity = 0; affinity < EVENT_BUS_AFFINITY_COUNT; affinity++)
+    {
+        for (int topic = 0; topic < EVENT_BUS_TOPIC_COUNT; topic++)
+        {
+            for (int event = 0; event < EVENT_BUS_MAX_EVENTS; event++)
+            {
+                event_bus_stats_t stats;
+                event_bus_stats_get(topic, event, affinity, &stats);
+                if (stats.published == 0)
+                    continue;
+                ESP_LOGI(TAG, "%s event %d on %s: published %lu, coalesced %lu, dropped %lu, latency avg %lu us, max %lu us",
+                         topic_names[topic], event, affinity_names[affinity], stats.published, stats.coalesced, stats.dropped,
+                         stats.latency_avg_us, stats.latency_max_us);
+            }
+        }
+    }
+}
+
+static void event_bus_task(void *p)
+{
+    delivery_t *delivery = &deliveries[EVENT_BUS_TASK];
+    int64_t stats_logged_at = esp_timer_get_time();
+    event_msg_t msg;
+    while (true)
+    {
+        if (xQueueReceive(delivery->queue, &msg, pdMS_TO_TICKS(EVENT_BUS_STATS_PERIOD_MS)) == pdTRUE)
+            delivery_dispatch(delivery, &msg);
+        if (esp_timer_get_time() - stats_logged_at >= EVENT_BUS_STATS_PERIOD_MS * 1000LL)
+        {
+            stats_log();
+            stats_logged_at = esp_timer_get_time();
+        }
+    }
+}
+
+// runs on the LVGL task with the port locked
+static void lvgl_timer_handle(lv_timer_t *timer)
+{
+    delivery_t *delivery = &deliveries[EVENT_BUS_LVGL];
+    event_msg_t msg;
+    while (xQueueReceive(delivery->queue, &msg, 0) == pdTRUE)
+        delivery_dispatch(delivery, &msg);
+}
+
+esp_err_t event_bus_init(void)
+{
+    ESP_RETURN_ON_FALSE(th_event_bus == NULL, ESP_OK, TAG, "Event bus already initialized");
+    for (int i = 0; i < EVENT_BUS_AFFINITY_COUNT; i++)
+    {
+        deliveries[i].queue = xQueueCreate(EVENT_BUS_QUEUE_LENGTH, sizeof(event_msg_t));
+        ESP_RETURN_ON_FALSE(deliveries[i].queue != NULL, ESP_ERR_NO_MEM, TAG, "Cannot create %s event queue", affinity_names[i]);
+    }
+    BaseType_t ret = xTaskCreatePinnedToCore(&event_bus_task, "event_bus", EVENT_BUS_TASK_STACK, NULL, EVENT_BUS_TASK_PRIORITY, &th_event_bus, 0);
+    ESP_RETURN_ON_FALSE(ret == pdPASS, ESP_FAIL, TAG, "Cannot create event_bus task, error code: %d", ret);
+    return ESP_OK;
+}
+
+esp_err_t event_bus_lvgl_start(void)
+{
+    ESP_RETURN_ON_FALSE(lvgl_timer == NULL, ESP_OK, TAG, "LVGL delivery already started");
+    lvgl_timer = lv_timer_create(lvgl_timer_handle, EVENT_BUS_LVGL_PERIOD_MS, NULL);
+    ESP_RETURN_ON_FALSE(lvgl_timer != NULL, ESP_ERR_NO_MEM, TAG, "Cannot create LVGL event timer");
+    return ESP_OK;
+}
+
+esp_err_t event_bus_subscribe(event_bus_topic_t topic, event_bus_dispatch_t dispatch, void *callback, event_bus_affinity_t affinity)
+{
+    ESP_RETURN_ON_FALSE(topic < EVENT_BUS_TOPIC_COUNT && affinity < EVENT_BUS_AFFINITY_COUNT, ESP_ERR_INVALID_ARG, TAG, "Invalid topic or affinity");
+    delivery_t *delivery = &deliveries[affinity];
+    // the slot is claimed and filled before it is counted, dispatching does not need the lock
+    taskENTER_CRITICAL(&lock);
+    int count = delivery->subscriber_count[topic];
+    if (count < EVENT_BUS_MAX_SUBSCRIBERS)
+    {
+        delivery->subscribers[topic][count].dispatch = dispatch;
+        delivery->subscribers[topic][count].callback = callback;
+        delivery->subscriber_count[topic] = count + 1;
+    }
+    taskEXIT_CRITICAL(&lock);
+    ESP_RETURN_ON_FALSE(count < EVENT_BUS_MAX_SUBSCRIBERS, ESP_ERR_NO_MEM, TAG, "Too many %s subscribers", topic_names[topic]);
+    return ESP_OK;
+}
+
+void event_bus_publish(event_bus_topic_t topic, int event, const void *subject, size_t size, bool coalesce)
+{
+    if (topic >= EVENT_BUS_TOPIC_COUNT || event < 0 || event >= EVENT_BUS_MAX_EVENTS || size > EVENT_BUS_DATA_SIZE)
+    {
+        ESP_LOGE(TAG, "Invalid %d event %d", topic, event);
+        return;
+    }
+    event_msg_t msg = {
+        .topic = topic,
+        .event = event,
+        .size = size,
+        .coalesced = coalesce,
+        .published_at = esp_timer_get_time(),
+    };
+    if (size > 0)
+        memcpy(msg.subject.data, subject, size);
+    else
+        msg.subject.pointer = (void *)subject;
+    for (int i = 0; i < EVENT_BUS_AFFINITY_COUNT; i++)
+    {
+        if (deliveries[i].queue != NULL && deliveries[i].subscriber_count[topic] > 0)
+            delivery_publish(&deliveries[i], &msg);
+    }
+}
+
+void event_bus_stats_get(event_bus_topic_t topic, int event, event_bus_affinity_t affinity, event_bus_stats_t *stats)
+{
+    memset(stats, 0, sizeof(event_bus_stats_t));
+    if (topic >= EVENT_BUS_TOPIC_COUNT || event < 0 || event >= EVENT_BUS_MAX_EVENTS || affinity >= EVENT_BUS_AFFINITY_COUNT)
+        return;
+    taskENTER_CRITICAL(&lock);
+    *stats = deliveries[affinity].stats[topic][event].stats;
+    taskEXIT_CRITICAL(&lock);
+}
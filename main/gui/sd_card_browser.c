@@ -37,7 +37,7 @@ playlist_operator_handle_t sdcard_list_handle = NULL;
 
 static esp_err_t list_directory(char *path);
 
-static void play(char *url)
+static void metadata_update(char *url)
 {
     char *cover = NULL;
     char *slash = strrchr(url, '/');
@@ -48,17 +48,60 @@ static void play(char *url)
         strncpy(cover, url, folder_length);
         strcpy(cover + folder_length, "/cover.jpg");
     }
+    int duration = 0;
+    player_audio_duration_get(&duration);
+    metadata_set(url, "SD Card", "", duration, url, cover);
+    if (cover != NULL)
+        free(cover);
+}
+
+static void play(char *url)
+{
     media_sourece_t source = {
         .type = MP_SOURCE_TYPE_SD_CARD,
         .url = url,
     };
     player_source_set(&source);
     player_play();
-    int duration = 0;
-    player_audio_duration_get(&duration);
-    metadata_set(url, "SD Card", "", duration, url, cover);
-    if (cover != NULL)
-        free(cover);
+    metadata_update(url);
+}
+
+/*
+ * Called from the reader task and the player task. The LVGL task may be waiting for the pipeline to stop
+ * or for a player command meanwhile, so the lock is not waited for indefinitely.
+ */
+#define GAPLESS_LOCK_TIMEOUT_MS 100
+
+// peeks the next track of the playlist, the current one is not changed
+static bool gapless_next_track(char *url, int url_size)
+{
+    bool found = false;
+    ESP_RETURN_ON_FALSE(lvgl_port_lock(GAPLESS_LOCK_TIMEOUT_MS), false, TAG, "GUI busy, no gapless playback");
+    int id = sdcard_list_get_url_id(sdcard_list_handle);
+    char *next = NULL;
+    if (sdcard_list_next(sdcard_list_handle, 1, &next) == ESP_OK && next != NULL && strlen(next) < url_size)
+    {
+        strcpy(url, next);
+        found = true;
+    }
+    char *current = NULL;
+    sdcard_list_choose(sdcard_list_handle, id, &current);
+    lvgl_port_unlock();
+    return found;
+}
+
+static void gapless_track_changed(const char *url)
+{
+    if (!lvgl_port_lock(GAPLESS_LOCK_TIMEOUT_MS))
+    {
+        ESP_LOGW(TAG, "GUI busy, playlist not updated to %s", url);
+        return;
+    }
+    char *next = NULL;
+    if (sdcard_list_next(sdcard_list_handle, 1, &next) != ESP_OK || next == NULL || strcmp(next, url) != 0)
+        ESP_LOGW(TAG, "Playlist changed meanwhile, now playing %s", url);
+    metadata_update((char *)url);
+    lvgl_port_unlock();
 }
 
 esp_err_t sd_card_browser_next(void)
@@ -220,6 +263,7 @@ lv_obj_t *sd_card_browser_create(lv_obj_t *parent, bool scan)
 {
     file_list = lv_list_create(parent);
     sdcard_list_create(&sdcard_list_handle);
+    player_gapless_set(MP_SOURCE_TYPE_SD_CARD, gapless_next_track, gapless_track_changed);
     if (!scan)
     {
         lv_obj_t *button = lv_list_add_btn(file_list, LV_SYMBOL_REFRESH, "Scan Memory Card");
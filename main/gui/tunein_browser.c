@@ -1,86 +1,137 @@
 #include "esp_log.h"
 #include "esp_check.h"
+#include "esp_timer.h"
 #include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
-#include "cJSON.h"
+#include "json_stream.h"
+#include "station_list.h"
+#include "tunein_resolver.h"
 #include "tunein_browser.h"
 #include "http_client.h"
 #include "player.h"
-#include "img_download.h"
+#include "img_loader.h"
+#include "audio_trace.h"
 #include "msg_window.h"
 #include "gui.h"
 
-#define HTTP_RESPONSE_MAX_SIZE 128 * 1024
+#define TUNEIN_FAVORITES_FILE "/sdcard/.tunein_favorites"
+#define LOGO_RETRY_MS 500 // the loader queue was full, nothing of ours in it would trigger the next request
 
 static const char *TAG = "TUNE_IN";
-static const char *URL_BASE = "https://opml.radiotime.com/Tune.ashx?id=";
 static const char *URL_FAVORITES = "https://api.tunein.com/profiles/me/follows?folderId=f1&filter=favorites&serial=9a451e82-6daf-48cf-abdc-9192fda47a63&partnerId=RadioTime";
 // static const char *URL_NOW_PLAYING = "https://feed.tunein.com/profiles/%s/nowPlaying";
 
 static lv_obj_t *active_station_button = NULL;
 static char *active_station_guide_id = NULL;
 static lv_obj_t *station_list = NULL;
-static radio_station_t *radio_stations = NULL;
-static int radio_stations_size = 0;
+static lv_coord_t *grid_col_dsc = NULL;
+static lv_coord_t *grid_row_dsc = NULL;
+
+// favorites shown in the grid
+static station_list_t *stations = NULL;
+static bool fetch_running = false;
+static int64_t tap_time = 0; // tap to MP_STATE_PLAYING latency
+
+// logos are loaded by the image loader, requests of older refreshes are dropped by generation
+static lv_obj_t **logo_buttons = NULL;
+static uint32_t logo_generation = 0;
+static int logo_next = 0;
+static int logo_done = 0;
+static lv_timer_t *logo_retry_timer = NULL;
+static int64_t refresh_start = 0;
 
 LV_IMG_DECLARE(radio_128x104);
 LV_IMG_DECLARE(tunein_refresh_128x128);
 
-static esp_err_t tunein_stream_url_get(radio_station_t *radio_station)
+// called with the LVGL port locked, takes the ownership of stream_url
+static void station_start(const char *title, const char *image_url, char *stream_url, bool cached)
 {
-    esp_err_t ret = ESP_OK;
-    int http_res_size;
-    char *http_response = NULL;
-    char *download_url = NULL;
-    char *stream_url = NULL;
-
-    ESP_GOTO_ON_FALSE((radio_station->stream_url == NULL), ESP_OK, err, TAG, "Radio station stream url already set");
-    ESP_GOTO_ON_FALSE((radio_station->guide_id != NULL), ESP_FAIL, err, TAG, "Radio station has no guide_id");
-
-    int url_length = strlen(URL_BASE) + strlen(radio_station->guide_id) + 1;
-    download_url = (char *)malloc(url_length);
-    strcpy(download_url, URL_BASE);
-    strcat(download_url, radio_station->guide_id);
-
-    ret = http_client_get(download_url, &http_response, &http_res_size, HTTP_RESPONSE_MAX_SIZE);
-    ESP_GOTO_ON_ERROR(ret, err, TAG, "Cannot download m3u file");
+    ESP_LOGI(TAG, "Stream url %s in %lld ms", cached ? "cached" : "resolved", (esp_timer_get_time() - tap_time) / 1000);
+    audio_trace_mark(AUDIO_TRACE_URL_RESOLVED, cached);
+    media_sourece_t source = {
+        .type = MP_SOURCE_TYPE_TUNE_IN,
+        .url = stream_url,
+    };
+    player_source_set(&source);
+    metadata_set((char *)title, (char *)title, stream_url, 0, stream_url, (char *)image_url);
+    free(stream_url);
+    audio_err_t play_ret = player_play();
+    if (play_ret != ESP_OK)
+        msg_window_show_ok("%s  Player error: %d", LV_SYMBOL_WARNING, play_ret);
+}
 
-    const char *first_r = strchr(http_response, '\r');
-    const char *first_n = strchr(http_response, '\n');
+/* Station whose stream url is downloaded off the LVGL task, the strings are copies as the list may be replaced */
+typedef struct
+{
+    char *guide_id;
+    char *title;
+    char *image_url;
+} station_resolve_t;
 
-    ESP_GOTO_ON_FALSE((first_n != NULL), ESP_FAIL, err, TAG, "Cannot determine first EOL of m3u file");
+static void station_resolve_free(station_resolve_t *request)
+{
+    free(request->guide_id);
+    if (request->title != NULL)
+        free(request->title);
+    if (request->image_url != NULL)
+        free(request->image_url);
+    free(request);
+}
 
-    int line_length = first_r != NULL ? first_r - http_response : first_n - http_response;
-    stream_url = (char *)malloc(line_length + 1);
-    ESP_GOTO_ON_FALSE(stream_url, ESP_ERR_NO_MEM, err, TAG, "Not enough memmory for stream url");
+static void station_resolve_task(void *p)
+{
+    station_resolve_t *request = (station_resolve_t *)p;
+    char *stream_url = NULL;
+    bool cached = false;
+    esp_err_t ret = tunein_resolver_get(request->guide_id, &stream_url, &cached);
 
-    // cut s from https protocol
-    if (stream_url[4] == 's')
+    lvgl_port_lock(0);
+    // the station may have been stopped meanwhile
+    bool active = active_station_guide_id != NULL && strcmp(active_station_guide_id, request->guide_id) == 0;
+    if (active && ret == ESP_OK)
     {
-        strncpy(stream_url, http_response, 4);
-        strncpy(stream_url[5], http_response[5], line_length - 5);
-        line_length--;
+        station_start(request->title, request->image_url, stream_url, cached);
+        stream_url = NULL;
     }
-    else
+    else if (active)
     {
-        strncpy(stream_url, http_response, line_length);
+        tap_time = 0;
+        msg_window_show_ok("%s  TuneIn get URL error: %d", LV_SYMBOL_WARNING, ret);
     }
-    stream_url[line_length] = 0;
-
-    ESP_LOGI(TAG, "first line: [%s] length: %d", stream_url, line_length);
+    else if (active_station_guide_id == NULL)
+    {
+        msg_window_hide();
+    }
+    lvgl_port_unlock();
 
-    radio_station->stream_url = stream_url;
+    if (stream_url != NULL)
+        free(stream_url);
+    station_resolve_free(request);
+    vTaskDelete(NULL);
+}
 
-err:
-    if (download_url)
+static esp_err_t station_resolve_start(const char *guide_id, const char *title, const char *image_url)
+{
+    station_resolve_t *request = (station_resolve_t *)calloc(1, sizeof(station_resolve_t));
+    ESP_RETURN_ON_FALSE(request != NULL, ESP_ERR_NO_MEM, TAG, "Not enough memmory for station request");
+    request->guide_id = strdup(guide_id);
+    request->title = title != NULL ? strdup(title) : NULL;
+    request->image_url = image_url != NULL ? strdup(image_url) : NULL;
+    if (request->guide_id == NULL)
     {
-        free(download_url);
+        station_resolve_free(request);
+        return ESP_ERR_NO_MEM;
     }
-    if (http_response)
+    BaseType_t ret = xTaskCreatePinnedToCore(&station_resolve_task, "tunein_resolve", 8 * 1024, request, 3, NULL, 0);
+    if (ret != pdPASS)
     {
-        free(http_response);
+        ESP_LOGE(TAG, "Cannot create tunein_resolve task, error code: %d", ret);
+        station_resolve_free(request);
+        return ESP_FAIL;
     }
-    return ret;
+    return ESP_OK;
 }
 
 // listen only for LV_EVENT_VALUE_CHANGED
@@ -91,30 +142,30 @@ static void station_button_handler(lv_event_t *e)
     if (checked)
     {
         msg_window_show_text("Connecting...");
-        radio_station_t *radio_station = (radio_station_t *)e->user_data;
+        tap_time = esp_timer_get_time();
+        audio_trace_start(AUDIO_TRACE_TAP, 0);
+        int index = (intptr_t)lv_event_get_user_data(e);
+        const char *title = station_list_get(stations, index, STATION_TITLE);
+        const char *image_url = station_list_get(stations, index, STATION_IMAGE_URL);
+        const char *guide_id = station_list_get(stations, index, STATION_GUIDE_ID);
 
         if (active_station_button != NULL)
             lv_obj_clear_state(active_station_button, LV_STATE_CHECKED);
         active_station_button = target;
         if (active_station_guide_id != NULL)
             free(active_station_guide_id);
-        active_station_guide_id = strdup(radio_station->guide_id);
+        active_station_guide_id = guide_id != NULL ? strdup(guide_id) : NULL;
 
-        esp_err_t url_ret = tunein_stream_url_get(radio_station);
+        // a url which is not cached yet is downloaded in the background, "Connecting..." stays until it plays
+        char *stream_url = NULL;
+        esp_err_t url_ret = tunein_resolver_cached_get(guide_id, &stream_url);
         if (url_ret == ESP_OK)
+            station_start(title, image_url, stream_url, true);
+        else if (url_ret == ESP_ERR_NOT_FOUND)
+            url_ret = station_resolve_start(guide_id, title, image_url);
+        if (url_ret != ESP_OK)
         {
-            media_sourece_t source = {
-                .type = MP_SOURCE_TYPE_TUNE_IN,
-                .url = radio_station->stream_url,
-            };
-            player_source_set(&source);
-            metadata_set(radio_station->title, radio_station->title, radio_station->stream_url, 0, radio_station->stream_url, radio_station->image_url);
-            audio_err_t play_ret = player_play();
-            if (play_ret != ESP_OK)
-                msg_window_show_ok("%s  Player error: %d", LV_SYMBOL_WARNING, play_ret);
-        }
-        else
-        {
+            tap_time = 0;
             msg_window_show_ok("%s  TuneIn get URL error: %d", LV_SYMBOL_WARNING, url_ret);
         }
     }
@@ -128,89 +179,114 @@ static void station_button_handler(lv_event_t *e)
     }
 }
 
-static esp_err_t tunein_favorites_get(radio_station_t **stations, int *count)
-{
-    esp_err_t ret = ESP_OK;
-    int http_res_size;
-    char *http_response = NULL;
-    cJSON *json_root = NULL;
-    *stations = NULL;
-
-    if (!heap_caps_check_integrity_all(true))
-        ESP_LOGE(TAG, "Heap corruption detected! - tunein_favorites_get - 1");
-    else
-        ESP_LOGI(TAG, "Heap corruption not detected! - tunein_favorites_get - 1");
-
-    ret = http_client_get(URL_FAVORITES, &http_response, &http_res_size, HTTP_RESPONSE_MAX_SIZE);
+static const char *FIELD_KEYS[STATION_FIELD_COUNT] = {"GuideId", "Image", "Title", "Subtitle", "Description"};
 
-    if (!heap_caps_check_integrity_all(true))
-        ESP_LOGE(TAG, "Heap corruption detected! - tunein_favorites_get - 2");
-    else
-        ESP_LOGI(TAG, "Heap corruption not detected! - tunein_favorites_get - 2");
-
-    ESP_GOTO_ON_ERROR(ret, err, TAG, "Cannot download TuneIn favorites");
-
-    cJSON *json_station = NULL;
-    cJSON *json_stations = NULL;
-    json_root = cJSON_Parse(http_response);
-
-    cJSON *Header = cJSON_GetObjectItem(json_root, "Header");
-    char *Title = cJSON_GetObjectItem(Header, "Title")->valuestring;
-    ESP_LOGI(TAG, "TuneIn folder name: %s", Title);
+typedef struct
+{
+    station_list_builder_t builder;
+    bool in_header;
+    bool in_items;
+    int field;
+    esp_err_t error;
+} favorites_parser_t;
 
-    json_stations = cJSON_GetObjectItemCaseSensitive(json_root, "Items");
-    int station_count = cJSON_GetArraySize(json_stations);
-    radio_station_t *radio_stations = (radio_station_t *)malloc(sizeof(radio_station_t) * station_count);
-    ESP_GOTO_ON_FALSE(radio_stations, ESP_ERR_NO_MEM, err, TAG, "Not enough memmory for radio stations");
+#define FIELD_FOLDER_NAME STATION_FIELD_COUNT
 
-    int i = 0;
-    cJSON_ArrayForEach(json_station, json_stations)
+// Document: {"Header": {"Title": ...}, "Items": [{"GuideId": ..., "Image": ..., ...}, ...]}
+static bool favorites_json_cb(json_event_t event, const char *value, int len, int depth, void *user_data)
+{
+    favorites_parser_t *fp = (favorites_parser_t *)user_data;
+    switch (event)
     {
-        cJSON *guide_id = cJSON_GetObjectItemCaseSensitive(json_station, "GuideId");
-        cJSON *image_url = cJSON_GetObjectItemCaseSensitive(json_station, "Image");
-        cJSON *title = cJSON_GetObjectItemCaseSensitive(json_station, "Title");
-        cJSON *subtitle = cJSON_GetObjectItemCaseSensitive(json_station, "Subtitle");
-        cJSON *description = cJSON_GetObjectItemCaseSensitive(json_station, "Description");
-
-        radio_stations[i].guide_id = NULL;
-        radio_stations[i].stream_url = NULL;
-        radio_stations[i].image_url = NULL;
-        radio_stations[i].title = NULL;
-        radio_stations[i].subtitle = NULL;
-        radio_stations[i].description = NULL;
-
-        if (cJSON_IsString(title) && title->valuestring != NULL)
-            radio_stations[i].title = strdup(title->valuestring);
-        if (cJSON_IsString(guide_id) && guide_id->valuestring != NULL)
-            radio_stations[i].guide_id = strdup(guide_id->valuestring);
-        if (cJSON_IsString(subtitle) && subtitle->valuestring != NULL)
-            radio_stations[i].subtitle = strdup(subtitle->valuestring);
-        if (cJSON_IsString(description) && description->valuestring != NULL)
-            radio_stations[i].description = strdup(description->valuestring);
-        if (cJSON_IsString(image_url) && image_url->valuestring != NULL)
-            radio_stations[i].image_url = strdup(image_url->valuestring);
-
-        i++;
+    case JSON_EVENT_KEY:
+        if (depth == 1)
+        {
+            fp->in_header = strcmp(value, "Header") == 0;
+            fp->in_items = strcmp(value, "Items") == 0;
+        }
+        fp->field = -1;
+        if (depth == 3 && fp->in_items && fp->builder.count > 0)
+        {
+            for (int i = 0; i < STATION_FIELD_COUNT; i++)
+            {
+                if (strcmp(value, FIELD_KEYS[i]) == 0)
+                    fp->field = i;
+            }
+        }
+        else if (depth == 2 && fp->in_header && strcmp(value, "Title") == 0)
+        {
+            fp->field = FIELD_FOLDER_NAME;
+        }
+        break;
+    case JSON_EVENT_STRING:
+        if (fp->field == FIELD_FOLDER_NAME)
+        {
+            ESP_LOGI(TAG, "TuneIn folder name: %s", value);
+        }
+        else if (fp->field >= 0)
+        {
+            fp->error = station_list_builder_set(&fp->builder, fp->field, value, len);
+            if (fp->error != ESP_OK)
+                return false;
+        }
+        fp->field = -1;
+        break;
+    case JSON_EVENT_OBJECT_START:
+        if (depth == 2 && fp->in_items)
+        {
+            fp->error = station_list_builder_add(&fp->builder);
+            if (fp->error != ESP_OK)
+                return false;
+        }
+        fp->field = -1;
+        break;
+    default:
+        fp->field = -1;
+        break;
     }
+    return true;
+}
 
-    *count = station_count;
-    *stations = radio_stations;
+static bool favorites_chunk_cb(const char *chunk, int len, void *user_data)
+{
+    json_stream_t *parser = (json_stream_t *)user_data;
+    return json_stream_feed(parser, chunk, len) == ESP_OK;
+}
 
-err:
-    if (json_root)
-    {
-        cJSON_Delete(json_root);
-    }
-    if (http_response)
-    {
-        free(http_response);
-    }
+static esp_err_t tunein_favorites_get(station_list_t **list)
+{
+    esp_err_t ret = ESP_OK;
+    char *chunk_buffer = NULL;
+    json_stream_t *parser = NULL;
+    favorites_parser_t fp = {
+        .field = -1,
+        .error = ESP_OK,
+    };
+    station_list_builder_init(&fp.builder);
+    *list = NULL;
+    int64_t start = esp_timer_get_time();
+
+    chunk_buffer = (char *)malloc(HTTP_CLIENT_CHUNK_SIZE);
+    parser = (json_stream_t *)malloc(sizeof(json_stream_t));
+    ESP_GOTO_ON_FALSE(chunk_buffer && parser, ESP_ERR_NO_MEM, err, TAG, "Not enough memmory for JSON parser");
+    json_stream_init(parser, favorites_json_cb, &fp);
+
+    ret = http_client_get_stream(URL_FAVORITES, chunk_buffer, HTTP_CLIENT_CHUNK_SIZE, favorites_chunk_cb, parser);
+    ESP_GOTO_ON_ERROR(ret, err, TAG, "Cannot download TuneIn favorites");
+    ESP_GOTO_ON_ERROR(fp.error, err, TAG, "Not enough memmory for radio stations");
+    ESP_GOTO_ON_FALSE((parser->depth == 0 && !parser->stopped), ESP_FAIL, err, TAG, "Invalid TuneIn favorites JSON");
 
-    if (!heap_caps_check_integrity_all(true))
-        ESP_LOGE(TAG, "Heap corruption detected! - tunein_favorites_get - end");
-    else
-        ESP_LOGI(TAG, "Heap corruption not detected! - tunein_favorites_get - end");
+    int pool_size = fp.builder.pool_size;
+    ret = station_list_builder_finish(&fp.builder, list);
+    ESP_GOTO_ON_ERROR(ret, err, TAG, "Not enough memmory for radio stations");
+    ESP_LOGI(TAG, "%d favorites parsed in %lld ms, %d bytes of strings", (*list)->count, (esp_timer_get_time() - start) / 1000, pool_size);
 
+err:
+    if (chunk_buffer)
+        free(chunk_buffer);
+    if (parser)
+        free(parser);
+    station_list_builder_free(&fp.builder);
     return ret;
 }
 
@@ -218,6 +294,11 @@ err:
 #define BUTTON_SIZE 160
 #define BUTTON_IMAGE_SIZE 128
 
+static void canvas_delete_handler(lv_event_t *e)
+{
+    free(lv_event_get_user_data(e));
+}
+
 static void refresh_button_handler(lv_event_t *e)
 {
     tunein_browser_refresh();
@@ -242,130 +323,247 @@ static void add_refresh_button(int item_count)
 
 static void free_radio_station_list()
 {
-    if (radio_stations != NULL)
+    if (stations != NULL)
+        free(stations);
+    stations = NULL;
+}
+
+static void logo_request_next(void);
+
+static void logo_loaded_cb(esp_err_t ret, lv_img_dsc_t *img, uint32_t group, void *user_data)
+{
+    if (group != logo_generation)
+    {
+        if (ret == ESP_OK)
+            free((void *)img->data);
+        return;
+    }
+    int i = (intptr_t)user_data;
+    if (ret == ESP_OK)
     {
-        for (int i = 0; i < radio_stations_size; i++)
+        // replace the placeholder, decoded image is already scaled to the button, it's freed with the canvas
+        lv_obj_clean(logo_buttons[i]);
+        lv_obj_t *canvas = lv_canvas_create(logo_buttons[i]);
+        lv_obj_add_event_cb(canvas, canvas_delete_handler, LV_EVENT_DELETE, (void *)img->data);
+        lv_canvas_set_buffer(canvas, (void *)img->data, img->header.w, img->header.h, LV_IMG_CF_TRUE_COLOR);
+        lv_obj_center(canvas);
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Cannot download station image: %s", station_list_get(stations, i, STATION_TITLE));
+    }
+    if (++logo_done == stations->count)
+        ESP_LOGI(TAG, "All %d station logos loaded in %lld ms", logo_done, (esp_timer_get_time() - refresh_start) / 1000);
+    logo_request_next();
+}
+
+// visible logos first, called with the LVGL port locked
+static uint8_t logo_priority(void *user_data)
+{
+    lv_obj_t *button = logo_buttons[(intptr_t)user_data];
+    lv_coord_t visible_top = lv_obj_get_scroll_y(station_list);
+    lv_coord_t visible_bottom = visible_top + lv_obj_get_height(station_list);
+    lv_coord_t y = lv_obj_get_y(button);
+    bool visible = y < visible_bottom && y + lv_obj_get_height(button) > visible_top;
+    return visible ? IMG_LOADER_PRIORITY_HIGH : IMG_LOADER_PRIORITY_LOW;
+}
+
+static void logo_retry_timer_cb(lv_timer_t *timer)
+{
+    logo_retry_timer = NULL; // deleted after its only run
+    if (logo_buttons != NULL && stations != NULL)
+        logo_request_next();
+}
+
+static void station_list_scroll_handler(lv_event_t *e)
+{
+    if (logo_buttons != NULL)
+        img_loader_priority_update(logo_generation, logo_priority);
+}
+
+// the loader queue is bounded, remaining logos are queued as the previous ones complete
+static void logo_request_next(void)
+{
+    while (logo_next < stations->count)
+    {
+        int i = logo_next;
+        const char *image_url = station_list_get(stations, i, STATION_IMAGE_URL);
+        if (image_url == NULL)
         {
-            if (radio_stations[i].guide_id != NULL)
-                free(radio_stations[i].guide_id);
-            if (radio_stations[i].stream_url != NULL)
-                free(radio_stations[i].stream_url);
-            if (radio_stations[i].image_url != NULL)
-                free(radio_stations[i].image_url);
-            if (radio_stations[i].title != NULL)
-                free(radio_stations[i].title);
-            if (radio_stations[i].subtitle != NULL)
-                free(radio_stations[i].subtitle);
-            if (radio_stations[i].description != NULL)
-                free(radio_stations[i].description);
+            logo_next++;
+            logo_done++;
+            continue;
         }
-        free(radio_stations);
-        radio_stations = NULL;
-        radio_stations_size = 0;
+        if (img_loader_request(image_url, BUTTON_IMAGE_SIZE, BUTTON_IMAGE_SIZE, logo_priority((void *)(intptr_t)i),
+                               logo_generation, logo_loaded_cb, (void *)(intptr_t)i) != ESP_OK)
+        {
+            // the queue may be full of other images, try again later
+            if (logo_retry_timer == NULL)
+            {
+                logo_retry_timer = lv_timer_create(logo_retry_timer_cb, LOGO_RETRY_MS, NULL);
+                lv_timer_set_repeat_count(logo_retry_timer, 1);
+            }
+            break;
+        }
+        logo_next++;
     }
 }
 
-void tunein_browser_refresh(void)
+static lv_obj_t *add_station_button(int i)
 {
-    if (!heap_caps_check_integrity_all(true))
-        ESP_LOGE(TAG, "Heap corruption detected! - tunein_browser_refresh - 1");
-    else
-        ESP_LOGI(TAG, "Heap corruption not detected! - tunein_browser_refresh - 1");
+    uint8_t col = i % COL_COUNT;
+    uint8_t row = i / COL_COUNT;
+    const char *title = station_list_get(stations, i, STATION_TITLE);
+    const char *guide_id = station_list_get(stations, i, STATION_GUIDE_ID);
+
+    ESP_LOGD(TAG, "title=%s, i=%d, col=%d, row=%d", title, i, col, row);
 
-    msg_window_show_text("Loading...");
+    lv_obj_t *button = lv_btn_create(station_list);
+    lv_obj_add_flag(button, LV_OBJ_FLAG_CHECKABLE);
+    lv_obj_add_event_cb(button, station_button_handler, LV_EVENT_VALUE_CHANGED, (void *)(intptr_t)i);
+    lv_obj_set_grid_cell(button, LV_GRID_ALIGN_STRETCH, col, 1, LV_GRID_ALIGN_STRETCH, row, 1);
+    if (active_station_guide_id != NULL && guide_id != NULL && strcmp(active_station_guide_id, guide_id) == 0)
+    {
+        lv_obj_add_state(button, LV_STATE_CHECKED);
+        active_station_button = button;
+    }
+
+    // placeholder until the logo arrives (or if it cannot be loaded)
+    lv_obj_t *label = lv_label_create(button);
+    lv_label_set_text(label, title != NULL ? title : "");
+    lv_label_set_long_mode(label, LV_LABEL_LONG_SCROLL_CIRCULAR);
+    lv_obj_align(label, LV_ALIGN_BOTTOM_MID, 0, 0);
+
+    lv_obj_t *img = lv_img_create(button);
+    lv_img_set_src(img, &radio_128x104);
+    lv_obj_align(img, LV_ALIGN_TOP_MID, 0, 8);
+    return button;
+}
+
+/* Show the station list in the grid, takes the ownership of the list */
+static void stations_show(station_list_t *list)
+{
+    // drop the pending logos of the previous list before its buttons are deleted
+    img_loader_cancel(logo_generation);
+    logo_generation++;
+    if (logo_buttons != NULL)
+        free(logo_buttons);
+    logo_buttons = NULL;
+    logo_next = 0;
+    logo_done = 0;
+
+    active_station_button = NULL;
     lv_obj_clean(station_list);
     free_radio_station_list();
-    if (tunein_favorites_get(&radio_stations, &radio_stations_size) == ESP_OK)
+    stations = list;
+    tunein_resolver_prefetch(stations);
+
+    if (grid_col_dsc == NULL)
     {
-        lv_coord_t *col_dsc = (lv_coord_t *)malloc((COL_COUNT + 1) * sizeof(lv_coord_t));
+        grid_col_dsc = (lv_coord_t *)malloc((COL_COUNT + 1) * sizeof(lv_coord_t));
         for (int i = 0; i < COL_COUNT; i++)
         {
-            col_dsc[i] = BUTTON_SIZE;
-        }
-        col_dsc[COL_COUNT] = LV_GRID_TEMPLATE_LAST;
-
-        int ROW_COUNT = ((radio_stations_size + 1) / COL_COUNT) + 1;
-        lv_coord_t *row_dsc = (lv_coord_t *)malloc((ROW_COUNT + 1) * sizeof(lv_coord_t));
-        for (int i = 0; i < ROW_COUNT; i++)
-        {
-            row_dsc[i] = BUTTON_SIZE;
+            grid_col_dsc[i] = BUTTON_SIZE;
         }
-        row_dsc[ROW_COUNT] = LV_GRID_TEMPLATE_LAST;
+        grid_col_dsc[COL_COUNT] = LV_GRID_TEMPLATE_LAST;
+    }
 
-        ESP_LOGD(TAG, "radio_stations_size=%d, COL_COUNT=%d, ROW_COUNT=%d", radio_stations_size, COL_COUNT, ROW_COUNT);
+    int ROW_COUNT = ((stations->count + 1) / COL_COUNT) + 1;
+    if (grid_row_dsc != NULL)
+        free(grid_row_dsc);
+    grid_row_dsc = (lv_coord_t *)malloc((ROW_COUNT + 1) * sizeof(lv_coord_t));
+    for (int i = 0; i < ROW_COUNT; i++)
+    {
+        grid_row_dsc[i] = BUTTON_SIZE;
+    }
+    grid_row_dsc[ROW_COUNT] = LV_GRID_TEMPLATE_LAST;
 
-        lv_obj_set_style_grid_column_dsc_array(station_list, col_dsc, 0);
-        lv_obj_set_style_grid_row_dsc_array(station_list, row_dsc, 0);
-        lv_obj_set_layout(station_list, LV_LAYOUT_GRID);
+    ESP_LOGD(TAG, "stations=%d, COL_COUNT=%d, ROW_COUNT=%d", stations->count, COL_COUNT, ROW_COUNT);
 
-        lv_obj_t *img;
-        lv_obj_t *button;
-        lv_obj_t *label;
-        lv_obj_t *canvas;
-        void *canvas_buffer;
+    lv_obj_set_style_grid_column_dsc_array(station_list, grid_col_dsc, 0);
+    lv_obj_set_style_grid_row_dsc_array(station_list, grid_row_dsc, 0);
+    lv_obj_set_layout(station_list, LV_LAYOUT_GRID);
 
-        if (!heap_caps_check_integrity_all(true))
-            ESP_LOGE(TAG, "Heap corruption detected! - tunein_browser_refresh - 2");
-        else
-            ESP_LOGI(TAG, "Heap corruption not detected! - tunein_browser_refresh - 2");
+    logo_buttons = (lv_obj_t **)malloc((stations->count > 0 ? stations->count : 1) * sizeof(lv_obj_t *));
+    for (int i = 0; i < stations->count; i++)
+    {
+        lv_obj_t *button = add_station_button(i);
+        if (logo_buttons != NULL)
+            logo_buttons[i] = button;
+    }
+    add_refresh_button(stations->count);
 
-        for (int i = 0; i < radio_stations_size; i++)
-        {
-            msg_window_show_text("Loading %d/%d", radio_stations_size, i + 1);
+    if (logo_buttons != NULL)
+    {
+        // positions are needed to fetch the visible logos first
+        lv_obj_update_layout(station_list);
+        logo_request_next();
+    }
+    ESP_LOGI(TAG, "Station grid ready in %lld ms", (esp_timer_get_time() - refresh_start) / 1000);
+}
 
-            uint8_t col = i % COL_COUNT;
-            uint8_t row = i / COL_COUNT;
+/*
+ * Download the favorites off the LVGL task and reconcile them with the shown list.
+ * The grid is rebuilt if the list changed or if the user asked for the refresh.
+ */
+static void favorites_fetch_task(void *p)
+{
+    bool user_refresh = (bool)(intptr_t)p;
+    station_list_t *list = NULL;
+    esp_err_t ret = tunein_favorites_get(&list);
 
-            ESP_LOGD(TAG, "title=%s, i=%d, col=%d, row=%d", radio_stations[i].title, i, col, row);
+    lvgl_port_lock(0);
+    bool changed = ret == ESP_OK && !station_list_equal(list, stations);
+    if (ret == ESP_OK && (changed || user_refresh))
+    {
+        ESP_LOGI(TAG, "Favorites downloaded in %lld ms, %s", (esp_timer_get_time() - refresh_start) / 1000, changed ? "changed" : "not changed");
+        stations_show(list);
+    }
+    else if (list != NULL)
+    {
+        free(list);
+    }
+    list = stations;
+    if (user_refresh)
+    {
+        if (ret == ESP_OK)
+            msg_window_hide();
+        else
+            msg_window_show_ok("%s  TuneIn favorites error: %d", LV_SYMBOL_WARNING, ret);
+    }
+    lvgl_port_unlock();
 
-            button = lv_btn_create(station_list);
-            lv_obj_add_flag(button, LV_OBJ_FLAG_CHECKABLE);
-            lv_obj_add_event_cb(button, station_button_handler, LV_EVENT_VALUE_CHANGED, &radio_stations[i]);
-            lv_obj_set_grid_cell(button, LV_GRID_ALIGN_STRETCH, col, 1, LV_GRID_ALIGN_STRETCH, row, 1);
-            if (active_station_guide_id != NULL && strcmp(active_station_guide_id, radio_stations[i].guide_id) == 0)
-            {
-                lv_obj_add_state(button, LV_STATE_CHECKED);
-            }
+    // the shown list is replaced only by this task, it's safe to read here
+    if (changed)
+        station_list_save(list, TUNEIN_FAVORITES_FILE);
 
-            lv_img_dsc_t station_image = {
-                .data = NULL,
-            };
-            if (download_image(radio_stations[i].image_url, &station_image) != ESP_OK)
-            {
-                ESP_LOGE(TAG, "Cannot download station image: %s", radio_stations[i].title);
-                if (station_image.data)
-                    free(station_image.data);
-
-                label = lv_label_create(button);
-                lv_label_set_text(label, radio_stations[i].title);
-                lv_label_set_long_mode(label, LV_LABEL_LONG_SCROLL_CIRCULAR);
-                lv_obj_align(label, LV_ALIGN_BOTTOM_MID, 0, 0);
-
-                img = lv_img_create(button);
-                lv_img_set_src(img, &radio_128x104);
-                lv_obj_align(img, LV_ALIGN_TOP_MID, 0, 8);
-                continue;
-            }
+    lvgl_port_lock(0);
+    fetch_running = false;
+    lvgl_port_unlock();
+    vTaskDelete(NULL);
+}
 
-            int h_zoom = (BUTTON_IMAGE_SIZE * LV_IMG_ZOOM_NONE) / station_image.header.w;
-            int v_zoom = (BUTTON_IMAGE_SIZE * LV_IMG_ZOOM_NONE) / station_image.header.h;
-            uint16_t zoom = h_zoom < v_zoom ? h_zoom : v_zoom;
-            int h_size = (station_image.header.w * zoom) / LV_IMG_ZOOM_NONE;
-            int v_size = (station_image.header.h * zoom) / LV_IMG_ZOOM_NONE;
-
-            canvas_buffer = (void *)malloc(h_size * v_size * sizeof(uint16_t));
-            // ESP_GOTO_ON_FALSE(canvas_buffer != NULL, ESP_ERR_NO_MEM, err, TAG, "Cannot allocate memmory for canvas buffer");
-            canvas = lv_canvas_create(button);
-            lv_canvas_set_buffer(canvas, canvas_buffer, h_size, v_size, LV_IMG_CF_TRUE_COLOR);
-            lv_canvas_transform(canvas, &station_image, 0, zoom, 0, 0, 0, 0, false);
-            lv_obj_center(canvas);
-
-            if (station_image.data)
-                free(station_image.data);
-        }
+static void favorites_fetch_start(bool user_refresh)
+{
+    if (fetch_running)
+        return;
+    refresh_start = esp_timer_get_time();
+    if (user_refresh)
+        msg_window_show_text("Loading...");
+    BaseType_t ret = xTaskCreatePinnedToCore(&favorites_fetch_task, "tunein_fetch", 8 * 1024, (void *)(intptr_t)user_refresh, 3, NULL, 0);
+    if (ret != pdPASS)
+    {
+        ESP_LOGE(TAG, "Cannot create tunein_fetch task, error code: %d", ret);
+        if (user_refresh)
+            msg_window_hide();
+        return;
     }
-    add_refresh_button(radio_stations_size);
-    msg_window_hide();
+    fetch_running = true;
+}
+
+void tunein_browser_refresh(void)
+{
+    favorites_fetch_start(true);
 }
 
 static void player_event_cb(player_event_t event, void *subject)
@@ -378,6 +576,12 @@ static void player_event_cb(player_event_t event, void *subject)
         {
             ESP_LOGI(TAG, "Hide loading window [ Connecting... ]");
             msg_window_hide();
+            if (tap_time != 0 && *player_state == MP_STATE_PLAYING)
+                ESP_LOGI(TAG, "Station tap to playing in %lld ms", (esp_timer_get_time() - tap_time) / 1000);
+            // the cached url may be outdated, resolve it again
+            if (*player_state == MP_STATE_ERROR && tap_time != 0)
+                tunein_resolver_invalidate(active_station_guide_id);
+            tap_time = 0;
         }
     }
     else if (event == MP_EVENT_SOURCE)
@@ -399,7 +603,16 @@ lv_obj_t *tunein_browser_create(lv_obj_t *parent)
 {
     station_list = lv_obj_create(parent);
     lv_obj_set_style_pad_all(station_list, UI_PADDING_ALL, LV_PART_MAIN);
-    add_refresh_button(0);
-    player_add_event_listener(player_event_cb);
+    lv_obj_add_event_cb(station_list, station_list_scroll_handler, LV_EVENT_SCROLL_END, NULL);
+    player_add_event_listener(player_event_cb, EVENT_BUS_LVGL);
+
+    // last known favorites are shown right away, then updated from TuneIn in the background
+    refresh_start = esp_timer_get_time();
+    station_list_t *list = NULL;
+    if (station_list_load(TUNEIN_FAVORITES_FILE, &list) == ESP_OK)
+        stations_show(list);
+    else
+        add_refresh_button(0);
+    favorites_fetch_start(false);
     return station_list;
 }
\ No newline at end of file
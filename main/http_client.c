@@ -1,14 +1,37 @@
 #include "http_client.h"
 
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "esp_wifi.h"
 #include "esp_http_client.h"
+#include "esp_timer.h"
 #include "esp_log.h"
 #include "esp_check.h"
 
+#define HTTP_POOL_SIZE 4
+#define HTTP_POOL_MAX_PER_HOST 2
+#define HTTP_POOL_IDLE_TIMEOUT_MS 15000
+#define HTTP_POOL_HOST_MAX_LEN 64
+#define HTTP_POOL_DRAIN_MAX_BYTES (4 * 1024) // a longer unread rest is dropped with the connection
+
+/* Kept-alive client, host is "scheme://host[:port]" of the last request */
+typedef struct
+{
+    esp_http_client_handle_t client;
+    char host[HTTP_POOL_HOST_MAX_LEN];
+    bool in_use;
+    int64_t last_used;
+} http_pool_slot_t;
+
 static const char *TAG = "HTTP_CLIENT";
 static const int perfect_rssi = -20;
 static const int worst_rssi = -85;
 
+static http_pool_slot_t pool[HTTP_POOL_SIZE];
+static SemaphoreHandle_t pool_lock = NULL;
+static http_client_stats_t stats = {0};
+
 int http_client_wifi_signal_quality_get(void)
 {
     wifi_ap_record_t ap;
@@ -27,60 +50,341 @@ int http_client_wifi_signal_quality_get(void)
     return signal_quality;
 }
 
-esp_err_t http_client_get(char *url, char **response_buffer, int *response_size, int max_response_size)
+esp_err_t http_client_init(void)
 {
-    esp_err_t ret = ESP_OK;
-    int content_length = 0;
-    char *http_buffer = NULL;
-    *response_size = 0;
-    *response_buffer = NULL;
+    ESP_RETURN_ON_FALSE(pool_lock == NULL, ESP_OK, TAG, "HTTP client pool already initialized");
+    pool_lock = xSemaphoreCreateMutex();
+    ESP_RETURN_ON_FALSE(pool_lock != NULL, ESP_ERR_NO_MEM, TAG, "Cannot create HTTP client pool lock");
+    return ESP_OK;
+}
 
-    if (!heap_caps_check_integrity_all(true))
-        ESP_LOGE(TAG, "Heap corruption detected! - http_client_get");
-    else
-        ESP_LOGI(TAG, "Heap corruption not detected! - http_client_get");
+void http_client_stats_get(http_client_stats_t *stats_out)
+{
+    if (pool_lock != NULL)
+        xSemaphoreTake(pool_lock, portMAX_DELAY);
+    *stats_out = stats;
+    if (pool_lock != NULL)
+        xSemaphoreGive(pool_lock);
+}
+
+static bool host_get(const char *url, char *host, int len)
+{
+    const char *start = strstr(url, "://");
+    if (start == NULL)
+        return false;
+    const char *end = strchr(start + 3, '/');
+    int host_len = end != NULL ? end - url : strlen(url);
+    if (host_len >= len)
+        return false;
+    memcpy(host, url, host_len);
+    host[host_len] = 0;
+    return true;
+}
 
+static esp_http_client_handle_t client_create(char *url)
+{
     esp_http_client_config_t config = {
         .url = url,
     };
-    esp_http_client_handle_t client = esp_http_client_init(&config);
+    return esp_http_client_init(&config);
+}
+
+static void slot_free(http_pool_slot_t *slot)
+{
+    esp_http_client_close(slot->client);
+    esp_http_client_cleanup(slot->client);
+    slot->client = NULL;
+    slot->in_use = false;
+}
+
+/* Get an idle connection to the host of the url, or a new client if there is none */
+static esp_http_client_handle_t pool_acquire(char *url, bool *reused)
+{
+    char host[HTTP_POOL_HOST_MAX_LEN];
+    *reused = false;
+    if (pool_lock == NULL || !host_get(url, host, sizeof(host)))
+        return client_create(url);
+
+    xSemaphoreTake(pool_lock, portMAX_DELAY);
+    int64_t now = esp_timer_get_time();
+    http_pool_slot_t *slot = NULL;
+    http_pool_slot_t *free_slot = NULL;
+    int host_count = 0;
+    for (int i = 0; i < HTTP_POOL_SIZE; i++)
+    {
+        http_pool_slot_t *s = &pool[i];
+        if (s->client != NULL && !s->in_use && now - s->last_used > HTTP_POOL_IDLE_TIMEOUT_MS * 1000LL)
+        {
+            ESP_LOGD(TAG, "Close idle connection to %s", s->host);
+            slot_free(s);
+        }
+        if (s->client == NULL)
+        {
+            if (free_slot == NULL)
+                free_slot = s;
+            continue;
+        }
+        if (strcmp(s->host, host) == 0)
+        {
+            host_count++;
+            if (slot == NULL && !s->in_use)
+                slot = s;
+        }
+        else if (!s->in_use && (free_slot == NULL || (free_slot->client != NULL && s->last_used < free_slot->last_used)))
+        {
+            // least recently used idle connection of another host
+            free_slot = s;
+        }
+    }
+
+    esp_http_client_handle_t client = NULL;
+    if (slot != NULL)
+    {
+        slot->in_use = true;
+        client = slot->client;
+        *reused = true;
+    }
+    else if (free_slot != NULL && host_count < HTTP_POOL_MAX_PER_HOST)
+    {
+        if (free_slot->client != NULL)
+            slot_free(free_slot);
+        free_slot->client = client_create(url);
+        if (free_slot->client != NULL)
+        {
+            strcpy(free_slot->host, host);
+            free_slot->in_use = true;
+        }
+        client = free_slot->client;
+    }
+    xSemaphoreGive(pool_lock);
+
+    if (client == NULL)
+        return client_create(url); // pool is full, one-shot client
+    if (*reused && esp_http_client_set_url(client, url) != ESP_OK)
+    {
+        http_client_close(client);
+        return client_create(url);
+    }
+    return client;
+}
+
+/* Drop a pooled client whose connection cannot be used anymore */
+static void pool_discard(esp_http_client_handle_t client)
+{
+    if (pool_lock != NULL)
+    {
+        xSemaphoreTake(pool_lock, portMAX_DELAY);
+        for (int i = 0; i < HTTP_POOL_SIZE; i++)
+        {
+            if (pool[i].client == client)
+            {
+                slot_free(&pool[i]);
+                xSemaphoreGive(pool_lock);
+                return;
+            }
+        }
+        xSemaphoreGive(pool_lock);
+    }
+    esp_http_client_close(client);
+    esp_http_client_cleanup(client);
+}
+
+esp_err_t http_client_open(char *url, esp_http_client_handle_t *client, int *content_length)
+{
+    esp_err_t ret = ESP_OK;
+    esp_http_client_handle_t http_client = NULL;
+    bool reused = false;
+    bool connected = false;
+    *client = NULL;
+    *content_length = 0;
 
-    ret = esp_http_client_set_method(client, HTTP_METHOD_GET);
-    ESP_GOTO_ON_ERROR(ret, err, TAG, "Failed to set HTTP method: GET");
+    int length = 0;
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        http_client = pool_acquire(url, &reused);
+        ESP_RETURN_ON_FALSE(http_client != NULL, ESP_FAIL, TAG, "Cannot init HTTP client");
+
+        ret = esp_http_client_set_method(http_client, HTTP_METHOD_GET);
+        ESP_GOTO_ON_ERROR(ret, err, TAG, "Failed to set HTTP method: GET");
 
-    ret = esp_http_client_open(client, 0);
+        ret = esp_http_client_open(http_client, 0);
+        if (ret == ESP_OK)
+        {
+            length = esp_http_client_fetch_headers(http_client);
+            if (length < 0)
+                ret = ESP_ERR_HTTP_FETCH_HEADER;
+        }
+        if (ret == ESP_OK || !reused)
+            break;
+        // the server closed the kept-alive connection, retry on a new one
+        ESP_LOGD(TAG, "Kept-alive connection lost, reconnecting");
+        pool_discard(http_client);
+        http_client = NULL;
+        if (pool_lock != NULL)
+        {
+            xSemaphoreTake(pool_lock, portMAX_DELAY);
+            stats.reuse_failures++;
+            xSemaphoreGive(pool_lock);
+        }
+    }
     ESP_GOTO_ON_ERROR(ret, err, TAG, "Failed to open HTTP connection");
+    connected = true;
 
-    content_length = esp_http_client_fetch_headers(client);
-    ESP_GOTO_ON_FALSE((content_length >= 0), ESP_ERR_HTTP_FETCH_HEADER, err, TAG, "HTTP client fetch headers failed");
-    ESP_GOTO_ON_FALSE((content_length < max_response_size), ESP_ERR_NO_MEM, err, TAG, "Content length bigger then max_response_size");
+    if (pool_lock != NULL)
+    {
+        xSemaphoreTake(pool_lock, portMAX_DELAY);
+        if (reused)
+            stats.handshakes_avoided++;
+        else
+            stats.connections++;
+        xSemaphoreGive(pool_lock);
+    }
 
-    int http_code = esp_http_client_get_status_code(client);
-    ESP_LOGI(TAG, "HTTP response code = %d, content-lenght = %d", http_code, content_length);
+    int http_code = esp_http_client_get_status_code(http_client);
+    ESP_LOGI(TAG, "HTTP response code = %d, content-lenght = %d, %s connection, connections = %lu, handshakes avoided = %lu, drains skipped = %lu",
+             http_code, length, reused ? "kept-alive" : "new", stats.connections, stats.handshakes_avoided, stats.drains_skipped);
     ESP_GOTO_ON_FALSE((http_code >= 200 && http_code < 300), ESP_FAIL, err, TAG, "HTTP request returned with error code");
 
-    if (content_length == 0)
+    *client = http_client;
+    *content_length = length;
+    return ESP_OK;
+err:
+    if (http_client != NULL)
+    {
+        if (connected)
+            http_client_close(http_client); // HTTP error status, the connection can be reused
+        else
+            pool_discard(http_client);
+    }
+    return ret;
+}
+
+int http_client_read(esp_http_client_handle_t client, char *buffer, int len)
+{
+    return esp_http_client_read_response(client, buffer, len);
+}
+
+void http_client_close(esp_http_client_handle_t client)
+{
+    if (client == NULL)
+        return;
+    http_pool_slot_t *slot = NULL;
+    if (pool_lock != NULL)
+    {
+        xSemaphoreTake(pool_lock, portMAX_DELAY);
+        for (int i = 0; i < HTTP_POOL_SIZE && slot == NULL; i++)
+        {
+            if (pool[i].client == client)
+                slot = &pool[i];
+        }
+        xSemaphoreGive(pool_lock);
+    }
+    if (slot == NULL)
+    {
+        pool_discard(client);
+        return;
+    }
+    // the rest of the response has to be read before the connection can be reused, a new handshake is cheaper than a long rest
+    char drain[512];
+    int drained = 0;
+    while (drained < HTTP_POOL_DRAIN_MAX_BYTES && !esp_http_client_is_complete_data_received(client))
+    {
+        int len = esp_http_client_read_response(client, drain, sizeof(drain));
+        if (len <= 0)
+            break;
+        drained += len;
+    }
+    if (!esp_http_client_is_complete_data_received(client))
+    {
+        ESP_LOGD(TAG, "More than %d bytes of the response left, closing the connection", HTTP_POOL_DRAIN_MAX_BYTES);
+        xSemaphoreTake(pool_lock, portMAX_DELAY);
+        stats.drains_skipped++;
+        xSemaphoreGive(pool_lock);
+        pool_discard(client);
+        return;
+    }
+    xSemaphoreTake(pool_lock, portMAX_DELAY);
+    slot->in_use = false;
+    slot->last_used = esp_timer_get_time();
+    xSemaphoreGive(pool_lock);
+}
+
+esp_err_t http_client_get_stream(char *url, char *buffer, int buffer_size, http_client_chunk_cb_t chunk_cb, void *user_data)
+{
+    esp_err_t ret = ESP_OK;
+    int content_length = 0;
+    esp_http_client_handle_t client = NULL;
+
+    ESP_RETURN_ON_ERROR(http_client_open(url, &client, &content_length), TAG, "Cannot open %s", url);
+    int total = 0;
+    while (true)
     {
-        ESP_LOGI(TAG, "HTTP header content length was 0, using max_response_size for response buffer allocation");
-        content_length = max_response_size;
+        int read_len = http_client_read(client, buffer, buffer_size);
+        ESP_GOTO_ON_FALSE((read_len >= 0), ESP_FAIL, err, TAG, "Cannot read HTTP response content");
+        if (read_len == 0)
+            break;
+        total += read_len;
+        if (!chunk_cb(buffer, read_len, user_data))
+            break;
     }
+    ESP_LOGD(TAG, "Streamed %d bytes from HTTP response", total);
+err:
+    http_client_close(client);
+    return ret;
+}
+
+esp_err_t http_client_get(char *url, char **response_buffer, int *response_size, int max_response_size)
+{
+    esp_err_t ret = ESP_OK;
+    int content_length = 0;
+    char *http_buffer = NULL;
+    esp_http_client_handle_t client = NULL;
+    *response_size = 0;
+    *response_buffer = NULL;
+
+    ret = http_client_open(url, &client, &content_length);
+    ESP_GOTO_ON_ERROR(ret, err, TAG, "Cannot open %s", url);
+    ESP_GOTO_ON_FALSE((content_length <= max_response_size), ESP_ERR_NO_MEM, err, TAG, "Content length bigger then max_response_size");
 
-    http_buffer = (char *)malloc(content_length + 1);
+    // without content length the buffer grows with the response, up to max_response_size
+    int capacity = content_length > 0 ? content_length : HTTP_CLIENT_CHUNK_SIZE;
+    if (capacity > max_response_size)
+        capacity = max_response_size;
+    http_buffer = (char *)malloc(capacity + 1);
     ESP_GOTO_ON_FALSE(http_buffer, ESP_ERR_NO_MEM, err, TAG, "Not enough memmory for response buffer");
 
-    int read_len = esp_http_client_read_response(client, http_buffer, content_length);
-    ESP_LOGI(TAG, "Read %d bytes from HTTP response", read_len);
-    ESP_GOTO_ON_FALSE((read_len > 0), ESP_FAIL, err, TAG, "Cannot read HTTP response content");
-    http_buffer[read_len] = 0;
+    int size = 0;
+    while (true)
+    {
+        if (size == capacity)
+        {
+            ESP_GOTO_ON_FALSE((capacity < max_response_size), ESP_ERR_NO_MEM, err, TAG, "Response bigger then max_response_size");
+            capacity = capacity * 2 < max_response_size ? capacity * 2 : max_response_size;
+            char *new_buffer = (char *)realloc(http_buffer, capacity + 1);
+            ESP_GOTO_ON_FALSE(new_buffer, ESP_ERR_NO_MEM, err, TAG, "Not enough memmory for response buffer");
+            http_buffer = new_buffer;
+        }
+        int read_len = http_client_read(client, http_buffer + size, capacity - size);
+        ESP_GOTO_ON_FALSE((read_len >= 0), ESP_FAIL, err, TAG, "Cannot read HTTP response content");
+        if (read_len == 0)
+            break;
+        size += read_len;
+        // the buffer is sized for a known length, growing it only to read the end would be wasted
+        if (content_length > 0 && size >= content_length)
+            break;
+    }
+    ESP_LOGI(TAG, "Read %d bytes from HTTP response", size);
+    ESP_GOTO_ON_FALSE((size > 0), ESP_FAIL, err, TAG, "Cannot read HTTP response content");
+    http_buffer[size] = 0;
 
     *response_buffer = http_buffer;
-    *response_size = read_len;
+    *response_size = size;
 
 err:
     if (ret != ESP_OK && http_buffer)
     {
         free(http_buffer);
     }
-    esp_http_client_close(client);
+    http_client_close(client);
     return ret;
 }
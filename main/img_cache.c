@@ -0,0 +1,416 @@
+#include "img_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <strings.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_check.h"
+
+#define INDEX_FILE IMG_CACHE_DIR "/index.bin"
+#define INDEX_TMP_FILE IMG_CACHE_DIR "/index.tmp"
+#define INDEX_MAGIC 0x31484349 // "ICH1"
+#define HASH_SIZE (IMG_CACHE_MAX_ENTRIES * 2)
+#define HASH_EMPTY 0xFFFF
+
+/* Index file: header followed by header.count entries, both written as-is */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t count;
+    uint32_t use_counter;
+    uint32_t reserved;
+} img_cache_header_t;
+
+typedef struct
+{
+    uint64_t key; // FNV-1a hash of url + box size, also the blob file name
+    uint32_t size;
+    uint32_t last_used;
+    uint16_t width;
+    uint16_t height;
+    uint32_t stored_at; // use_counter when the blob was written, tells a replaced entry apart
+} img_cache_entry_t;
+
+static const char *TAG = "IMG_CACHE";
+
+static img_cache_entry_t *entries = NULL;
+static int entry_count = 0;
+static uint16_t hash_table[HASH_SIZE];
+static uint32_t use_counter = 0;
+static uint32_t tmp_counter = 0;
+static uint32_t total_bytes = 0;
+static bool index_dirty = false;
+static img_cache_stats_t stats = {0};
+static SemaphoreHandle_t lock = NULL;
+static TaskHandle_t th_flush = NULL;
+
+static uint64_t cache_key(const char *url, int box_w, int box_h)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char *c = url; *c; c++)
+    {
+        hash ^= (uint8_t)*c;
+        hash *= 0x100000001b3ULL;
+    }
+    uint32_t box = (box_w << 16) | (box_h & 0xFFFF);
+    for (int i = 0; i < 4; i++)
+    {
+        hash ^= (box >> (i * 8)) & 0xFF;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static void blob_path(uint64_t key, char *path, size_t len)
+{
+    snprintf(path, len, "%s/%016llx.565", IMG_CACHE_DIR, key);
+}
+
+// blobs are written under a name of their own, concurrent puts of the same key do not share a file
+static void blob_tmp_path(uint64_t key, uint32_t id, char *path, size_t len)
+{
+    snprintf(path, len, "%s/%016llx.%lu", IMG_CACHE_DIR, key, id % 1000);
+}
+
+static int hash_find(uint64_t key)
+{
+    uint32_t slot = (uint32_t)key % HASH_SIZE;
+    while (hash_table[slot] != HASH_EMPTY)
+    {
+        if (entries[hash_table[slot]].key == key)
+            return hash_table[slot];
+        slot = (slot + 1) % HASH_SIZE;
+    }
+    return -1;
+}
+
+static void hash_insert(int index)
+{
+    uint32_t slot = (uint32_t)entries[index].key % HASH_SIZE;
+    while (hash_table[slot] != HASH_EMPTY)
+        slot = (slot + 1) % HASH_SIZE;
+    hash_table[slot] = index;
+}
+
+static void hash_rebuild(void)
+{
+    memset(hash_table, 0xFF, sizeof(hash_table));
+    for (int i = 0; i < entry_count; i++)
+        hash_insert(i);
+}
+
+static void schedule_flush(void)
+{
+    index_dirty = true;
+    if (th_flush != NULL)
+        xTaskNotifyGive(th_flush);
+}
+
+// must be called with lock held
+static void entry_remove(int index)
+{
+    char path[64];
+    blob_path(entries[index].key, path, sizeof(path));
+    unlink(path);
+    total_bytes -= entries[index].size;
+    entries[index] = entries[--entry_count];
+    hash_rebuild();
+    schedule_flush();
+}
+
+// must be called with lock held
+static void evict_for(uint32_t size)
+{
+    while (entry_count > 0 && (entry_count >= IMG_CACHE_MAX_ENTRIES || total_bytes + size > IMG_CACHE_MAX_BYTES))
+    {
+        int lru = 0;
+        for (int i = 1; i < entry_count; i++)
+        {
+            if (entries[i].last_used < entries[lru].last_used)
+                lru = i;
+        }
+        ESP_LOGD(TAG, "Evict %016llx, %lu bytes", entries[lru].key, entries[lru].size);
+        entry_remove(lru);
+        stats.evictions++;
+    }
+}
+
+// must be called with lock held
+static esp_err_t index_write(void)
+{
+    img_cache_header_t header = {
+        .magic = INDEX_MAGIC,
+        .count = entry_count,
+        .use_counter = use_counter,
+    };
+    FILE *f = fopen(INDEX_TMP_FILE, "wb");
+    ESP_RETURN_ON_FALSE(f != NULL, ESP_FAIL, TAG, "Cannot create %s", INDEX_TMP_FILE);
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    if (ok && entry_count > 0)
+        ok = fwrite(entries, sizeof(img_cache_entry_t), entry_count, f) == entry_count;
+    ok = fflush(f) == 0 && ok;
+    fsync(fileno(f));
+    fclose(f);
+    ESP_RETURN_ON_FALSE(ok, ESP_FAIL, TAG, "Cannot write %s", INDEX_TMP_FILE);
+
+    // FAT cannot rename over an existing file, index_load() falls back to the tmp file if we stop in between
+    unlink(INDEX_FILE);
+    ESP_RETURN_ON_FALSE(rename(INDEX_TMP_FILE, INDEX_FILE) == 0, ESP_FAIL, TAG, "Cannot rename %s", INDEX_TMP_FILE);
+    index_dirty = false;
+    return ESP_OK;
+}
+
+static esp_err_t index_load(void)
+{
+    struct stat st;
+    if (stat(INDEX_FILE, &st) != 0 && stat(INDEX_TMP_FILE, &st) == 0)
+    {
+        ESP_LOGW(TAG, "Index update was interrupted, using %s", INDEX_TMP_FILE);
+        rename(INDEX_TMP_FILE, INDEX_FILE);
+    }
+
+    entry_count = 0;
+    total_bytes = 0;
+    FILE *f = fopen(INDEX_FILE, "rb");
+    if (f == NULL)
+    {
+        ESP_LOGI(TAG, "No cache index, starting empty");
+        hash_rebuild();
+        return ESP_OK;
+    }
+    img_cache_header_t header;
+    if (fread(&header, sizeof(header), 1, f) == 1 && header.magic == INDEX_MAGIC && header.count <= IMG_CACHE_MAX_ENTRIES)
+    {
+        entry_count = fread(entries, sizeof(img_cache_entry_t), header.count, f);
+        use_counter = header.use_counter;
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Invalid cache index, starting empty");
+    }
+    fclose(f);
+
+    for (int i = 0; i < entry_count; i++)
+        total_bytes += entries[i].size;
+    hash_rebuild();
+    ESP_LOGI(TAG, "Cache index loaded, %d images, %lu bytes", entry_count, total_bytes);
+    return ESP_OK;
+}
+
+// blobs renamed in before a crash that never reached the index, and interrupted writes, are deleted
+static void orphans_remove(void)
+{
+    DIR *dir = opendir(IMG_CACHE_DIR);
+    if (dir == NULL)
+        return;
+    int removed = 0;
+    struct dirent *de;
+    char path[sizeof(IMG_CACHE_DIR) + sizeof(de->d_name) + 1];
+    while ((de = readdir(dir)) != NULL)
+    {
+        if (strcasecmp(de->d_name, "index.bin") == 0)
+            continue;
+        char *end = NULL;
+        uint64_t key = strtoull(de->d_name, &end, 16);
+        if (end == de->d_name + 16 && strcasecmp(end, ".565") == 0 && hash_find(key) >= 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", IMG_CACHE_DIR, de->d_name);
+        if (unlink(path) == 0)
+            removed++;
+    }
+    closedir(dir);
+    if (removed > 0)
+        ESP_LOGI(TAG, "Removed %d files without an index entry", removed);
+}
+
+esp_err_t img_cache_flush(void)
+{
+    ESP_RETURN_ON_FALSE(entries != NULL, ESP_ERR_INVALID_STATE, TAG, "Image cache not initialized");
+    esp_err_t ret = ESP_OK;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (index_dirty)
+    {
+        ret = index_write();
+        ESP_LOGI(TAG, "Index saved, %d images, %lu bytes, hits = %lu, misses = %lu, evictions = %lu",
+                 entry_count, total_bytes, stats.hits, stats.misses, stats.evictions);
+    }
+    xSemaphoreGive(lock);
+    return ret;
+}
+
+// write-back: index changes are collected and saved once after IMG_CACHE_FLUSH_DELAY_MS
+static void flush_task(void *p)
+{
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        vTaskDelay(IMG_CACHE_FLUSH_DELAY_MS / portTICK_PERIOD_MS);
+        ulTaskNotifyTake(pdTRUE, 0);
+        img_cache_flush();
+    }
+}
+
+esp_err_t img_cache_init(void)
+{
+    ESP_RETURN_ON_FALSE(entries == NULL, ESP_OK, TAG, "Image cache already initialized");
+    struct stat st;
+    if (stat(IMG_CACHE_DIR, &st) != 0)
+        ESP_RETURN_ON_FALSE(mkdir(IMG_CACHE_DIR, 0775) == 0, ESP_FAIL, TAG, "Cannot create %s", IMG_CACHE_DIR);
+
+    lock = xSemaphoreCreateMutex();
+    ESP_RETURN_ON_FALSE(lock != NULL, ESP_ERR_NO_MEM, TAG, "Cannot create image cache lock");
+    entries = (img_cache_entry_t *)malloc(IMG_CACHE_MAX_ENTRIES * sizeof(img_cache_entry_t));
+    ESP_RETURN_ON_FALSE(entries != NULL, ESP_ERR_NO_MEM, TAG, "Cannot allocate image cache index");
+    index_load();
+    orphans_remove();
+
+    BaseType_t ret = xTaskCreate(&flush_task, "img_cache_flush", 3 * 1024, NULL, 2, &th_flush);
+    ESP_RETURN_ON_FALSE(ret == pdPASS, ESP_FAIL, TAG, "Cannot create img_cache_flush task, error code: %d", ret);
+    return ESP_OK;
+}
+
+esp_err_t img_cache_get(const char *url, int box_w, int box_h, lv_img_dsc_t *lv_img_dsc)
+{
+    ESP_RETURN_ON_FALSE(entries != NULL, ESP_ERR_INVALID_STATE, TAG, "Image cache not initialized");
+    uint64_t key = cache_key(url, box_w, box_h);
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    int index = hash_find(key);
+    if (index < 0)
+    {
+        stats.misses++;
+        xSemaphoreGive(lock);
+        return ESP_ERR_NOT_FOUND;
+    }
+    img_cache_entry_t entry = entries[index];
+    entries[index].last_used = ++use_counter;
+    // the blob is read without the lock, it may be evicted or replaced meanwhile
+    schedule_flush();
+    xSemaphoreGive(lock);
+
+    esp_err_t ret = ESP_OK;
+    char path[64];
+    uint8_t *data = NULL;
+    blob_path(key, path, sizeof(path));
+    FILE *f = fopen(path, "rb");
+    ESP_GOTO_ON_FALSE(f != NULL, ESP_ERR_NOT_FOUND, err, TAG, "Cannot open %s", path);
+    data = (uint8_t *)malloc(entry.size);
+    ESP_GOTO_ON_FALSE(data != NULL, ESP_ERR_NO_MEM, err, TAG, "Cannot allocate memmory for cached image");
+    ESP_GOTO_ON_FALSE(fread(data, entry.size, 1, f) == 1, ESP_ERR_NOT_FOUND, err, TAG, "Cannot read %s", path);
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    index = hash_find(key);
+    bool current = index >= 0 && entries[index].stored_at == entry.stored_at;
+    if (current)
+        stats.hits++;
+    else
+        stats.misses++;
+    xSemaphoreGive(lock);
+    if (!current)
+    {
+        ESP_LOGD(TAG, "%s changed while reading, treated as a miss", path);
+        free(data);
+        fclose(f);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    lv_img_dsc->header.w = entry.width;
+    lv_img_dsc->header.h = entry.height;
+    lv_img_dsc->header.cf = LV_IMG_CF_TRUE_COLOR;
+    lv_img_dsc->data_size = entry.size;
+    lv_img_dsc->data = data;
+    data = NULL;
+err:
+    if (f != NULL)
+        fclose(f);
+    if (data != NULL)
+        free(data);
+    if (ret == ESP_ERR_NOT_FOUND)
+    {
+        // blob is missing or broken, drop it from the index unless it was replaced meanwhile
+        xSemaphoreTake(lock, portMAX_DELAY);
+        index = hash_find(key);
+        if (index >= 0 && entries[index].stored_at == entry.stored_at)
+            entry_remove(index);
+        stats.misses++;
+        xSemaphoreGive(lock);
+    }
+    return ret;
+}
+
+esp_err_t img_cache_put(const char *url, int box_w, int box_h, const lv_img_dsc_t *lv_img_dsc)
+{
+    ESP_RETURN_ON_FALSE(entries != NULL, ESP_ERR_INVALID_STATE, TAG, "Image cache not initialized");
+    ESP_RETURN_ON_FALSE(lv_img_dsc->data_size <= IMG_CACHE_MAX_BYTES, ESP_ERR_INVALID_SIZE, TAG, "Image too big for the cache");
+    uint64_t key = cache_key(url, box_w, box_h);
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    evict_for(lv_img_dsc->data_size);
+    uint32_t tmp_id = ++tmp_counter;
+    xSemaphoreGive(lock);
+
+    char tmp_path[64];
+    blob_tmp_path(key, tmp_id, tmp_path, sizeof(tmp_path));
+    FILE *f = fopen(tmp_path, "wb");
+    ESP_RETURN_ON_FALSE(f != NULL, ESP_FAIL, TAG, "Cannot create %s", tmp_path);
+    bool ok = fwrite(lv_img_dsc->data, lv_img_dsc->data_size, 1, f) == 1;
+    fclose(f);
+    if (!ok)
+    {
+        unlink(tmp_path);
+        ESP_LOGE(TAG, "Cannot write %s", tmp_path);
+        return ESP_FAIL;
+    }
+
+    char path[64];
+    blob_path(key, path, sizeof(path));
+    xSemaphoreTake(lock, portMAX_DELAY);
+    // another task may have put the same image or filled the cache meanwhile
+    int index = hash_find(key);
+    if (index >= 0)
+        entry_remove(index);
+    evict_for(lv_img_dsc->data_size);
+    unlink(path); // left over without an entry, FAT cannot rename over it
+    if (rename(tmp_path, path) != 0)
+    {
+        xSemaphoreGive(lock);
+        unlink(tmp_path);
+        ESP_LOGE(TAG, "Cannot rename %s", tmp_path);
+        return ESP_FAIL;
+    }
+    ++use_counter;
+    img_cache_entry_t entry = {
+        .key = key,
+        .size = lv_img_dsc->data_size,
+        .last_used = use_counter,
+        .width = lv_img_dsc->header.w,
+        .height = lv_img_dsc->header.h,
+        .stored_at = use_counter,
+    };
+    entries[entry_count] = entry;
+    hash_insert(entry_count);
+    entry_count++;
+    total_bytes += entry.size;
+    schedule_flush();
+    xSemaphoreGive(lock);
+    ESP_LOGD(TAG, "Cached %s as %016llx, %lu bytes", url, key, entry.size);
+    return ESP_OK;
+}
+
+void img_cache_stats_get(img_cache_stats_t *stats_out)
+{
+    if (lock != NULL)
+        xSemaphoreTake(lock, portMAX_DELAY);
+    *stats_out = stats;
+    stats_out->entries = entry_count;
+    stats_out->total_bytes = total_bytes;
+    if (lock != NULL)
+        xSemaphoreGive(lock);
+}
@@ -2,193 +2,249 @@
 #include "esp_check.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "esp_random.h"
+#include "esp_timer.h"
 
 #include "board.h"
 #include "img_download.h"
 #include "jpeg_decoder.h"
 #include "http_client.h"
+#include "img_cache.h"
 #include "lodepng.h"
 
 #define HTTP_RESPONSE_MAX_SIZE 512 * 1024
 static const char *TAG = "IMG_DOWNLOAD";
 
-esp_err_t jpeg_to_rgb565(uint8_t *jpeg_buffer, size_t jpeg_buffer_size, lv_img_dsc_t *lv_img_dsc)
+typedef struct
 {
-    esp_jpeg_image_cfg_t jpeg_cfg = {
-        .indata = jpeg_buffer,
-        .indata_size = jpeg_buffer_size,
-        .out_format = JPEG_IMAGE_FORMAT_RGB565,
-        .out_scale = JPEG_IMAGE_SCALE_0,
-        .flags = {
-#ifdef CONFIG_LV_COLOR_16_SWAP
-            .swap_color_bytes = 1,
-#else
-            .swap_color_bytes = 0,
-#endif
-        },
-    };
-    esp_jpeg_image_output_t jpeg_size;
-    esp_err_t ret = esp_jpeg_decode(&jpeg_cfg, &jpeg_size);
-    if (ret != ESP_OK)
-    {
-        ESP_LOGW(TAG, "JPEG decode error");
-        return ret;
-    }
-
-    ESP_LOGI(TAG, "JPEG decode success, image width = %d height = %d, size = %lu, outbuf = %p",
-             jpeg_size.width, jpeg_size.height, jpeg_cfg.outbuf_size, jpeg_cfg.outbuf);
-    lv_img_dsc->header.w = jpeg_size.width;
-    lv_img_dsc->header.h = jpeg_size.height;
-    lv_img_dsc->header.cf = LV_IMG_CF_TRUE_COLOR;
-    lv_img_dsc->data_size = jpeg_cfg.outbuf_size;
-    lv_img_dsc->data = jpeg_cfg.outbuf;
-    return ESP_OK;
+    FILE *file;
+    esp_http_client_handle_t http;
+    int content_length;
+    uint8_t head[8]; // first bytes of the image, used to select the decoder
+    int head_len;
+    int head_pos;
+} img_reader_t;
+
+static int img_reader_read(img_reader_t *reader, uint8_t *buffer, int len)
+{
+    int read = 0;
+    while (reader->head_pos < reader->head_len && read < len)
+        buffer[read++] = reader->head[reader->head_pos++];
+    if (read == len)
+        return read;
+    int ret = 0;
+    if (reader->file != NULL)
+        ret = fread(buffer + read, 1, len - read, reader->file);
+    else if (reader->http != NULL)
+        ret = http_client_read(reader->http, (char *)buffer + read, len - read);
+    return ret > 0 ? read + ret : read;
 }
 
-esp_err_t png_to_rgb565(unsigned char *png_buffer, size_t png_buffer_size, lv_img_dsc_t *lv_img_dsc)
+static uint32_t jpeg_read_cb(void *ctx, uint8_t *buf, uint32_t len)
 {
-    ESP_LOGI(TAG, "lodepng_decode24...");
-    unsigned width, height;
-    uint8_t *rgb888 = NULL;
-    uint16_t *rgb565 = NULL;
-    unsigned error = lodepng_decode24(&rgb888, &width, &height, png_buffer, png_buffer_size);
-    if (error)
+    img_reader_t *reader = (img_reader_t *)ctx;
+    if (buf != NULL)
+        return img_reader_read(reader, buf, len);
+    // skip
+    uint8_t skip_buffer[64];
+    uint32_t skipped = 0;
+    while (skipped < len)
     {
-        if (rgb888 != NULL)
-        {
-            free(rgb888);
-        }
-        ESP_LOGW(TAG, "PNG (lodepng) decode error: %s", lodepng_error_text(error));
-        return ESP_FAIL;
+        int chunk = len - skipped < sizeof(skip_buffer) ? len - skipped : sizeof(skip_buffer);
+        int read = img_reader_read(reader, skip_buffer, chunk);
+        if (read <= 0)
+            break;
+        skipped += read;
     }
-    ESP_LOGI(TAG, "PNG decode success, image width = %u height = %u", width, height);
+    return skipped;
+}
+
+static void img_reader_close(img_reader_t *reader)
+{
+    if (reader->file != NULL)
+        fclose(reader->file);
+    reader->file = NULL;
+    http_client_close(reader->http);
+    reader->http = NULL;
+}
 
-    uint32_t out_size = width * height * sizeof(uint16_t);
-    rgb565 = (uint16_t *)malloc(out_size);
-    if (rgb565 == NULL)
+static esp_err_t img_reader_open(char *url, img_reader_t *reader)
+{
+    esp_err_t ret = ESP_OK;
+    memset(reader, 0, sizeof(img_reader_t));
+    if (strncmp("file://", url, strlen("file://")) == 0)
     {
-        ESP_LOGE(TAG, "Not enough memmory for PNG->RGB888->RGB565 out buffer");
-        return ESP_FAIL;
+        reader->file = fopen(url + 6, "rb");
+        ESP_RETURN_ON_FALSE(reader->file != NULL, ESP_ERR_NOT_FOUND, TAG, "Cannot open file");
+        ESP_GOTO_ON_FALSE(fseek(reader->file, 0, SEEK_END) == 0, ESP_FAIL, err, TAG, "Cannot seek to the end of file");
+        reader->content_length = ftell(reader->file);
+        ESP_GOTO_ON_FALSE(fseek(reader->file, 0, SEEK_SET) == 0, ESP_FAIL, err, TAG, "Cannot seek back to the beginning of file");
     }
-    // convert 888 to 565
-    for (int i = 0; i < width * height; i += 1)
+    else
     {
-        uint8_t red = rgb888[i * 3];
-        uint8_t green = rgb888[i * 3 + 1];
-        uint8_t blue = rgb888[i * 3 + 2];
-        uint16_t b = (blue >> 3) & 0x1f;
-        uint16_t g = ((green >> 2) & 0x3f) << 5;
-        uint16_t r = ((red >> 3) & 0x1f) << 11;
-        rgb565[i] = (uint16_t)(r | g | b);
+        ESP_RETURN_ON_ERROR(http_client_open(url, &reader->http, &reader->content_length), TAG, "Cannot open image URL");
+        ESP_GOTO_ON_FALSE(reader->content_length < HTTP_RESPONSE_MAX_SIZE, ESP_ERR_NO_MEM, err, TAG, "Image bigger then %d bytes", HTTP_RESPONSE_MAX_SIZE);
     }
-    free(rgb888);
+    reader->head_len = img_reader_read(reader, reader->head, sizeof(reader->head));
+    reader->head_pos = 0;
+    ESP_GOTO_ON_FALSE(reader->head_len == sizeof(reader->head), ESP_FAIL, err, TAG, "Image too short");
+    return ESP_OK;
+err:
+    img_reader_close(reader);
+    return ret;
+}
 
-    lv_img_dsc->header.w = width;
-    lv_img_dsc->header.h = height;
-    lv_img_dsc->header.cf = LV_IMG_CF_TRUE_COLOR;
-    lv_img_dsc->data_size = out_size;
-    lv_img_dsc->data = (uint8_t *)rgb565;
+/* Size of the image scaled to fit into the box, aspect ratio is kept */
+static void img_fit_size(int src_w, int src_h, int box_w, int box_h, int *w, int *h)
+{
+    int h_zoom = (box_w * LV_IMG_ZOOM_NONE) / src_w;
+    int v_zoom = (box_h * LV_IMG_ZOOM_NONE) / src_h;
+    int zoom = h_zoom < v_zoom ? h_zoom : v_zoom;
+    *w = (src_w * zoom) / LV_IMG_ZOOM_NONE;
+    *h = (src_h * zoom) / LV_IMG_ZOOM_NONE;
+    if (*w < 1)
+        *w = 1;
+    if (*h < 1)
+        *h = 1;
+}
 
-    return ESP_OK;
+static void img_dsc_set(lv_img_dsc_t *lv_img_dsc, uint16_t *data, int w, int h)
+{
+    lv_img_dsc->header.w = w;
+    lv_img_dsc->header.h = h;
+    lv_img_dsc->header.cf = LV_IMG_CF_TRUE_COLOR;
+    lv_img_dsc->data_size = w * h * sizeof(uint16_t);
+    lv_img_dsc->data = (uint8_t *)data;
 }
 
-esp_err_t load_image_from_cache(char *url, lv_img_dsc_t *lv_img_dsc)
+static esp_err_t jpeg_decode_fit(img_reader_t *reader, int box_w, int box_h, lv_img_dsc_t *lv_img_dsc)
 {
     esp_err_t ret = ESP_OK;
-    FILE *f_img = NULL;
-    FILE *f_index = NULL;
-    char *img_buffer = NULL;
+    esp_jpeg_stream_handle_t jpeg = NULL;
+    esp_jpeg_image_output_t jpeg_size;
+    uint16_t *canvas = NULL;
+    int w, h;
 
-    f_index = fopen("/sdcard/.img_cache/index", "r");
-    ESP_GOTO_ON_FALSE(f_index != NULL, ESP_ERR_NOT_FOUND, err, TAG, "Cannot open cache index file");
+    ret = esp_jpeg_stream_open(jpeg_read_cb, reader, &jpeg_size, &jpeg);
+    ESP_GOTO_ON_ERROR(ret, err, TAG, "JPEG header error");
+    ESP_GOTO_ON_FALSE(jpeg_size.width > 0 && jpeg_size.height > 0, ESP_FAIL, err, TAG, "Invalid JPEG size");
 
-    char line[1024];
-    while (fgets(line, 1024, f_index))
+    img_fit_size(jpeg_size.width, jpeg_size.height, box_w, box_h, &w, &h);
+    canvas = (uint16_t *)malloc(w * h * sizeof(uint16_t));
+    ESP_GOTO_ON_FALSE(canvas != NULL, ESP_ERR_NO_MEM, err, TAG, "Cannot allocate memmory for canvas buffer");
+
+#ifdef CONFIG_LV_COLOR_16_SWAP
+    ret = esp_jpeg_stream_decode(jpeg, (uint8_t *)canvas, w, h, true);
+#else
+    ret = esp_jpeg_stream_decode(jpeg, (uint8_t *)canvas, w, h, false);
+#endif
+    ESP_GOTO_ON_ERROR(ret, err, TAG, "JPEG decode error");
+
+    ESP_LOGI(TAG, "JPEG decode success, image width = %d height = %d, canvas width = %d height = %d",
+             jpeg_size.width, jpeg_size.height, w, h);
+    img_dsc_set(lv_img_dsc, canvas, w, h);
+    canvas = NULL;
+err:
+    if (canvas != NULL)
+        free(canvas);
+    esp_jpeg_stream_close(jpeg);
+    return ret;
+}
+
+static esp_err_t png_decode_fit(img_reader_t *reader, int box_w, int box_h, lv_img_dsc_t *lv_img_dsc)
+{
+    esp_err_t ret = ESP_OK;
+    unsigned width, height;
+    uint8_t *png_buffer = NULL;
+    uint8_t *rgb888 = NULL;
+    uint16_t *canvas = NULL;
+    int size = 0;
+    int w, h;
+
+    // lodepng needs the whole file in memory
+    int capacity = reader->content_length > 0 ? reader->content_length : 32 * 1024;
+    png_buffer = (uint8_t *)malloc(capacity);
+    ESP_GOTO_ON_FALSE(png_buffer != NULL, ESP_ERR_NO_MEM, err, TAG, "Cannot allocate memmory for PNG buffer");
+    while (true)
     {
-        char *token = strtok(line, ",");
-        if (token)
+        if (size == capacity)
         {
-            if (strcmp(url, token) == 0)
-            {
-                lv_img_dsc->header.cf = LV_IMG_CF_TRUE_COLOR;
-                lv_img_dsc->header.w = atoi(strtok(NULL, ","));
-                lv_img_dsc->header.h = atoi(strtok(NULL, ","));
-                lv_img_dsc->data_size = atoi(strtok(NULL, ","));
-                char *id = strtok(NULL, ",");
-                ESP_LOGI(TAG, "Image from url %s found in cache with id: %s", url, id);
-                char img_file_name[128];
-                strcpy(img_file_name, "/sdcard/.img_cache/");
-                strcat(img_file_name, id);
-                f_img = fopen(img_file_name, "r");
-                img_buffer = malloc(lv_img_dsc->data_size);
-                ESP_GOTO_ON_FALSE(img_buffer != NULL, ESP_ERR_NO_MEM, err, TAG, "Cannot allocate memmory for file load into PSRAM");
-                int read = fread(img_buffer, lv_img_dsc->data_size, 1, f_img);
-                ESP_GOTO_ON_FALSE(read == 1, ESP_FAIL, err, TAG, "Cannot read the whole file");
-                lv_img_dsc->data = (uint8_t *)img_buffer;
-            }
+            ESP_GOTO_ON_FALSE(capacity < HTTP_RESPONSE_MAX_SIZE, ESP_ERR_NO_MEM, err, TAG, "PNG bigger then %d bytes", HTTP_RESPONSE_MAX_SIZE);
+            capacity *= 2;
+            uint8_t *new_buffer = (uint8_t *)realloc(png_buffer, capacity);
+            ESP_GOTO_ON_FALSE(new_buffer != NULL, ESP_ERR_NO_MEM, err, TAG, "Cannot grow PNG buffer");
+            png_buffer = new_buffer;
         }
+        int read = img_reader_read(reader, png_buffer + size, capacity - size);
+        if (read <= 0)
+            break;
+        size += read;
     }
-    if (f_img == NULL)
+
+    unsigned error = lodepng_decode24(&rgb888, &width, &height, png_buffer, size);
+    ESP_GOTO_ON_FALSE(error == 0, ESP_FAIL, err, TAG, "PNG (lodepng) decode error: %s", lodepng_error_text(error));
+    free(png_buffer);
+    png_buffer = NULL;
+    ESP_LOGI(TAG, "PNG decode success, image width = %u height = %u", width, height);
+
+    img_fit_size(width, height, box_w, box_h, &w, &h);
+    canvas = (uint16_t *)malloc(w * h * sizeof(uint16_t));
+    ESP_GOTO_ON_FALSE(canvas != NULL, ESP_ERR_NO_MEM, err, TAG, "Cannot allocate memmory for canvas buffer");
+
+    // scale (nearest neighbour) and convert 888 to 565
+    for (int y = 0; y < h; y++)
     {
-        ESP_LOGI(TAG, "Canot find cached image for url %s", url);
-        ret = ESP_ERR_NOT_FOUND;
+        uint8_t *row = rgb888 + (y * height / h) * width * 3;
+        for (int x = 0; x < w; x++)
+        {
+            uint8_t *pixel = row + (x * width / w) * 3;
+            uint16_t color = ((pixel[0] & 0xF8) << 8) | ((pixel[1] & 0xFC) << 3) | (pixel[2] >> 3);
+#ifdef CONFIG_LV_COLOR_16_SWAP
+            color = (color >> 8) | (color << 8);
+#endif
+            canvas[y * w + x] = color;
+        }
     }
+    img_dsc_set(lv_img_dsc, canvas, w, h);
+    canvas = NULL;
 err:
-    if (f_index != NULL)
-        fclose(f_index);
-    if (f_img != NULL)
-        fclose(f_img);
-    if (ret != ESP_OK && img_buffer != NULL)
-        free(img_buffer);
+    if (png_buffer != NULL)
+        free(png_buffer);
+    if (rgb888 != NULL)
+        free(rgb888);
+    if (canvas != NULL)
+        free(canvas);
     return ret;
 }
 
-esp_err_t save_image_to_cache(char *url, lv_img_dsc_t *lv_img_dsc)
-{
-    return ESP_ERR_NOT_SUPPORTED;
-}
-
-esp_err_t download_image(char *url, lv_img_dsc_t *lv_img_dsc)
+esp_err_t download_image(char *url, int box_w, int box_h, lv_img_dsc_t *lv_img_dsc)
 {
     ESP_LOGI(TAG, "Download image from %s", url);
+    ESP_RETURN_ON_FALSE(box_w > 0 && box_h > 0, ESP_ERR_INVALID_ARG, TAG, "Invalid image box size");
 
     esp_err_t ret = ESP_OK;
-    char *img_buffer = NULL;
-    int img_size = 0;
+    img_reader_t reader;
+    int64_t start = esp_timer_get_time();
 
-    if (strncmp("file://", url, strlen("file://")) == 0)
+    if (img_cache_get(url, box_w, box_h, lv_img_dsc) == ESP_OK)
     {
-        FILE *f = fopen(url + 6, "rb");
-        ESP_GOTO_ON_FALSE(f != NULL, ESP_ERR_NOT_FOUND, err, TAG, "Cannot open file");
-        int seek = fseek(f, 0, SEEK_END);
-        ESP_GOTO_ON_FALSE(seek == 0, ESP_FAIL, err, TAG, "Cannot seek to the end of file");
-        img_size = ftell(f);
-        seek = fseek(f, 0, SEEK_SET);
-        ESP_GOTO_ON_FALSE(seek == 0, ESP_FAIL, err, TAG, "Cannot seek back to the beginning of file");
-        img_buffer = malloc(img_size + 1);
-        ESP_GOTO_ON_FALSE(img_buffer != NULL, ESP_ERR_NO_MEM, err, TAG, "Cannot allocate memmory for file load into PSRAM");
-        int read = fread(img_buffer, img_size, 1, f);
-        ESP_GOTO_ON_FALSE(read == 1, ESP_FAIL, err, TAG, "Cannot read the whole file");
-        fclose(f);
-        img_buffer[img_size] = 0;
-        ret = ESP_OK;
+        ESP_LOGD(TAG, "Image loaded from cache in %lld ms", (esp_timer_get_time() - start) / 1000);
+        return ESP_OK;
     }
+
+    ESP_RETURN_ON_ERROR(img_reader_open(url, &reader), TAG, "Cannot download image");
+
+    if (reader.head[0] == 0xFF && reader.head[1] == 0xD8)
+        ret = jpeg_decode_fit(&reader, box_w, box_h, lv_img_dsc);
+    else if (memcmp(reader.head, "\x89PNG", 4) == 0)
+        ret = png_decode_fit(&reader, box_w, box_h, lv_img_dsc);
     else
-    {
-        ret = http_client_get(url, &img_buffer, &img_size, HTTP_RESPONSE_MAX_SIZE);
-    }
-    ESP_GOTO_ON_ERROR(ret, err, TAG, "Cannot download image");
+        ret = ESP_ERR_NOT_SUPPORTED;
+    img_reader_close(&reader);
+    if (ret == ESP_OK)
+        img_cache_put(url, box_w, box_h, lv_img_dsc);
 
-    ret = jpeg_to_rgb565((uint8_t *)img_buffer, img_size, lv_img_dsc);
-    if (ret != ESP_OK)
-    {
-        ret = png_to_rgb565((unsigned char *)img_buffer, img_size, lv_img_dsc);
-    }
-err:
-    if (img_buffer)
-    {
-        free(img_buffer);
-    }
+    ESP_LOGD(TAG, "Image %s in %lld ms", ret == ESP_OK ? "decoded" : "failed", (esp_timer_get_time() - start) / 1000);
     return ret;
 }
@@ -0,0 +1,157 @@
+#include "img_loader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_check.h"
+#include "esp_lvgl_port.h"
+
+#include "img_download.h"
+
+typedef struct
+{
+    char *url;
+    int box_w;
+    int box_h;
+    uint8_t priority;
+    uint32_t seq;
+    uint32_t group;
+    img_loader_cb_t cb;
+    void *user_data;
+} img_request_t;
+
+static const char *TAG = "IMG_LOADER";
+
+static img_request_t queue[IMG_LOADER_QUEUE_SIZE];
+static int queue_len = 0;
+static uint32_t queue_seq = 0;
+static SemaphoreHandle_t lock = NULL;
+static SemaphoreHandle_t pending = NULL;
+
+static bool queue_pop(img_request_t *request)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    int best = -1;
+    for (int i = 0; i < queue_len; i++)
+    {
+        if (best < 0 || queue[i].priority < queue[best].priority ||
+            (queue[i].priority == queue[best].priority && (int32_t)(queue[i].seq - queue[best].seq) < 0))
+            best = i;
+    }
+    if (best >= 0)
+    {
+        *request = queue[best];
+        queue[best] = queue[--queue_len];
+    }
+    xSemaphoreGive(lock);
+    return best >= 0;
+}
+
+static void worker_task(void *p)
+{
+    img_request_t request;
+    while (true)
+    {
+        xSemaphoreTake(pending, portMAX_DELAY);
+        if (!queue_pop(&request))
+            continue;
+
+        lv_img_dsc_t img = {
+            .data = NULL,
+        };
+        esp_err_t ret = download_image(request.url, request.box_w, request.box_h, &img);
+        free(request.url);
+
+        lvgl_port_lock(0);
+        request.cb(ret, &img, request.group, request.user_data);
+        lvgl_port_unlock();
+    }
+}
+
+esp_err_t img_loader_request(const char *url, int box_w, int box_h, uint8_t priority, uint32_t group, img_loader_cb_t cb, void *user_data)
+{
+    ESP_RETURN_ON_FALSE(lock != NULL, ESP_ERR_INVALID_STATE, TAG, "Image loader not initialized");
+    ESP_RETURN_ON_FALSE(url != NULL && cb != NULL, ESP_ERR_INVALID_ARG, TAG, "Invalid image request");
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (queue_len == IMG_LOADER_QUEUE_SIZE)
+    {
+        xSemaphoreGive(lock);
+        return ESP_ERR_NO_MEM;
+    }
+    char *url_copy = strdup(url);
+    if (url_copy == NULL)
+    {
+        xSemaphoreGive(lock);
+        return ESP_ERR_NO_MEM;
+    }
+    img_request_t request = {
+        .url = url_copy,
+        .box_w = box_w,
+        .box_h = box_h,
+        .priority = priority,
+        .seq = queue_seq++,
+        .group = group,
+        .cb = cb,
+        .user_data = user_data,
+    };
+    queue[queue_len++] = request;
+    xSemaphoreGive(lock);
+    xSemaphoreGive(pending);
+    return ESP_OK;
+}
+
+void img_loader_priority_update(uint32_t group, img_loader_priority_cb_t priority_cb)
+{
+    if (lock == NULL)
+        return;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (int i = 0; i < queue_len; i++)
+    {
+        if (queue[i].group == group)
+            queue[i].priority = priority_cb(queue[i].user_data);
+    }
+    xSemaphoreGive(lock);
+}
+
+void img_loader_cancel(uint32_t group)
+{
+    if (lock == NULL)
+        return;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    int i = 0;
+    while (i < queue_len)
+    {
+        if (queue[i].group == group)
+        {
+            free(queue[i].url);
+            queue[i] = queue[--queue_len];
+            xSemaphoreTake(pending, 0);
+        }
+        else
+        {
+            i++;
+        }
+    }
+    xSemaphoreGive(lock);
+}
+
+esp_err_t img_loader_init(void)
+{
+    ESP_RETURN_ON_FALSE(lock == NULL, ESP_OK, TAG, "Image loader already initialized");
+    lock = xSemaphoreCreateMutex();
+    pending = xSemaphoreCreateCounting(IMG_LOADER_QUEUE_SIZE, 0);
+    ESP_RETURN_ON_FALSE(lock != NULL && pending != NULL, ESP_ERR_NO_MEM, TAG, "Cannot create image loader semaphores");
+    for (int i = 0; i < IMG_LOADER_WORKERS; i++)
+    {
+        char name[16];
+        snprintf(name, sizeof(name), "img_loader_%d", i);
+        BaseType_t ret = xTaskCreatePinnedToCore(&worker_task, name, 8 * 1024, NULL, 3, NULL, IMG_LOADER_CORE);
+        ESP_RETURN_ON_FALSE(ret == pdPASS, ESP_FAIL, TAG, "Cannot create %s task, error code: %d", name, ret);
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,32 @@
+#ifndef DIDL_PARSER_H
+#define DIDL_PARSER_H
+
+#include <stdint.h>
+#include "esp_err.h"
+
+/* Fields of the first item of a DIDL-Lite document, the strings are unescaped and NULL if missing */
+typedef struct
+{
+    const char *title;
+    const char *album;
+    const char *artist;
+    const char *album_art_uri;
+    const char *res;           // url of the first res element
+    const char *protocol_info; // of the first res element
+    int duration;              // ms, from res@duration or upnp:duration, -1 if unknown
+    int bitrate;               // bytes per second as in res@bitrate, -1 if unknown
+    int64_t size;              // bytes, -1 if unknown
+    char *arena;               // one allocation for all strings
+} didl_item_t;
+
+/**
+ * @brief Parse a DIDL-Lite document in one scan
+ *
+ * Namespace prefixes are ignored, entities and CDATA sections are decoded.
+ * The item has to be released with didl_item_free().
+ */
+esp_err_t didl_parse(const char *xml, didl_item_t *item);
+
+void didl_item_free(didl_item_t *item);
+
+#endif
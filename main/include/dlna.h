@@ -7,7 +7,20 @@
 #define DLNA_UNIQUE_DEVICE_NAME "ESP32_DMR_8db0797a"
 #define DLNA_DEVICE_UUID "8db0797a-f01a-4949-8f59-51188b181809"
 #define DLNA_ROOT_PATH "/rootDesc.xml"
+#define DLNA_TRACE_PATH "/trace" // playback start-up trace, see audio_trace.h
+#define DLNA_TRACE_JSON_SIZE (16 * 1024)
+#define DLNA_NOTIFY_INTERVAL_MS 200 // state variable changes within are sent in one event
+#define DLNA_NOTIFY_STATS_PERIOD_MS (60 * 1000) // notification statistics are logged at most this often
+#define DLNA_POSITION_TTL_MS 100    // rendered position values are reused by the attributes of a request
+
+typedef struct
+{
+    uint32_t changes;       // state variable changes marked
+    uint32_t notifications; // events sent, each one goes to every subscriber
+} dlna_notify_stats_t;
 
 esp_dlna_handle_t dlna_start();
 
+void dlna_notify_stats_get(dlna_notify_stats_t *stats);
+
 #endif
\ No newline at end of file
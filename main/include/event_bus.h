@@ -0,0 +1,72 @@
+#ifndef EVENT_BUS_H
+#define EVENT_BUS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#define EVENT_BUS_QUEUE_LENGTH 32
+#define EVENT_BUS_MAX_SUBSCRIBERS 8  // per topic and affinity
+#define EVENT_BUS_MAX_EVENTS 8       // per topic
+#define EVENT_BUS_DATA_SIZE 16       // subject bytes copied with an event
+#define EVENT_BUS_TASK_PRIORITY 3    // below the audio pipeline
+#define EVENT_BUS_TASK_STACK (6 * 1024)
+#define EVENT_BUS_LVGL_PERIOD_MS 10
+#define EVENT_BUS_SLOW_MS 50          // dispatch latency logged as a warning
+#define EVENT_BUS_STATS_PERIOD_MS (60 * 1000)
+
+typedef enum
+{
+    EVENT_BUS_PLAYER = 0,
+    EVENT_BUS_METADATA = 1,
+    EVENT_BUS_TOPIC_COUNT,
+} event_bus_topic_t;
+
+typedef enum
+{
+    EVENT_BUS_TASK = 0, // event bus task, must not touch LVGL objects
+    EVENT_BUS_LVGL = 1, // LVGL task, from an lv_timer
+    EVENT_BUS_AFFINITY_COUNT,
+} event_bus_affinity_t;
+
+/* calls a subscriber callback with the event and subject of its topic */
+typedef void (*event_bus_dispatch_t)(void *callback, int event, void *subject);
+
+typedef struct
+{
+    uint32_t published;
+    uint32_t coalesced; // replaced by a later one before delivery
+    uint32_t dropped;   // queue full
+    uint32_t delivered;
+    uint32_t latency_avg_us; // publish to the start of the dispatch
+    uint32_t latency_max_us;
+} event_bus_stats_t;
+
+/**
+ * @brief Create the event queues and the delivery task
+ */
+esp_err_t event_bus_init(void);
+
+/**
+ * @brief Deliver the LVGL affine events from an lv_timer, must be called with the LVGL port locked
+ */
+esp_err_t event_bus_lvgl_start(void);
+
+/**
+ * @brief Subscribe to the events of a topic, the callback is called by dispatch on the task of the affinity
+ */
+esp_err_t event_bus_subscribe(event_bus_topic_t topic, event_bus_dispatch_t dispatch, void *callback, event_bus_affinity_t affinity);
+
+/**
+ * @brief Queue an event for the subscribers of the topic, never blocks
+ *
+ * @param subject   size bytes are copied with the event, the subscribers get a pointer to the copy.
+ *                  With size 0 the pointer itself is passed, it has to stay valid.
+ * @param coalesce  Only the latest subject is delivered if the event is still queued
+ */
+void event_bus_publish(event_bus_topic_t topic, int event, const void *subject, size_t size, bool coalesce);
+
+void event_bus_stats_get(event_bus_topic_t topic, int event, event_bus_affinity_t affinity, event_bus_stats_t *stats);
+
+#endif
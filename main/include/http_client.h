@@ -1,9 +1,67 @@
 #ifndef HTTP_CLIENT_H
 #define HTTP_CLIENT_H
 
+#include <stdint.h>
+#include <stdbool.h>
 #include "esp_err.h"
+#include "esp_http_client.h"
+
+typedef struct
+{
+    uint32_t connections;        // new TCP/TLS connections
+    uint32_t handshakes_avoided; // requests sent on a kept-alive connection
+    uint32_t reuse_failures;     // kept-alive connections closed by the server meanwhile
+    uint32_t drains_skipped;     // connections closed because too much of the response was left unread
+} http_client_stats_t;
+
+/**
+ * @brief Init the keep-alive connection pool, without it every request uses a new connection
+ */
+esp_err_t http_client_init(void);
+void http_client_stats_get(http_client_stats_t *stats);
+
+#define HTTP_CLIENT_CHUNK_SIZE 4096
+
+/**
+ * @brief Response body consumer of http_client_get_stream()
+ *
+ * @param chunk      Next part of the body, only valid during the call
+ * @param len        Length of the chunk
+ * @param user_data  User data passed to http_client_get_stream()
+ *
+ * @return false to stop reading the response
+ */
+typedef bool (*http_client_chunk_cb_t)(const char *chunk, int len, void *user_data);
 
 int http_client_wifi_signal_quality_get(void);
+
+/**
+ * @brief Download the whole response into a buffer allocated for it, the caller has to free the response
+ *
+ * The buffer is allocated by Content-Length or grows with the response if there is no Content-Length.
+ */
 esp_err_t http_client_get(char *url, char **response, int *response_size, int max_response_size);
 
+/**
+ * @brief Download the response and pass it to chunk_cb in parts of at most buffer_size bytes
+ *
+ * @param[in] url        URL to download
+ * @param[in] buffer     Reusable chunk buffer, e.g. HTTP_CLIENT_CHUNK_SIZE bytes
+ * @param[in] chunk_cb   Body consumer
+ */
+esp_err_t http_client_get_stream(char *url, char *buffer, int buffer_size, http_client_chunk_cb_t chunk_cb, void *user_data);
+
+/**
+ * @brief Open a GET request and fetch the response headers, the body can be read by http_client_read()
+ *
+ * A kept-alive connection to the same host is reused if there is an idle one in the pool.
+ *
+ * @param[in]  url              URL to download
+ * @param[out] client           HTTP client, must be closed by http_client_close()
+ * @param[out] content_length   Content-Length header value, 0 if not present
+ */
+esp_err_t http_client_open(char *url, esp_http_client_handle_t *client, int *content_length);
+int http_client_read(esp_http_client_handle_t client, char *buffer, int len);
+void http_client_close(esp_http_client_handle_t client);
+
 #endif
\ No newline at end of file
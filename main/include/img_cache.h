@@ -0,0 +1,51 @@
+#ifndef IMG_CACHE_H
+#define IMG_CACHE_H
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "lvgl.h"
+
+#define IMG_CACHE_DIR "/sdcard/.img_cache"
+#define IMG_CACHE_MAX_ENTRIES 256
+#define IMG_CACHE_MAX_BYTES (16 * 1024 * 1024)
+#define IMG_CACHE_FLUSH_DELAY_MS 3000
+
+typedef struct
+{
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t entries;
+    uint32_t total_bytes;
+} img_cache_stats_t;
+
+/**
+ * @brief Load the cache index from the SD card, must be called after the card is mounted
+ */
+esp_err_t img_cache_init(void);
+
+/**
+ * @brief Get an already scaled RGB565 image from the cache
+ *
+ * @param[in]  url          Image URL
+ * @param[in]  box_w        Box width the image was scaled for
+ * @param[in]  box_h        Box height the image was scaled for
+ * @param[out] lv_img_dsc   Cached image, the caller owns (and has to free) lv_img_dsc->data
+ *
+ * @return ESP_ERR_NOT_FOUND on cache miss
+ */
+esp_err_t img_cache_get(const char *url, int box_w, int box_h, lv_img_dsc_t *lv_img_dsc);
+
+/**
+ * @brief Store a scaled RGB565 image in the cache, least recently used images are evicted if needed
+ */
+esp_err_t img_cache_put(const char *url, int box_w, int box_h, const lv_img_dsc_t *lv_img_dsc);
+
+/**
+ * @brief Write the index to the SD card now if it has pending changes
+ */
+esp_err_t img_cache_flush(void);
+
+void img_cache_stats_get(img_cache_stats_t *stats);
+
+#endif
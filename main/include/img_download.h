@@ -5,6 +5,17 @@
 #include "esp_err.h"
 #include "lvgl.h"
 
-esp_err_t download_image(char *url, lv_img_dsc_t *lv_img_dsc);
+/**
+ * @brief Download (http:// or file://) and decode a JPEG or PNG image, scaled to fit into the box
+ *
+ * The returned RGB565 buffer (lv_img_dsc->data) has the final size, it can be used as canvas buffer directly.
+ * The caller owns it and has to free it.
+ *
+ * @param[in]  url          Image URL
+ * @param[in]  box_w        Max width of the image
+ * @param[in]  box_h        Max height of the image
+ * @param[out] lv_img_dsc   Decoded image
+ */
+esp_err_t download_image(char *url, int box_w, int box_h, lv_img_dsc_t *lv_img_dsc);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,57 @@
+#ifndef IMG_LOADER_H
+#define IMG_LOADER_H
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "lvgl.h"
+
+#define IMG_LOADER_WORKERS 2
+#define IMG_LOADER_QUEUE_SIZE 16
+#define IMG_LOADER_CORE 0 // LVGL task runs on core 1
+
+#define IMG_LOADER_PRIORITY_HIGH 0
+#define IMG_LOADER_PRIORITY_LOW 1
+
+#define IMG_LOADER_GROUP_ALBUM_ART UINT32_MAX // lower groups are free for generation counters
+
+/**
+ * @brief Image loaded callback, called from a worker task with the LVGL port locked
+ *
+ * @param ret        Result of download_image()
+ * @param img        Decoded image, on success the callback owns (and has to free) img->data
+ * @param group      Group the request was queued with
+ * @param user_data  User data the request was queued with
+ */
+typedef void (*img_loader_cb_t)(esp_err_t ret, lv_img_dsc_t *img, uint32_t group, void *user_data);
+
+esp_err_t img_loader_init(void);
+
+/**
+ * @brief Queue an image for download_image() on a worker task
+ *
+ * Requests with lower priority value are served first, FIFO within the same priority.
+ *
+ * @return ESP_ERR_NO_MEM if the queue is full
+ */
+esp_err_t img_loader_request(const char *url, int box_w, int box_h, uint8_t priority, uint32_t group, img_loader_cb_t cb, void *user_data);
+
+/**
+ * @brief Priority of a queued request, see img_loader_priority_update()
+ */
+typedef uint8_t (*img_loader_priority_cb_t)(void *user_data);
+
+/**
+ * @brief Set the priority of the queued requests of the group again, e.g. after the images were scrolled
+ *
+ * @param priority_cb  Called with the user data of each request, with the loader queue locked
+ */
+void img_loader_priority_update(uint32_t group, img_loader_priority_cb_t priority_cb);
+
+/**
+ * @brief Drop the queued requests of the group
+ *
+ * Requests already being downloaded are not interrupted, their callback is still called.
+ */
+void img_loader_cancel(uint32_t group);
+
+#endif
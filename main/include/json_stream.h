@@ -0,0 +1,61 @@
+#ifndef JSON_STREAM_H
+#define JSON_STREAM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#define JSON_STREAM_TOKEN_MAX_LEN 1024 // longer strings are truncated
+#define JSON_STREAM_MAX_DEPTH 32
+
+typedef enum
+{
+    JSON_EVENT_OBJECT_START,
+    JSON_EVENT_OBJECT_END,
+    JSON_EVENT_ARRAY_START,
+    JSON_EVENT_ARRAY_END,
+    JSON_EVENT_KEY,
+    JSON_EVENT_STRING,
+    JSON_EVENT_PRIMITIVE, // number, true, false or null
+} json_event_t;
+
+/**
+ * @brief JSON parser event callback
+ *
+ * @param event      Event type
+ * @param value      Unescaped, zero terminated key, string or primitive, NULL for the other events
+ * @param len        Length of value
+ * @param depth      Number of open containers around the token, START/END events are reported with the depth outside the container
+ * @param user_data  User data passed to json_stream_init()
+ *
+ * @return false to stop parsing
+ */
+typedef bool (*json_stream_cb_t)(json_event_t event, const char *value, int len, int depth, void *user_data);
+
+/* Incremental (SAX style) JSON parser, the document can be fed in chunks of any size */
+typedef struct
+{
+    json_stream_cb_t cb;
+    void *user_data;
+    uint8_t state;
+    uint8_t depth;
+    uint32_t object_stack; // bit per depth, set if the container is an object
+    bool expect_key;
+    bool stopped;
+    uint32_t unicode;
+    uint8_t unicode_digits;
+    uint32_t high_surrogate;
+    int token_len;
+    char token[JSON_STREAM_TOKEN_MAX_LEN + 1];
+} json_stream_t;
+
+void json_stream_init(json_stream_t *parser, json_stream_cb_t cb, void *user_data);
+
+/**
+ * @brief Parse the next chunk of the document
+ *
+ * @return ESP_FAIL on syntax error, ESP_ERR_INVALID_STATE if the callback stopped the parser
+ */
+esp_err_t json_stream_feed(json_stream_t *parser, const char *data, int len);
+
+#endif
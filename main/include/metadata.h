@@ -1,7 +1,9 @@
 #ifndef DLNA_METADATA_H
 #define DLNA_METADATA_H
 
+#include <stdint.h>
 #include "esp_err.h"
+#include "event_bus.h"
 
 
 typedef struct
@@ -14,32 +16,92 @@ typedef struct
     char *image_url;
 } audio_metadata_t;
 
+#define METADATA_ICY_VALUE_SIZE 256 // longer ICY values are truncated
+
 typedef enum
 {
     METADATA_EVENT = 0,
 } metadata_event_t;
 
-typedef void (*metadata_event_cb)(metadata_event_t event, void *subject);
+typedef enum
+{
+    METADATA_FIELD_TITLE,
+    METADATA_FIELD_ALBUM,
+    METADATA_FIELD_ARTIST,
+    METADATA_FIELD_DURATION,
+    METADATA_FIELD_IMAGE_URL,
+    METADATA_FIELD_STREAM_URL,
+    METADATA_FIELD_COUNT,
+} metadata_field_t;
 
+#define METADATA_CHANGED(changes, field) (((changes) >> (field)) & 1)
+
+/* Immutable copy of the metadata, the strings are part of the same allocation */
 typedef struct
 {
-    metadata_event_cb callback;
-    struct metadataa_event_cb_node_t *next;
-} metadata_event_cb_node_t;
+    uint32_t version;
+    uint32_t changed_at[METADATA_FIELD_COUNT]; // version of the last change of each field
+    const char *title;
+    const char *album;
+    const char *artist;
+    int duration;
+    const char *stream_url;
+    const char *image_url;
+    int refs;
+} metadata_snapshot_t;
 
-void metadata_add_event_listener(metadata_event_cb callback);
+typedef void (*metadata_event_cb)(metadata_event_t event, void *subject);
+
+esp_err_t metadata_init(void);
+
+/**
+ * @brief Listen to the metadata changes, delivered on the task of the affinity
+ *
+ * Writes which change no field fire no event. Events are coalesced,
+ * the listeners find the changed fields with metadata_snapshot_changes().
+ */
+void metadata_add_event_listener(metadata_event_cb callback, event_bus_affinity_t affinity);
+
+/**
+ * @brief Current metadata, it does not change while it is held and has to be released
+ *
+ * @return NULL before metadata_init()
+ */
+const metadata_snapshot_t *metadata_snapshot_get(void);
+void metadata_snapshot_release(const metadata_snapshot_t *snapshot);
+
+/**
+ * @brief Fields changed after the version of an older snapshot, bit per metadata_field_t
+ */
+uint32_t metadata_snapshot_changes(const metadata_snapshot_t *snapshot, uint32_t version);
+
+/**
+ * @brief Keep the metadata from being changed, may be nested
+ */
+void metadata_lock(void);
+void metadata_unlock(void);
 
 esp_err_t metadata_set_dlna_xml(char *xml);
-esp_err_t metadata_get_dlna_xml(char **xml);
 
+/**
+ * @brief DIDL-Lite of the current snapshot, escaped to be sent as a SOAP value
+ *
+ * The xml is generated once per snapshot version and stays valid until the next change,
+ * hold metadata_lock() while it is used.
+ *
+ * @param[out] len  Length of the xml
+ * @return NULL if there is not enough memory
+ */
+const char *metadata_get_dlna_xml_escaped(int *len);
+
+/**
+ * @brief Set the title, artist and album art from the StreamTitle and StreamUrl of ICY metadata
+ *
+ * "Artist - Title" is split into its parts.
+ */
 esp_err_t metadata_set_icy_str(char *icy);
 
-char *metadata_title_get(void);
-char *metadata_album_get(void);
-char *metadata_artist_get(void);
 int metadata_duration_get(void);
-char *metadata_stream_url_get(void);
-char *metadata_image_url_get(void);
 
 void metadata_set(char *title,
                   char *album,
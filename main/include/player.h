@@ -6,6 +6,14 @@
 #include "esp_err.h"
 
 #include "metadata.h"
+#include "event_bus.h"
+
+#define PLAYER_URL_MAX_LENGTH 1024       // longer urls are truncated for the readers
+#define PLAYER_COMMAND_QUEUE_LENGTH 16
+#define PLAYER_TASK_PRIORITY 3           // below the audio pipeline
+#define PLAYER_TASK_STACK (6 * 1024)
+#define PLAYER_PROGRESS_PERIOD_MS 500    // snapshot time and position refresh while playing
+#define PLAYER_SEEK_SETTLE_MS 150        // a seek runs once the target stopped changing for this long
 
 extern const char* tone_uri[];
 
@@ -52,19 +60,57 @@ media_sourece_t;
         .url = NULL,                 \
     }
 
-typedef void (*event_cb)(player_event_t event, void *subject);
-
+/* consistent copy of the player state, taken without waiting for the player task */
 typedef struct
 {
-    event_cb callback;
-    struct event_cb_node_t *next;
-} event_cb_node_t;
+    player_state_t state;
+    media_sourece_type_t source_type;
+    int volume;
+    bool muted;
+    int time;     // sec, refreshed every PLAYER_PROGRESS_PERIOD_MS while playing
+    int duration; // sec
+    int position; // bytes
+} player_snapshot_t;
 
-void player_add_event_listener(event_cb callback);
+typedef void (*event_cb)(player_event_t event, void *subject);
 
+/* gapless playback, next track from the reader task, track changed from the player task */
+typedef bool (*player_next_track_cb)(char *url, int url_size);
+typedef void (*player_track_changed_cb)(const char *url);
+
+/**
+ * @brief Listen to the player events, delivered on the task of the affinity
+ *
+ * The subject is a copy made when the event was fired. MP_EVENT_SOURCE has no url, see player_source_url_get().
+ */
+void player_add_event_listener(event_cb callback, event_bus_affinity_t affinity);
+
+/**
+ * @brief Create the player and the task which runs its commands
+ *
+ * The commands below are queued to the player task, the caller waits for their result.
+ * They must not be called from the esp_audio callbacks or the reader tasks.
+ * Seek, volume and mute are queued without waiting, only the latest seek target and volume are applied.
+ */
 esp_audio_handle_t player_init(void);
 void player_source_set(media_sourece_t *source);
-media_sourece_t *player_source_get(void);
+media_sourece_type_t player_source_type_get(void);
+
+/**
+ * @brief Copy the url of the current track, returns its length
+ */
+int player_source_url_get(char *buffer, int size);
+
+void player_snapshot_get(player_snapshot_t *snapshot);
+
+/**
+ * @brief Enable gapless playback of the tracks of a source
+ *
+ * Near the end of a track next_track copies the url of the following one, it is decoded right after the current one
+ * if both are MP3 or AAC, or PCM WAV on the SD card, of the same format. The reader continues with it while the end of the current one
+ * is still buffered, track_changed is called once that has been played.
+ */
+void player_gapless_set(media_sourece_type_t type, player_next_track_cb next_track, player_track_changed_cb track_changed);
 
 audio_err_t player_play(void);
 void player_stop(void);
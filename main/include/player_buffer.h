@@ -0,0 +1,66 @@
+#ifndef PLAYER_BUFFER_H
+#define PLAYER_BUFFER_H
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "audio_element.h"
+
+#define PLAYER_BUFFER_PCM_SIZE (64 * 1024)      // decoder to I2S, ~370 ms of 44.1 kHz 16 bit stereo
+#define PLAYER_BUFFER_NET_MIN_SIZE (32 * 1024)  // network jitter buffer of the http stream
+#define PLAYER_BUFFER_NET_MAX_SIZE (512 * 1024)
+#define PLAYER_BUFFER_NET_INITIAL_SIZE (128 * 1024)
+#define PLAYER_BUFFER_NET_ALIGN (16 * 1024)
+#define PLAYER_BUFFER_MIN_SECONDS 3   // buffered audio on a steady connection
+#define PLAYER_BUFFER_MAX_SECONDS 30  // buffered audio on a slow or jittery connection
+#define PLAYER_BUFFER_UNDERRUN_SECONDS 2 // added for every underrun of the current stream
+#define PLAYER_BUFFER_SAMPLE_MS 500
+
+#define PLAYER_BUFFER_FAST_START_MS 200        // buffered audio needed to start a stream
+#define PLAYER_BUFFER_RAMP_MS_PER_S 100        // watermark growth per second of playback
+#define PLAYER_BUFFER_STEADY_DEFAULT_MS 2000   // steady watermark while the bitrate is not known
+#define PLAYER_BUFFER_DEFAULT_BITRATE (128000 / 8)
+#define PLAYER_BUFFER_PREFILL_MAX_WAIT_MS 15000
+
+typedef struct
+{
+    uint32_t net_fill;       // compressed data waiting for the decoder
+    uint32_t net_size;
+    uint32_t pcm_fill;       // decoded data waiting for I2S
+    uint32_t pcm_size;
+    uint32_t target_size;    // network buffer size used for the next stream
+    uint32_t bitrate;        // bytes/s consumed by the decoder
+    uint32_t throughput;     // bytes/s downloaded while the buffer was not full
+    uint32_t throughput_dev; // standard deviation of the throughput
+    uint32_t underruns;      // I2S underruns since boot
+    uint32_t stream_underruns; // I2S underruns of the current stream
+    uint32_t watermark_ms;     // buffered audio needed to (re)start playing
+    uint32_t steady_ms;        // the watermark ramps up to this
+    uint32_t ramp_underruns;   // underruns while the watermark was still ramping up
+    uint32_t steady_underruns; // underruns at the steady watermark
+} player_buffer_stats_t;
+
+/**
+ * @brief Start monitoring the buffers of the player pipeline
+ *
+ * The network buffer of the reader is sized from the measured bitrate and the throughput variance.
+ * A ring buffer cannot be resized while the pipeline runs, so the size is applied by player_buffer_apply()
+ * before the next stream is started and stays the same until the stream ends.
+ *
+ * Playback starts as soon as PLAYER_BUFFER_FAST_START_MS of audio is buffered, the watermark then ramps up
+ * while playing to half of the network buffer. After an underrun the I2S stream waits for the current watermark.
+ */
+esp_err_t player_buffer_init(audio_element_handle_t net_reader, audio_element_handle_t decoder, audio_element_handle_t i2s_writer);
+
+/**
+ * @brief Set the network buffer size of the next stream to the current target, the watermark starts again low
+ */
+void player_buffer_apply(void);
+
+/**
+ * @brief Time until the audio the reader writes now is heard, estimated from the buffers after it
+ */
+uint32_t player_buffer_delay_ms(audio_element_handle_t reader);
+
+void player_buffer_stats_get(player_buffer_stats_t *stats);
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef STATION_LIST_H
+#define STATION_LIST_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#define STATION_LIST_MAGIC 0x4C535452 // "RTSL"
+#define STATION_LIST_VERSION 1
+#define STATION_FIELD_NONE UINT32_MAX
+
+typedef enum
+{
+    STATION_GUIDE_ID,
+    STATION_IMAGE_URL,
+    STATION_TITLE,
+    STATION_SUBTITLE,
+    STATION_DESCRIPTION,
+    STATION_FIELD_COUNT,
+} station_field_t;
+
+/*
+ * Radio station list in one contiguous block:
+ *
+ *     station_list_t header
+ *     uint32_t offsets[STATION_FIELD_COUNT][count]   string offsets in the pool, STATION_FIELD_NONE if not set
+ *     char pool[pool_size]                           zero terminated strings
+ *
+ * There are no pointers in the block, it can be saved and loaded as-is and freed with a single free().
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;
+    uint32_t pool_size;
+    uint32_t size; // size of the whole block
+} station_list_t;
+
+typedef struct
+{
+    char *pool;
+    uint32_t pool_size;
+    uint32_t pool_capacity;
+    uint32_t *offsets; // [count][STATION_FIELD_COUNT] while building
+    int count;
+    int capacity;
+} station_list_builder_t;
+
+void station_list_builder_init(station_list_builder_t *builder);
+
+/**
+ * @brief Start a new station, the fields are set by station_list_builder_set()
+ */
+esp_err_t station_list_builder_add(station_list_builder_t *builder);
+
+/**
+ * @brief Set a field of the last added station, value is copied into the string pool
+ */
+esp_err_t station_list_builder_set(station_list_builder_t *builder, station_field_t field, const char *value, int len);
+
+/**
+ * @brief Create the station list block, the builder is freed
+ */
+esp_err_t station_list_builder_finish(station_list_builder_t *builder, station_list_t **list);
+void station_list_builder_free(station_list_builder_t *builder);
+
+/**
+ * @brief Get a field of a station, NULL if the field is not set
+ */
+const char *station_list_get(const station_list_t *list, int index, station_field_t field);
+
+/**
+ * @brief Find a station by guide id, -1 if not found
+ */
+int station_list_find(const station_list_t *list, const char *guide_id);
+
+bool station_list_equal(const station_list_t *a, const station_list_t *b);
+
+/**
+ * @brief Save the list through <path>.tmp
+ *
+ * The tmp file is synced before it replaces the old one, station_list_load() uses it if the replace was interrupted.
+ */
+esp_err_t station_list_save(const station_list_t *list, const char *path);
+
+/**
+ * @brief Load and validate a saved list, the caller has to free it
+ */
+esp_err_t station_list_load(const char *path, station_list_t **list);
+
+#endif
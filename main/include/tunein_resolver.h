@@ -0,0 +1,48 @@
+#ifndef TUNEIN_RESOLVER_H
+#define TUNEIN_RESOLVER_H
+
+#include "esp_err.h"
+#include "station_list.h"
+
+#define TUNEIN_RESOLVER_CACHE_FILE "/sdcard/.tunein_stream_urls"
+#define TUNEIN_RESOLVER_TTL_MS (6 * 60 * 60 * 1000)
+#define TUNEIN_RESOLVER_RETRY_MS (60 * 1000)
+#define TUNEIN_RESOLVER_MAX_ENTRIES 256
+
+/**
+ * @brief Load the persisted stream urls and start the background resolver task
+ */
+esp_err_t tunein_resolver_init(void);
+
+/**
+ * @brief Resolve the stream urls of all stations in the background, cached urls are kept
+ */
+void tunein_resolver_prefetch(const station_list_t *list);
+
+/**
+ * @brief Get the cached stream url of a station, without downloading it
+ *
+ * @param[in]  guide_id  TuneIn guide id of the station
+ * @param[out] url       Stream url, the caller has to free it
+ *
+ * @return ESP_ERR_NOT_FOUND if the url is not cached
+ */
+esp_err_t tunein_resolver_cached_get(const char *guide_id, char **url);
+
+/**
+ * @brief Get the stream url of a station, resolved now if it is not cached yet
+ *
+ * A miss downloads the url, do not call it from the LVGL task.
+ *
+ * @param[in]  guide_id  TuneIn guide id of the station
+ * @param[out] url       Stream url, the caller has to free it
+ * @param[out] cached    Set if the url came from the cache
+ */
+esp_err_t tunein_resolver_get(const char *guide_id, char **url, bool *cached);
+
+/**
+ * @brief Drop the cached url of a station which could not be played, it is resolved again in the background
+ */
+void tunein_resolver_invalidate(const char *guide_id);
+
+#endif
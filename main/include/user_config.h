@@ -3,6 +3,32 @@
 
 #include "esp_err.h"
 #include <stdbool.h>
+#include <stdint.h>
+
+#define CONFIG_FLUSH_DELAY_MS 3000 // changes are written to flash after they stopped for this long
+#define CONFIG_FLUSH_TASK_PRIORITY 1
+#define CONFIG_FLUSH_TASK_STACK (3 * 1024)
+
+typedef struct
+{
+    uint32_t changes;         // values changed by the setters
+    uint32_t commits;         // flash commits made
+    uint32_t commits_avoided; // changes saved together or overwritten before saving
+} config_stats_t;
+
+/**
+ * @brief Load the config into RAM and start the task which writes the changes back
+ *
+ * Must be called after nvs_flash_init(), the getters read only RAM afterwards.
+ */
+esp_err_t config_init(void);
+
+/**
+ * @brief Write the pending changes to flash now, also done on esp_restart()
+ */
+esp_err_t config_flush(void);
+
+void config_stats_get(config_stats_t *stats);
 
 uint8_t config_get_i2s_output();
 esp_err_t config_set_i2s_output(uint8_t value);
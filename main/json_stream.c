@@ -0,0 +1,235 @@
+#include "json_stream.h"
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_check.h"
+
+enum
+{
+    STATE_VALUE,
+    STATE_STRING,
+    STATE_ESCAPE,
+    STATE_UNICODE,
+    STATE_PRIMITIVE,
+};
+
+static const char *TAG = "JSON_STREAM";
+
+void json_stream_init(json_stream_t *parser, json_stream_cb_t cb, void *user_data)
+{
+    memset(parser, 0, sizeof(json_stream_t));
+    parser->cb = cb;
+    parser->user_data = user_data;
+    parser->state = STATE_VALUE;
+}
+
+static void token_append(json_stream_t *parser, char c)
+{
+    if (parser->token_len < JSON_STREAM_TOKEN_MAX_LEN)
+        parser->token[parser->token_len++] = c;
+}
+
+static void token_append_utf8(json_stream_t *parser, uint32_t code)
+{
+    if (code < 0x80)
+    {
+        token_append(parser, code);
+    }
+    else if (code < 0x800)
+    {
+        token_append(parser, 0xC0 | (code >> 6));
+        token_append(parser, 0x80 | (code & 0x3F));
+    }
+    else if (code < 0x10000)
+    {
+        token_append(parser, 0xE0 | (code >> 12));
+        token_append(parser, 0x80 | ((code >> 6) & 0x3F));
+        token_append(parser, 0x80 | (code & 0x3F));
+    }
+    else
+    {
+        token_append(parser, 0xF0 | (code >> 18));
+        token_append(parser, 0x80 | ((code >> 12) & 0x3F));
+        token_append(parser, 0x80 | ((code >> 6) & 0x3F));
+        token_append(parser, 0x80 | (code & 0x3F));
+    }
+}
+
+static bool emit(json_stream_t *parser, json_event_t event, bool with_token)
+{
+    const char *value = NULL;
+    int len = 0;
+    if (with_token)
+    {
+        parser->token[parser->token_len] = 0;
+        value = parser->token;
+        len = parser->token_len;
+    }
+    if (!parser->cb(event, value, len, parser->depth, parser->user_data))
+        parser->stopped = true;
+    return !parser->stopped;
+}
+
+static bool in_object(json_stream_t *parser)
+{
+    return parser->depth > 0 && (parser->object_stack & (1UL << (parser->depth - 1)));
+}
+
+static esp_err_t container_start(json_stream_t *parser, bool object)
+{
+    ESP_RETURN_ON_FALSE(parser->depth < JSON_STREAM_MAX_DEPTH, ESP_FAIL, TAG, "JSON nested too deep");
+    emit(parser, object ? JSON_EVENT_OBJECT_START : JSON_EVENT_ARRAY_START, false);
+    if (object)
+        parser->object_stack |= 1UL << parser->depth;
+    else
+        parser->object_stack &= ~(1UL << parser->depth);
+    parser->depth++;
+    parser->expect_key = object;
+    return ESP_OK;
+}
+
+static esp_err_t container_end(json_stream_t *parser, bool object)
+{
+    ESP_RETURN_ON_FALSE(parser->depth > 0 && in_object(parser) == object, ESP_FAIL, TAG, "Unexpected end of JSON container");
+    parser->depth--;
+    parser->expect_key = false;
+    emit(parser, object ? JSON_EVENT_OBJECT_END : JSON_EVENT_ARRAY_END, false);
+    return ESP_OK;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+esp_err_t json_stream_feed(json_stream_t *parser, const char *data, int len)
+{
+    int i = 0;
+    while (i < len)
+    {
+        ESP_RETURN_ON_FALSE(!parser->stopped, ESP_ERR_INVALID_STATE, TAG, "JSON parser stopped");
+        char c = data[i];
+        switch (parser->state)
+        {
+        case STATE_STRING:
+            if (c == '\\')
+            {
+                parser->state = STATE_ESCAPE;
+            }
+            else if (c == '"')
+            {
+                parser->state = STATE_VALUE;
+                bool key = parser->expect_key && in_object(parser);
+                parser->expect_key = false;
+                emit(parser, key ? JSON_EVENT_KEY : JSON_EVENT_STRING, true);
+            }
+            else
+            {
+                token_append(parser, c);
+            }
+            break;
+        case STATE_ESCAPE:
+            parser->state = STATE_STRING;
+            switch (c)
+            {
+            case 'b':
+                token_append(parser, '\b');
+                break;
+            case 'f':
+                token_append(parser, '\f');
+                break;
+            case 'n':
+                token_append(parser, '\n');
+                break;
+            case 'r':
+                token_append(parser, '\r');
+                break;
+            case 't':
+                token_append(parser, '\t');
+                break;
+            case 'u':
+                parser->state = STATE_UNICODE;
+                parser->unicode = 0;
+                parser->unicode_digits = 0;
+                break;
+            default: // '"', '\\', '/'
+                token_append(parser, c);
+                break;
+            }
+            break;
+        case STATE_UNICODE:
+        {
+            int digit = hex_value(c);
+            ESP_RETURN_ON_FALSE(digit >= 0, ESP_FAIL, TAG, "Invalid \\u escape in JSON string");
+            parser->unicode = (parser->unicode << 4) | digit;
+            if (++parser->unicode_digits < 4)
+                break;
+            parser->state = STATE_STRING;
+            if (parser->unicode >= 0xD800 && parser->unicode <= 0xDBFF)
+            {
+                parser->high_surrogate = parser->unicode;
+            }
+            else if (parser->unicode >= 0xDC00 && parser->unicode <= 0xDFFF && parser->high_surrogate != 0)
+            {
+                token_append_utf8(parser, 0x10000 + ((parser->high_surrogate - 0xD800) << 10) + (parser->unicode - 0xDC00));
+                parser->high_surrogate = 0;
+            }
+            else
+            {
+                token_append_utf8(parser, parser->unicode);
+                parser->high_surrogate = 0;
+            }
+            break;
+        }
+        case STATE_PRIMITIVE:
+            if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '+' || c == '-' || c == '.')
+            {
+                token_append(parser, c);
+                break;
+            }
+            parser->state = STATE_VALUE;
+            emit(parser, JSON_EVENT_PRIMITIVE, true);
+            continue; // c ends the primitive, it is parsed as the next token
+        case STATE_VALUE:
+            switch (c)
+            {
+            case ' ':
+            case '\t':
+            case '\r':
+            case '\n':
+            case ':':
+                break;
+            case ',':
+                parser->expect_key = in_object(parser);
+                break;
+            case '{':
+            case '[':
+                ESP_RETURN_ON_ERROR(container_start(parser, c == '{'), TAG, "JSON syntax error");
+                break;
+            case '}':
+            case ']':
+                ESP_RETURN_ON_ERROR(container_end(parser, c == '}'), TAG, "JSON syntax error");
+                break;
+            case '"':
+                parser->state = STATE_STRING;
+                parser->token_len = 0;
+                parser->high_surrogate = 0;
+                break;
+            default:
+                parser->state = STATE_PRIMITIVE;
+                parser->token_len = 0;
+                token_append(parser, c);
+                break;
+            }
+            break;
+        }
+        i++;
+    }
+    return parser->stopped ? ESP_ERR_INVALID_STATE : ESP_OK;
+}
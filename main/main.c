@@ -15,6 +15,12 @@
 #include "dlna.h"
 #include "buttons.h"
 #include "player.h"
+#include "img_cache.h"
+#include "img_loader.h"
+#include "http_client.h"
+#include "tunein_resolver.h"
+#include "event_bus.h"
+#include "user_config.h"
 
 static const char *TAG = "MAIN";
 
@@ -45,6 +51,7 @@ void app_main()
         ret = nvs_flash_init();
     }
     ESP_ERROR_CHECK(ret);
+    config_init();
     ESP_ERROR_CHECK(esp_netif_init());
 
     esp_periph_config_t periph_cfg = DEFAULT_ESP_PERIPH_SET_CONFIG();
@@ -59,8 +66,14 @@ void app_main()
     esp_periph_handle_t wifi_handle = periph_wifi_init(&wifi_cfg);
     esp_periph_start(set, wifi_handle);
     periph_wifi_wait_for_connected(wifi_handle, portMAX_DELAY);
+    http_client_init();
 
     audio_board_sdcard_init(set);
+    img_cache_init();
+    img_loader_init();
+    tunein_resolver_init();
+    metadata_init();
+    event_bus_init();
 
     esp_audio_handle_t player = player_init();
 
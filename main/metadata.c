@@ -3,8 +3,13 @@
 #include "esp_log.h"
 #include "esp_err.h"
 #include "esp_check.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "event_bus.h"
+#include "didl_parser.h"
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 
 #define METADATA_NEW()      \
     {                       \
@@ -17,109 +22,306 @@
     }
 
 static const char *TAG = "METADATA";
-audio_metadata_t metadata = METADATA_NEW();
-static metadata_event_cb_node_t *event_cb_list_root = NULL;
+static audio_metadata_t metadata = METADATA_NEW(); // written with lock held
+static SemaphoreHandle_t lock = NULL; // writers
+/* the readers take a reference of the latest snapshot without waiting for the writers */
+static metadata_snapshot_t *snapshot = NULL;
+static portMUX_TYPE snapshot_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t version = 0; // of the snapshot
+/* escaped DIDL-Lite of the metadata, kept until the version changes */
+static char *escaped_xml = NULL;
+static int escaped_xml_len = 0;
+static uint32_t escaped_xml_version = 0;
 
-void metadata_add_event_listener(metadata_event_cb callback)
+static int snapshot_string_size(const char *value)
 {
-    if (event_cb_list_root == NULL)
+    return value == NULL ? 0 : strlen(value) + 1;
+}
+
+static const char *snapshot_string_copy(char **buffer, const char *value)
+{
+    if (value == NULL)
+        return NULL;
+    char *copy = strcpy(*buffer, value);
+    *buffer += strlen(value) + 1;
+    return copy;
+}
+
+// one allocation with the strings, changed_at and version are set by the caller
+static metadata_snapshot_t *snapshot_create(void)
+{
+    int size = sizeof(metadata_snapshot_t) + snapshot_string_size(metadata.title) + snapshot_string_size(metadata.album) +
+               snapshot_string_size(metadata.artist) + snapshot_string_size(metadata.stream_url) + snapshot_string_size(metadata.image_url);
+    metadata_snapshot_t *next = (metadata_snapshot_t *)calloc(1, size);
+    if (next == NULL)
     {
-        event_cb_list_root = (metadata_event_cb_node_t *)malloc(sizeof(metadata_event_cb_node_t));
-        event_cb_list_root->callback = callback;
-        event_cb_list_root->next = NULL;
+        ESP_LOGE(TAG, "Cannot allocate %d bytes for metadata snapshot", size);
+        return NULL;
     }
-    else
+    char *strings = (char *)(next + 1);
+    next->title = snapshot_string_copy(&strings, metadata.title);
+    next->album = snapshot_string_copy(&strings, metadata.album);
+    next->artist = snapshot_string_copy(&strings, metadata.artist);
+    next->stream_url = snapshot_string_copy(&strings, metadata.stream_url);
+    next->image_url = snapshot_string_copy(&strings, metadata.image_url);
+    next->duration = metadata.duration;
+    next->refs = 1; // held as the current one
+    return next;
+}
+
+static bool string_changed(const char *a, const char *b)
+{
+    return (a == NULL) != (b == NULL) || (a != NULL && strcmp(a, b) != 0);
+}
+
+/* Fields of the metadata which differ from the current snapshot */
+static uint32_t snapshot_diff(void)
+{
+    uint32_t changes = 0;
+    changes |= string_changed(snapshot->title, metadata.title) << METADATA_FIELD_TITLE;
+    changes |= string_changed(snapshot->album, metadata.album) << METADATA_FIELD_ALBUM;
+    changes |= string_changed(snapshot->artist, metadata.artist) << METADATA_FIELD_ARTIST;
+    changes |= (snapshot->duration != metadata.duration) << METADATA_FIELD_DURATION;
+    changes |= string_changed(snapshot->image_url, metadata.image_url) << METADATA_FIELD_IMAGE_URL;
+    changes |= string_changed(snapshot->stream_url, metadata.stream_url) << METADATA_FIELD_STREAM_URL;
+    return changes;
+}
+
+// must be called with lock held, returns false if no field changed
+static bool snapshot_publish(void)
+{
+    uint32_t changes = snapshot_diff();
+    if (changes == 0)
+        return false;
+    metadata_snapshot_t *next = snapshot_create();
+    if (next == NULL)
+        return false;
+    next->version = snapshot->version + 1;
+    for (int i = 0; i < METADATA_FIELD_COUNT; i++)
+        next->changed_at[i] = METADATA_CHANGED(changes, i) ? next->version : snapshot->changed_at[i];
+    metadata_snapshot_t *previous = snapshot;
+    taskENTER_CRITICAL(&snapshot_lock);
+    snapshot = next;
+    taskEXIT_CRITICAL(&snapshot_lock);
+    version = next->version;
+    metadata_snapshot_release(previous);
+    ESP_LOGD(TAG, "Metadata version %lu, changed fields 0x%02lx", next->version, changes);
+    return true;
+}
+
+esp_err_t metadata_init(void)
+{
+    ESP_RETURN_ON_FALSE(lock == NULL, ESP_OK, TAG, "Metadata already initialized");
+    snapshot = snapshot_create();
+    ESP_RETURN_ON_FALSE(snapshot != NULL, ESP_ERR_NO_MEM, TAG, "Cannot create metadata snapshot");
+    lock = xSemaphoreCreateRecursiveMutex();
+    ESP_RETURN_ON_FALSE(lock != NULL, ESP_ERR_NO_MEM, TAG, "Cannot create metadata lock");
+    return ESP_OK;
+}
+
+const metadata_snapshot_t *metadata_snapshot_get(void)
+{
+    taskENTER_CRITICAL(&snapshot_lock);
+    metadata_snapshot_t *current = snapshot;
+    if (current != NULL)
+        current->refs++;
+    taskEXIT_CRITICAL(&snapshot_lock);
+    return current;
+}
+
+void metadata_snapshot_release(const metadata_snapshot_t *released)
+{
+    if (released == NULL)
+        return;
+    metadata_snapshot_t *writable = (metadata_snapshot_t *)released;
+    taskENTER_CRITICAL(&snapshot_lock);
+    int refs = --writable->refs;
+    taskEXIT_CRITICAL(&snapshot_lock);
+    if (refs == 0)
+        free(writable);
+}
+
+uint32_t metadata_snapshot_changes(const metadata_snapshot_t *current, uint32_t since)
+{
+    uint32_t changes = 0;
+    for (int i = 0; i < METADATA_FIELD_COUNT; i++)
     {
-        metadata_event_cb_node_t *new_node = (metadata_event_cb_node_t *)malloc(sizeof(metadata_event_cb_node_t));
-        new_node->callback = callback;
-        new_node->next = NULL;
-
-        metadata_event_cb_node_t *node = event_cb_list_root;
-        while (node->next != NULL)
-            node = node->next;
-        node->next = new_node;
+        if (current->changed_at[i] > since)
+            changes |= 1 << i;
     }
+    return changes;
+}
+
+void metadata_lock(void)
+{
+    xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+}
+
+void metadata_unlock(void)
+{
+    xSemaphoreGiveRecursive(lock);
+}
+
+static void event_dispatch(void *callback, int event, void *subject)
+{
+    ((metadata_event_cb)callback)((metadata_event_t)event, subject);
 }
 
-static void fire_event(metadata_event_t event, void *subject)
+void metadata_add_event_listener(metadata_event_cb callback, event_bus_affinity_t affinity)
 {
-    ESP_LOGD(TAG, "Sending event %d to all observer", event);
-    metadata_event_cb_node_t *node = event_cb_list_root;
-    while (node != NULL)
+    event_bus_subscribe(EVENT_BUS_METADATA, event_dispatch, (void *)callback, affinity);
+}
+
+// the listeners take the latest snapshot, only one event is queued
+static void fire_event(metadata_event_t event)
+{
+    event_bus_publish(EVENT_BUS_METADATA, event, NULL, 0, true);
+}
+
+typedef struct
+{
+    const char *value;
+    int len;
+} icy_span_t;
+
+/* values of the last ICY metadata, the metadata strings point here instead of allocated copies */
+static struct
+{
+    char title[METADATA_ICY_VALUE_SIZE];
+    char artist[METADATA_ICY_VALUE_SIZE];
+    char image_url[METADATA_ICY_VALUE_SIZE];
+} icy_values;
+
+static bool icy_value(const char *value)
+{
+    return value == icy_values.title || value == icy_values.artist || value == icy_values.image_url;
+}
+
+// the end of the metadata or the next "Key='"
+static bool icy_field_start(const char *p)
+{
+    p += strspn(p, " ");
+    if (*p == 0)
+        return true;
+    const char *key = p;
+    while ((*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z'))
+        p++;
+    return p > key && p[0] == '=' && p[1] == '\'';
+}
+
+/*
+ * Value of key in "StreamTitle='...';StreamUrl='...';", the value may contain quotes and semicolons.
+ * It ends with the quote followed by ';' and the next field, or the last quote if there is none.
+ */
+static bool icy_field_find(const char *icy, const char *key, icy_span_t *span)
+{
+    int key_len = strlen(key);
+    const char *p = icy;
+    while ((p = strstr(p, key)) != NULL)
     {
-        ESP_LOGI(TAG, "Sending event %d to %p", event, node->callback);
-        (node->callback)(event, subject);
-        node = node->next;
+        if ((p == icy || p[-1] == ';' || p[-1] == ' ') && p[key_len] == '=' && p[key_len + 1] == '\'')
+            break;
+        p += key_len;
     }
-    ESP_LOGI(TAG, "All observer notified");
+    if (p == NULL)
+        return false;
+    const char *start = p + key_len + 2;
+    const char *end = NULL;
+    for (const char *quote = strchr(start, '\''); quote != NULL; quote = strchr(quote + 1, '\''))
+    {
+        end = quote;
+        if (quote[1] == 0 || (quote[1] == ';' && icy_field_start(quote + 2)))
+            break;
+    }
+    if (end == NULL)
+        end = start + strlen(start);
+    span->value = start;
+    span->len = end - start;
+    return true;
 }
 
-esp_err_t metadata_set_icy_str(char *icy)
+static bool icy_image_url(const icy_span_t *url)
 {
-    char *start = strstr(icy, "StreamTitle='");
-    ESP_RETURN_ON_FALSE(start != NULL, ESP_OK, TAG, "ICY metadata has no StreamTitle information");
-    start += strlen("StreamTitle='");
-    char *end = strstr(start, ";");
-    ESP_RETURN_ON_FALSE(end != NULL, ESP_FAIL, TAG, "ICY metadata StreamTitle has no ending ; char");
-    size_t len = end - start - 1;
-    ESP_RETURN_ON_FALSE(len > 0, ESP_OK, TAG, "ICY metadata StreamTitle is empty");
-    if (metadata.title != NULL)
-        free(metadata.title);
-    metadata.title = (char *)malloc(len + 1);
-    ESP_RETURN_ON_FALSE(metadata.title != NULL, ESP_ERR_NO_MEM, TAG, "Cannot allocate memmory for metadata.title");
-    strncpy(metadata.title, start, len);
-    metadata.title[len] = '\0';
-    fire_event(METADATA_EVENT, &metadata);
-    return ESP_OK;
+    static const char *extensions[] = {".jpg", ".jpeg", ".png"};
+    if (strncmp(url->value, "http", 4) != 0)
+        return false;
+    for (int i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++)
+    {
+        int len = strlen(extensions[i]);
+        if (url->len > len && strncasecmp(url->value + url->len - len, extensions[i], len) == 0)
+            return true;
+    }
+    return false;
 }
 
-static void get_xml_tag_value(char *xml, char **value, char *key)
+// sets the field to the ICY buffer, returns false if it is the same value already
+static bool icy_field_set(char **field, char *buffer, const icy_span_t *span)
 {
-    *value = NULL;
-    char start_tag[24];
-    char end_tag[24];
-    snprintf(start_tag, sizeof(start_tag), "<%s>", key);
-    snprintf(end_tag, sizeof(end_tag), "</%s>", key);
-    char *start = strstr(xml, start_tag);
-    char *end = strstr(xml, end_tag);
-    if (start == NULL || end == NULL)
+    int len = span->len < METADATA_ICY_VALUE_SIZE ? span->len : METADATA_ICY_VALUE_SIZE - 1;
+    if (*field == buffer && strncmp(buffer, span->value, len) == 0 && buffer[len] == 0)
+        return false;
+    if (*field != NULL && !icy_value(*field))
+        free(*field);
+    memcpy(buffer, span->value, len);
+    buffer[len] = 0;
+    *field = buffer;
+    return true;
+}
+
+esp_err_t metadata_set_icy_str(char *icy)
+{
+    icy_span_t title, artist = {0}, url;
+    ESP_RETURN_ON_FALSE(icy_field_find(icy, "StreamTitle", &title), ESP_OK, TAG, "ICY metadata has no StreamTitle information");
+    ESP_RETURN_ON_FALSE(title.len > 0, ESP_OK, TAG, "ICY metadata StreamTitle is empty");
+    // most stations send "Artist - Title"
+    for (const char *dash = title.value; dash + 3 < title.value + title.len; dash++)
     {
-        ESP_LOGD(TAG, "%s is NULL", key);
-        return;
+        if (dash > title.value && strncmp(dash, " - ", 3) == 0)
+        {
+            artist.value = title.value;
+            artist.len = dash - title.value;
+            title.len -= dash + 3 - title.value;
+            title.value = dash + 3;
+            break;
+        }
     }
-    start += strlen(start_tag);
-    size_t len = end - start;
-    if (len == 0)
+    bool has_image = icy_field_find(icy, "StreamUrl", &url) && icy_image_url(&url);
+
+    metadata_lock();
+    // stations repeat the same metadata every few kilobytes, that is neither copied nor published
+    bool changed = icy_field_set(&metadata.title, icy_values.title, &title);
+    if (artist.len > 0)
     {
-        ESP_LOGD(TAG, "%s is empty", key);
-        return;
+        changed |= icy_field_set(&metadata.artist, icy_values.artist, &artist);
     }
-
-    char *_value = (char *)malloc(len + 1);
-    if (_value == NULL)
+    else if (metadata.artist == icy_values.artist)
     {
-        ESP_LOGE(TAG, "Cannot allocate memmory for key %s", key);
-        return;
+        metadata.artist = NULL;
+        changed = true;
     }
-    strncpy(_value, start, len);
-    _value[len] = '\0';
-    *value = _value;
+    if (has_image)
+        changed |= icy_field_set(&metadata.image_url, icy_values.image_url, &url);
+    changed = changed && snapshot_publish();
+    metadata_unlock();
 
-    ESP_LOGD(TAG, "%s = %s, len = %d", key, _value, len);
+    if (changed)
+        fire_event(METADATA_EVENT);
+    return ESP_OK;
+}
+
+static void value_free(char *value)
+{
+    if (value != NULL && !icy_value(value))
+        free(value);
 }
 
 static void metadata_free(void)
 {
-    if (metadata.title != NULL)
-        free(metadata.title);
-    if (metadata.album != NULL)
-        free(metadata.album);
-    if (metadata.artist != NULL)
-        free(metadata.artist);
-    if (metadata.stream_url != NULL)
-        free(metadata.stream_url);
-    if (metadata.image_url != NULL)
-        free(metadata.image_url);
+    value_free(metadata.title);
+    value_free(metadata.album);
+    value_free(metadata.artist);
+    value_free(metadata.stream_url);
+    value_free(metadata.image_url);
     metadata.duration = 0;
     metadata.title = NULL;
     metadata.album = NULL;
@@ -128,90 +330,148 @@ static void metadata_free(void)
     metadata.image_url = NULL;
 }
 
+// empty DIDL values are kept as missing
+static char *value_dup(const char *value)
+{
+    return value == NULL || value[0] == 0 ? NULL : strdup(value);
+}
+
 esp_err_t metadata_set_dlna_xml(char *xml)
 {
+    didl_item_t item;
+    ESP_RETURN_ON_ERROR(didl_parse(xml, &item), TAG, "Cannot parse DIDL-Lite metadata");
+    metadata_lock();
     metadata_free();
-    char *buffer = NULL;
-    get_xml_tag_value(xml, &buffer, "upnp:duration");
-    if (buffer != NULL)
-    {
-        metadata.duration = atoi(buffer);
-        free(buffer);
-    }
-    get_xml_tag_value(xml, &(metadata.title), "dc:title");
-    get_xml_tag_value(xml, &(metadata.album), "upnp:album");
-    get_xml_tag_value(xml, &(metadata.artist), "upnp:artist");
-    get_xml_tag_value(xml, &(metadata.image_url), "upnp:albumArtURI");
+    metadata.title = value_dup(item.title);
+    metadata.album = value_dup(item.album);
+    metadata.artist = value_dup(item.artist);
+    metadata.image_url = value_dup(item.album_art_uri);
+    metadata.duration = item.duration > 0 ? item.duration / 1000 : 0;
+    bool changed = snapshot_publish();
+    metadata_unlock();
+    didl_item_free(&item);
 
-    fire_event(METADATA_EVENT, &metadata);
+    if (changed)
+        fire_event(METADATA_EVENT);
 
     return ESP_OK;
 }
 
-static const char *DIDL_START = "<DIDL-Lite xmlns:dc=\"http://purl.org/dc/elements/1.1/\" xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\" xmlns=\"urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/\" xmlns : dlna = \"urn:schemas-dlna-org:metadata-1-0/\"><item id=\"1\" parentID=\"0\" restricted=\"1\">";
-static const char *DIDL_TITLE = "<dc:title>%s</dc:title>";
-static const char *DIDL_ALBUM = "<upnp:album>%s</upnp:album>";
-static const char *DIDL_ARTIST = "<upnp:artist>%s</upnp:artist>";
-static const char *DIDL_DURATION = "<upnp:duration>%02d:%02d:%02d</upnp:duration>";
-static const char *DIDL_ART_URI = "<upnp:albumArtURI>%s</upnp:albumArtURI>";
+static const char *DIDL_START = "<DIDL-Lite xmlns:dc=\"http://purl.org/dc/elements/1.1/\" xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\" xmlns=\"urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/\" xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\"><item id=\"1\" parentID=\"0\" restricted=\"1\">";
 static const char *DIDL_CLASS = "<upnp:class>object.item.audioItem.musicTrack</upnp:class>";
-static const char *DIDL_RES = "<res>%s</res>";
 static const char *DIDL_END = "</item></DIDL-Lite>";
 
-esp_err_t metadata_get_dlna_xml(char **xml)
-{
-    *xml = NULL;
-    int len = strlen(DIDL_START);
-    if (metadata.title != NULL)
-        len += strlen(metadata.title) + strlen(DIDL_TITLE);
-    if (metadata.album != NULL)
-        len += strlen(metadata.album) + strlen(DIDL_ALBUM);
-    if (metadata.artist != NULL)
-        len += strlen(metadata.artist) + strlen(DIDL_ARTIST);
-    if (metadata.image_url != NULL)
-        len += strlen(metadata.image_url) + strlen(DIDL_ART_URI);
-    if (metadata.stream_url != NULL)
-        len += strlen(metadata.stream_url) + strlen(DIDL_RES);
-    len += strlen(DIDL_DURATION);
-    len += strlen(DIDL_CLASS);
-    len += strlen(DIDL_END);
-
-    char *buff = (char *)malloc(len);
-    if (buff == NULL)
+/* same characters as hesc_escape_html() */
+static const char *xml_escaped(char c)
+{
+    switch (c)
     {
-        ESP_LOGE(TAG, "Cannot allocate %d bytes of memmory for DIDL XML", len);
-        return ESP_FAIL;
+    case '"':
+        return "&quot;";
+    case '&':
+        return "&amp;";
+    case '\'':
+        return "&#39;";
+    case '<':
+        return "&lt;";
+    case '>':
+        return "&gt;";
+    default:
+        return NULL;
     }
+}
+
+/* counts the length if buffer is NULL */
+typedef struct
+{
+    char *buffer;
+    int len;
+} didl_writer_t;
 
-    len = 0;
-    len += sprintf(buff, "%s", DIDL_START);
-    if (metadata.title != NULL)
-        len += sprintf(buff + len, DIDL_TITLE, metadata.title);
-    if (metadata.album != NULL)
-        len += sprintf(buff + len, DIDL_ALBUM, metadata.album);
-    if (metadata.artist != NULL)
-        len += sprintf(buff + len, DIDL_ARTIST, metadata.artist);
-    if (metadata.image_url != NULL)
-        len += sprintf(buff + len, DIDL_ART_URI, metadata.image_url);
-    if (metadata.stream_url != NULL)
-        len += sprintf(buff + len, DIDL_RES, metadata.stream_url);
-    len += sprintf(buff + len, DIDL_DURATION, metadata.duration / 3600, metadata.duration / 60, metadata.duration % 60);
-    len += sprintf(buff + len, "%s", DIDL_CLASS);
-    len += sprintf(buff + len, "%s", DIDL_END);
-
-    ESP_LOGD(TAG, "DIDL XML from metadata length = %d xml = %s", len, buff);
-
-    *xml = buff;
+// writes text escaped levels times, the markup is escaped once for SOAP, the values also for the DIDL-Lite itself
+static void didl_put(didl_writer_t *writer, const char *text, int levels)
+{
+    for (; *text != 0; text++)
+    {
+        const char *escaped = levels > 0 ? xml_escaped(*text) : NULL;
+        if (escaped != NULL)
+        {
+            didl_put(writer, escaped, levels - 1);
+            continue;
+        }
+        if (writer->buffer != NULL)
+            writer->buffer[writer->len] = *text;
+        writer->len++;
+    }
+}
 
-    return ESP_OK;
+static void didl_element_put(didl_writer_t *writer, const char *name, const char *value)
+{
+    if (value == NULL)
+        return;
+    didl_put(writer, "<", 1);
+    didl_put(writer, name, 1);
+    didl_put(writer, ">", 1);
+    didl_put(writer, value, 2);
+    didl_put(writer, "</", 1);
+    didl_put(writer, name, 1);
+    didl_put(writer, ">", 1);
+}
+
+static void didl_write(didl_writer_t *writer)
+{
+    char duration[16];
+    snprintf(duration, sizeof(duration), "%02d:%02d:%02d", metadata.duration / 3600, (metadata.duration % 3600) / 60, metadata.duration % 60);
+    didl_put(writer, DIDL_START, 1);
+    didl_element_put(writer, "dc:title", metadata.title);
+    didl_element_put(writer, "upnp:album", metadata.album);
+    didl_element_put(writer, "upnp:artist", metadata.artist);
+    didl_element_put(writer, "upnp:albumArtURI", metadata.image_url);
+    didl_element_put(writer, "res", metadata.stream_url);
+    didl_element_put(writer, "upnp:duration", duration);
+    didl_put(writer, DIDL_CLASS, 1);
+    didl_put(writer, DIDL_END, 1);
+}
+
+const char *metadata_get_dlna_xml_escaped(int *len)
+{
+    *len = 0;
+    metadata_lock();
+    if (escaped_xml == NULL || escaped_xml_version != version)
+    {
+        // the first pass only measures, the xml is written into one exactly sized buffer
+        didl_writer_t writer = {0};
+        didl_write(&writer);
+        char *xml = (char *)malloc(writer.len + 1);
+        if (xml == NULL)
+        {
+            metadata_unlock();
+            ESP_LOGE(TAG, "Cannot allocate %d bytes of memmory for DIDL XML", writer.len + 1);
+            return NULL;
+        }
+        writer.buffer = xml;
+        writer.len = 0;
+        didl_write(&writer);
+        xml[writer.len] = 0;
+        if (escaped_xml != NULL)
+            free(escaped_xml);
+        escaped_xml = xml;
+        escaped_xml_len = writer.len;
+        escaped_xml_version = version;
+        ESP_LOGD(TAG, "DIDL XML version %lu, length = %d xml = %s", version, escaped_xml_len, escaped_xml);
+    }
+    *len = escaped_xml_len;
+    metadata_unlock();
+    return escaped_xml;
 }
 
-char *metadata_title_get(void) { return metadata.title; }
-char *metadata_album_get(void) { return metadata.album; }
-char *metadata_artist_get(void) { return metadata.artist; }
-int metadata_duration_get(void) { return metadata.duration; }
-char *metadata_stream_url_get(void) { return metadata.stream_url; }
-char *metadata_image_url_get(void) { return metadata.image_url; }
+int metadata_duration_get(void)
+{
+    const metadata_snapshot_t *current = metadata_snapshot_get();
+    int duration = current == NULL ? 0 : current->duration;
+    metadata_snapshot_release(current);
+    return duration;
+}
 
 void metadata_set(char *title,
                   char *album,
@@ -220,6 +480,7 @@ void metadata_set(char *title,
                   char *stream_url,
                   char *image_url)
 {
+    metadata_lock();
     metadata_free();
     if (title != NULL)
         metadata.title = strdup(title);
@@ -232,5 +493,8 @@ void metadata_set(char *title,
     if (image_url != NULL)
         metadata.image_url = strdup(image_url);
     metadata.duration = duration;
-    fire_event(METADATA_EVENT, &metadata);
+    bool changed = snapshot_publish();
+    metadata_unlock();
+    if (changed)
+        fire_event(METADATA_EVENT);
 }
\ No newline at end of file
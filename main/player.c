@@ -10,6 +10,15 @@
 #include "user_config.h"
 #include "display.h"
 #include "board.h"
+#include "audio_trace.h"
+#include "player_buffer.h"
+#include "event_bus.h"
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 
 const char *tone_uri[] = {
     "flash://tone/0_Bt_Reconnect.mp3",
@@ -40,97 +49,257 @@ static const char *TAG = "PLAYER";
 static const char *esp_audio_status_names[6] = {"UNKNOWN", "RUNNING", "PAUSED", "STOPPED", "FINISHED", "ERROR"};
 static const char *media_sourece_names[6] = {"NULL", "DLNA", "TUNE_IN", "SD_CARD", "OTHER"};
 
+typedef enum
+{
+    CMD_SOURCE_SET,
+    CMD_PLAY,
+    CMD_STOP,
+    CMD_PAUSE,
+    CMD_SEEK,
+    CMD_VOLUME_SET,
+    CMD_MUTE_SET,
+    CMD_STATUS,        // from the esp_audio callback, the status is in status_request
+    CMD_TRACK_CHANGED, // gapless, from the reader task
+} player_cmd_type_t;
+
+typedef struct
+{
+    player_cmd_type_t type;
+    bool wait; // the caller waits for the result
+    union
+    {
+        bool mute;
+        media_sourece_t source; // url allocated by the sender, owned by the task
+        struct
+        {
+            char *url;       // allocated by the reader, owned by the task
+            TickType_t due;  // when the audio before it has been played
+        } track;
+    } arg;
+} player_cmd_t;
+
 static audio_element_handle_t i2s_stream_handle;
 static esp_audio_handle_t player = NULL;
+static player_next_track_cb gapless_next_track[MP_SOURCE_TYPE_OTHER + 1] = {NULL};
+static player_track_changed_cb gapless_track_changed[MP_SOURCE_TYPE_OTHER + 1] = {NULL};
+
+/* owned by the player task */
 static int muted_volume = 0;
-static bool player_muted = false;
-static event_cb_node_t *event_cb_list_root = NULL;
-static player_state_t player_state = MP_STATE_NO_MEDIA;
 static media_sourece_t media_sourece = NULL_MEDIA_SOURCE();
+static int time_offset = 0; // ms, esp_audio time when the current gapless track started
 
-// int test_vol_subject;
+static QueueHandle_t commands = NULL;
+static TaskHandle_t th_player = NULL;
+static SemaphoreHandle_t call_lock = NULL; // one waiting caller at a time
+static SemaphoreHandle_t call_done = NULL;
+static esp_err_t call_result = ESP_OK;
 
-void player_add_event_listener(event_cb callback)
+/* latest requested value, only one command of its kind is queued at a time */
+typedef struct
 {
-    if (event_cb_list_root == NULL)
-    {
-        event_cb_list_root = (event_cb_node_t *)malloc(sizeof(event_cb_node_t));
-        event_cb_list_root->callback = callback;
-        event_cb_list_root->next = NULL;
-    }
+    bool queued;
+    int value;
+} request_t;
+
+static request_t seek_request = {0};
+static request_t volume_request = {0};
+static request_t status_request = {0}; // esp_audio_status_t, taken by the player task even if its command was dropped
+static portMUX_TYPE request_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/* owned by the player task, deferred until the target settled */
+static bool seek_pending = false;
+static int seek_target = 0;
+static TickType_t seek_due = 0;
+
+/* owned by the player task, the reader continued with the gapless track before the audio in between was played */
+static char *track_url = NULL;
+static TickType_t track_due = 0;  // ticks left while paused
+static bool track_paused = false;
+static bool track_pending = false; // set by the reader, no further gapless track until the switch was made
+
+/*
+ * Seqlock of the state read by the other tasks: the writers update it in a critical section with an odd sequence,
+ * the readers copy it without locking and retry if the sequence changed meanwhile.
+ */
+static struct
+{
+    uint32_t seq;
+    player_snapshot_t snapshot;
+    char url[PLAYER_URL_MAX_LENGTH];
+} shared = {
+    .snapshot = {.state = MP_STATE_NO_MEDIA, .source_type = MP_SOURCE_TYPE_NULL},
+};
+static portMUX_TYPE shared_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void shared_write_begin(void)
+{
+    taskENTER_CRITICAL(&shared_lock);
+    __atomic_store_n(&shared.seq, shared.seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void shared_write_end(void)
+{
+    __atomic_store_n(&shared.seq, shared.seq + 1, __ATOMIC_RELEASE);
+    taskEXIT_CRITICAL(&shared_lock);
+}
+
+static uint32_t shared_read_begin(void)
+{
+    uint32_t seq;
+    // the writer holds the critical section only for a copy
+    while ((seq = __atomic_load_n(&shared.seq, __ATOMIC_ACQUIRE)) & 1)
+        ;
+    return seq;
+}
+
+static bool shared_read_retry(uint32_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&shared.seq, __ATOMIC_RELAXED) != seq;
+}
+
+static void event_dispatch(void *callback, int event, void *subject)
+{
+    ((event_cb)callback)((player_event_t)event, subject);
+}
+
+void player_add_event_listener(event_cb callback, event_bus_affinity_t affinity)
+{
+    event_bus_subscribe(EVENT_BUS_PLAYER, event_dispatch, (void *)callback, affinity);
+}
+
+/* The subject is copied, only the latest position and volume is delivered */
+static void fire_event(player_event_t event, const void *subject, size_t size)
+{
+    event_bus_publish(EVENT_BUS_PLAYER, event, subject, size, event == MP_EVENT_POSITION || event == MP_EVENT_VOLUME);
+}
+
+static void state_set(player_state_t state)
+{
+    shared_write_begin();
+    shared.snapshot.state = state;
+    shared_write_end();
+    fire_event(MP_EVENT_STATE, &state, sizeof(state));
+}
+
+static void source_url_set(char *url)
+{
+    if (media_sourece.url)
+        free(media_sourece.url);
+    media_sourece.url = url;
+    if (url != NULL && strlen(url) >= PLAYER_URL_MAX_LENGTH)
+        ESP_LOGW(TAG, "Url longer than %d, readers get it truncated", PLAYER_URL_MAX_LENGTH - 1);
+    shared_write_begin();
+    shared.snapshot.source_type = media_sourece.type;
+    if (url != NULL)
+        strlcpy(shared.url, url, sizeof(shared.url));
     else
-    {
-        event_cb_node_t *new_node = (event_cb_node_t *)malloc(sizeof(event_cb_node_t));
-        new_node->callback = callback;
-        new_node->next = NULL;
-
-        event_cb_node_t *node = event_cb_list_root;
-        while (node->next != NULL)
-            node = node->next;
-        node->next = new_node;
-    }
+        shared.url[0] = 0;
+    shared_write_end();
 }
 
-static void fire_event(player_event_t event, void *subject)
+// time, duration and position of the snapshot, refreshed while playing
+static void progress_update(void)
 {
-    ESP_LOGI(TAG, "Sending event %d to all observer", event);
-    event_cb_node_t *node = event_cb_list_root;
-    while (node != NULL)
+    int time = 0, duration = 0, position = 0;
+    esp_audio_time_get(player, &time);
+    esp_audio_duration_get(player, &duration);
+    esp_audio_pos_get(player, &position);
+    shared_write_begin();
+    shared.snapshot.time = (time - time_offset) / 1000;
+    shared.snapshot.duration = duration / 1000;
+    shared.snapshot.position = position;
+    shared_write_end();
+}
+
+static esp_err_t i2s_stream_volume_set(audio_element_handle_t i2s_stream, int volume)
+{
+    ESP_LOGD(TAG, "Volume set = %d", volume);
+    if (i2s_alc_volume_set(i2s_stream, volume * 1.28 - 64) == ESP_OK)
     {
-        ESP_LOGI(TAG, "Sending event %d to %p", event, node->callback);
-        (node->callback)(event, subject);
-        node = node->next;
+        shared_write_begin();
+        shared.snapshot.volume = volume;
+        shared_write_end();
+        fire_event(MP_EVENT_VOLUME, &volume, sizeof(volume));
+        return ESP_OK;
     }
-    ESP_LOGI(TAG, "All observer notified");
+    return ESP_FAIL;
 }
 
-void player_source_set(media_sourece_t *source)
+static esp_err_t i2s_stream_volume_get(audio_element_handle_t i2s_stream, int *volume)
 {
-    ESP_LOGD(TAG, "Set URL = %s, source = %s", source->url, media_sourece_names[source->type]);
-    esp_audio_stop(player, TERMINATION_TYPE_NOW);
-    media_sourece.type = source->type;
-    if (media_sourece.url)
+    ESP_LOGD(TAG, "Volume get");
+    int i2s_vol = 0;
+    if (i2s_alc_volume_get(i2s_stream, &i2s_vol) == ESP_OK)
     {
-        free(media_sourece.url);
+        *volume = (i2s_vol + 64) / 1.28;
+        return ESP_OK;
     }
-    media_sourece.url = strdup(source->url);
-    fire_event(MP_EVENT_SOURCE, &media_sourece);
+    return ESP_FAIL;
 }
 
-media_sourece_t *player_source_get(void)
+// the audio of the previous track has been played, the current one is the track the reader continued with
+static void track_changed(void)
 {
-    return &media_sourece;
+    char *url = track_url;
+    track_url = NULL;
+    track_paused = false;
+    source_url_set(url);
+    int time = 0;
+    esp_audio_time_get(player, &time);
+    time_offset = time;
+    __atomic_store_n(&track_pending, false, __ATOMIC_RELAXED);
+    player_track_changed_cb changed = gapless_track_changed[media_sourece.type];
+    if (changed != NULL)
+        changed(url);
 }
 
-void player_stop(void)
+// the buffered audio is gone, the switch is not made
+static void track_drop(void)
 {
-    ESP_LOGD(TAG, "Stop");
-    esp_audio_stop(player, TERMINATION_TYPE_NOW);
+    if (track_url)
+        free(track_url);
+    track_url = NULL;
+    track_paused = false;
+    __atomic_store_n(&track_pending, false, __ATOMIC_RELAXED);
 }
 
-void player_pause(void)
+static void track_pause(void)
 {
-
-    ESP_LOGD(TAG, "Pause");
-    esp_audio_pause(player);
+    if (track_url == NULL || track_paused)
+        return;
+    TickType_t now = xTaskGetTickCount();
+    track_due = (int32_t)(track_due - now) > 0 ? track_due - now : 0;
+    track_paused = true;
 }
 
-/* seek to position seconds */
-void player_seek(int position)
+static void track_resume(void)
 {
-    ESP_LOGD(TAG, "Seek to %d", position);
-    if (esp_audio_seek(player, position) == ESP_OK)
-    {
-        fire_event(MP_EVENT_POSITION, &position);
-    }
+    if (!track_paused)
+        return;
+    track_due += xTaskGetTickCount();
+    track_paused = false;
 }
 
-player_state_t player_state_get(void)
+static void source_set(media_sourece_t *source)
 {
-    return player_state;
+    ESP_LOGD(TAG, "Set URL = %s, source = %s", source->url, media_sourece_names[source->type]);
+    audio_trace_begin(AUDIO_TRACE_PLAYER_SOURCE_SET, source->type);
+    esp_audio_stop(player, TERMINATION_TYPE_NOW);
+    track_drop();
+    media_sourece.type = source->type;
+    source_url_set(source->url);
+    time_offset = 0;
+    // the url may be freed before the event is delivered
+    media_sourece_t subject = {
+        .type = media_sourece.type,
+        .url = NULL,
+    };
+    fire_event(MP_EVENT_SOURCE, &subject, sizeof(subject));
 }
 
-audio_err_t player_play(void)
+static audio_err_t play(void)
 {
     esp_audio_state_t state = {0};
     audio_err_t ret = esp_audio_state_get(player, &state);
@@ -140,21 +309,21 @@ audio_err_t player_play(void)
         ESP_LOGD(TAG, "Resume");
         ret = esp_audio_resume(player);
         ESP_RETURN_ON_ERROR(ret, TAG, "Cannot resume. Error code: %d", ret);
+        track_resume();
     }
     else if (media_sourece.url != NULL)
     {
         ESP_LOGD(TAG, "Playing %s", media_sourece.url);
+        audio_trace_begin(AUDIO_TRACE_PLAYER_PLAY, media_sourece.type);
         if (state.status != AUDIO_STATUS_RUNNING)
-        {
-            player_state = MP_STATE_TRANSITIONING;
-            fire_event(MP_EVENT_STATE, &player_state);
-        }
+            state_set(MP_STATE_TRANSITIONING);
+        player_buffer_apply();
+        track_drop();
+        time_offset = 0;
         ret = esp_audio_play(player, AUDIO_CODEC_TYPE_DECODER, media_sourece.url, 0);
+        audio_trace_mark(AUDIO_TRACE_ESP_AUDIO_PLAY, ret);
         if (ret != ESP_OK)
-        {
-            player_state = MP_STATE_ERROR;
-            fire_event(MP_EVENT_STATE, &player_state);
-        }
+            state_set(MP_STATE_ERROR);
         ESP_RETURN_ON_ERROR(ret, TAG, "Cannot play url:%s Error code: %d", media_sourece.url, ret);
     }
     else
@@ -164,114 +333,409 @@ audio_err_t player_play(void)
     return ret;
 }
 
-static esp_err_t i2s_stream_volume_set(audio_element_handle_t i2s_stream, int volume)
-{
-    ESP_LOGD(TAG, "Volume set = %d", volume);
-    if (i2s_alc_volume_set(i2s_stream, volume * 1.28 - 64) == ESP_OK)
-    {
-        fire_event(MP_EVENT_VOLUME, &volume);
-        return ESP_OK;
-    }
-    return ESP_FAIL;
-}
-
-esp_err_t player_volume_set(int volume)
+static esp_err_t volume_set(int volume)
 {
     if (volume > 100)
         volume = 100;
     if (volume < 0)
         volume = 0;
+    // kept in RAM, the config writes it to flash once it stopped changing
     config_set_audio_volume(volume);
     return i2s_stream_volume_set(i2s_stream_handle, volume);
 }
 
-static esp_err_t i2s_stream_volume_get(audio_element_handle_t i2s_stream, int *volume)
+static esp_err_t seek(int position)
 {
-    ESP_LOGD(TAG, "Volume get");
-    int i2s_vol = 0;
-    if (i2s_alc_volume_get(i2s_stream, &i2s_vol) == ESP_OK)
+    seek_pending = false;
+    // the seek is in the track the reader is at, the buffered end of the previous one is dropped
+    if (track_url)
+        track_changed();
+    ESP_LOGD(TAG, "Seek to %d", position);
+    ESP_RETURN_ON_FALSE(esp_audio_seek(player, position) == ESP_OK, ESP_FAIL, TAG, "Cannot seek to %d", position);
+    // the position is in the current track, esp_audio restarts its clock from it after a gapless switch too
+    time_offset = 0;
+    fire_event(MP_EVENT_POSITION, &position, sizeof(position));
+    return ESP_OK;
+}
+
+static int request_take(request_t *request)
+{
+    taskENTER_CRITICAL(&request_lock);
+    request->queued = false;
+    int value = request->value;
+    taskEXIT_CRITICAL(&request_lock);
+    return value;
+}
+
+static esp_err_t mute_set(bool mute)
+{
+    esp_err_t ret = ESP_OK;
+    if (mute)
     {
-        *volume = (i2s_vol + 64) / 1.28;
-        return ESP_OK;
+        ESP_GOTO_ON_ERROR(i2s_stream_volume_get(i2s_stream_handle, &muted_volume), err, TAG, "Cannot get volume before muting");
+        ESP_GOTO_ON_ERROR(volume_set(0), err, TAG, "Cannot set volume to 0 for muting");
     }
-    return ESP_FAIL;
+    else
+    {
+        ESP_GOTO_ON_ERROR(volume_set(muted_volume), err, TAG, "Cannot restore volume for unmuting");
+    }
+    shared_write_begin();
+    shared.snapshot.muted = mute;
+    shared_write_end();
+    fire_event(MP_EVENT_MUTE, &mute, sizeof(mute));
+err:
+    return ret;
 }
 
-esp_err_t player_volume_get(int *volume)
+static void status_set(esp_audio_status_t status)
 {
-    return i2s_stream_volume_get(i2s_stream_handle, volume);
+    ESP_LOGD(TAG, "Audio event recieved, status = %s", esp_audio_status_names[status]);
+    switch (status)
+    {
+    case AUDIO_STATUS_RUNNING:
+        state_set(MP_STATE_PLAYING);
+        break;
+    case AUDIO_STATUS_PAUSED:
+        state_set(MP_STATE_PAUSED);
+        break;
+    case AUDIO_STATUS_STOPPED:
+        state_set(MP_STATE_STOPPED);
+        break;
+    case AUDIO_STATUS_FINISHED:
+        state_set(MP_STATE_FINISHED);
+        break;
+    case AUDIO_STATUS_ERROR:
+        state_set(MP_STATE_ERROR);
+        break;
+    default:
+        state_set(MP_STATE_TRANSITIONING);
+        break;
+    }
 }
 
-bool player_mute_get(void)
+static void status_take(void)
 {
-    return player_muted;
+    taskENTER_CRITICAL(&request_lock);
+    bool queued = status_request.queued;
+    status_request.queued = false;
+    esp_audio_status_t status = status_request.value;
+    taskEXIT_CRITICAL(&request_lock);
+    if (queued)
+        status_set(status);
 }
 
-esp_err_t player_mute_set(bool mute)
+static esp_err_t command_run(player_cmd_t *cmd)
 {
-    esp_err_t ret = ESP_OK;
-    if (mute)
+    switch (cmd->type)
     {
-        ESP_GOTO_ON_ERROR(player_volume_get(&muted_volume), err, TAG, "Cannot get volume before muting");
-        ESP_GOTO_ON_ERROR(player_volume_set(0), err, TAG, "Cannot set volume to 0 for muting");
+    case CMD_SOURCE_SET:
+        seek_pending = false;
+        source_set(&cmd->arg.source);
+        return ESP_OK;
+    case CMD_PLAY:
+        return play();
+    case CMD_STOP:
+        ESP_LOGD(TAG, "Stop");
+        seek_pending = false;
+        track_drop();
+        return esp_audio_stop(player, TERMINATION_TYPE_NOW);
+    case CMD_PAUSE:
+        ESP_LOGD(TAG, "Pause");
+        ESP_RETURN_ON_ERROR(esp_audio_pause(player), TAG, "Cannot pause");
+        track_pause();
+        return ESP_OK;
+    case CMD_SEEK:
+        // every seek reconnects with a range request, it waits until the target stopped moving
+        seek_target = request_take(&seek_request);
+        seek_pending = true;
+        seek_due = xTaskGetTickCount() + pdMS_TO_TICKS(PLAYER_SEEK_SETTLE_MS);
+        return ESP_OK;
+    case CMD_VOLUME_SET:
+        return volume_set(request_take(&volume_request));
+    case CMD_MUTE_SET:
+        return mute_set(cmd->arg.mute);
+    case CMD_STATUS:
+        status_take();
+        return ESP_OK;
+    case CMD_TRACK_CHANGED:
+        if (track_url)
+            track_changed();
+        track_url = cmd->arg.track.url;
+        track_due = cmd->arg.track.due;
+        return ESP_OK;
     }
-    else
+    return ESP_ERR_INVALID_ARG;
+}
+
+static TickType_t wait_until(TickType_t wait, TickType_t due, TickType_t now)
+{
+    if ((int32_t)(due - now) <= 0)
+        return 0;
+    return due - now < wait ? due - now : wait;
+}
+
+// time until the next deferred work of the player task
+static TickType_t task_wait_get(void)
+{
+    TickType_t now = xTaskGetTickCount();
+    TickType_t wait = shared.snapshot.state == MP_STATE_PLAYING ? pdMS_TO_TICKS(PLAYER_PROGRESS_PERIOD_MS) : portMAX_DELAY;
+    if (seek_pending)
+        wait = wait_until(wait, seek_due, now);
+    if (track_url && !track_paused)
+        wait = wait_until(wait, track_due, now);
+    return wait;
+}
+
+/* All changes of the player are made here, one after the other */
+static void player_task(void *p)
+{
+    player_cmd_t cmd;
+    while (true)
     {
-        ESP_GOTO_ON_ERROR(player_volume_set(muted_volume), err, TAG, "Cannot restore volume for unmuting");
+        if (xQueueReceive(commands, &cmd, task_wait_get()) == pdTRUE)
+        {
+            esp_err_t ret = command_run(&cmd);
+            if (cmd.wait)
+            {
+                call_result = ret;
+                xSemaphoreGive(call_done);
+            }
+        }
+        // a status whose command did not fit in the queue
+        if (__atomic_load_n(&status_request.queued, __ATOMIC_RELAXED))
+            status_take();
+        TickType_t now = xTaskGetTickCount();
+        if (seek_pending && (int32_t)(seek_due - now) <= 0)
+            seek(seek_target);
+        if (track_url && !track_paused && (int32_t)(track_due - now) <= 0)
+            track_changed();
+        progress_update();
     }
-    player_muted = mute;
-    fire_event(MP_EVENT_MUTE, &mute);
-err:
+}
+
+// queues the command and waits until the player task ran it
+static esp_err_t command_call(player_cmd_t *cmd)
+{
+    ESP_RETURN_ON_FALSE(commands != NULL, ESP_ERR_INVALID_STATE, TAG, "Player not initialized");
+    ESP_RETURN_ON_FALSE(xTaskGetCurrentTaskHandle() != th_player, ESP_ERR_INVALID_STATE, TAG, "Player command %d from the player task", cmd->type);
+    cmd->wait = true;
+    xSemaphoreTake(call_lock, portMAX_DELAY);
+    xQueueSend(commands, cmd, portMAX_DELAY);
+    xSemaphoreTake(call_done, portMAX_DELAY);
+    esp_err_t ret = call_result;
+    xSemaphoreGive(call_lock);
     return ret;
 }
 
+// queues the command without waiting, used by the audio tasks and the coalesced requests
+static bool command_post(player_cmd_t *cmd)
+{
+    cmd->wait = false;
+    if (commands == NULL || xQueueSend(commands, cmd, 0) != pdTRUE)
+    {
+        ESP_LOGE(TAG, "Command queue full, player command %d dropped", cmd->type);
+        if (cmd->type == CMD_TRACK_CHANGED)
+            free(cmd->arg.track.url);
+        return false;
+    }
+    return true;
+}
+
+// replaces the value of a queued request, queues the command if there is none
+static esp_err_t request_post(request_t *request, player_cmd_type_t type, int value)
+{
+    taskENTER_CRITICAL(&request_lock);
+    request->value = value;
+    bool queued = request->queued;
+    request->queued = true;
+    taskEXIT_CRITICAL(&request_lock);
+    if (queued)
+        return ESP_OK;
+    player_cmd_t cmd = {.type = type};
+    if (command_post(&cmd))
+        return ESP_OK;
+    taskENTER_CRITICAL(&request_lock);
+    request->queued = false;
+    taskEXIT_CRITICAL(&request_lock);
+    return ESP_FAIL;
+}
+
+void player_source_set(media_sourece_t *source)
+{
+    player_cmd_t cmd = {
+        .type = CMD_SOURCE_SET,
+        .arg.source = {
+            .type = source->type,
+            .url = source->url == NULL ? NULL : strdup(source->url),
+        },
+    };
+    if (command_call(&cmd) != ESP_OK && cmd.arg.source.url != NULL)
+        free(cmd.arg.source.url);
+}
+
+media_sourece_type_t player_source_type_get(void)
+{
+    player_snapshot_t snapshot;
+    player_snapshot_get(&snapshot);
+    return snapshot.source_type;
+}
+
+int player_source_url_get(char *buffer, int size)
+{
+    if (size <= 0)
+        return 0;
+    uint32_t seq;
+    do
+    {
+        seq = shared_read_begin();
+        strlcpy(buffer, shared.url, size);
+    } while (shared_read_retry(seq));
+    return strlen(buffer);
+}
+
+void player_snapshot_get(player_snapshot_t *snapshot)
+{
+    uint32_t seq;
+    do
+    {
+        seq = shared_read_begin();
+        *snapshot = shared.snapshot;
+    } while (shared_read_retry(seq));
+}
+
+void player_stop(void)
+{
+    player_cmd_t cmd = {.type = CMD_STOP};
+    command_call(&cmd);
+}
+
+void player_pause(void)
+{
+    player_cmd_t cmd = {.type = CMD_PAUSE};
+    command_call(&cmd);
+}
+
+/* seek to position seconds */
+void player_seek(int position)
+{
+    request_post(&seek_request, CMD_SEEK, position);
+}
+
+player_state_t player_state_get(void)
+{
+    player_snapshot_t snapshot;
+    player_snapshot_get(&snapshot);
+    return snapshot.state;
+}
+
+audio_err_t player_play(void)
+{
+    player_cmd_t cmd = {.type = CMD_PLAY};
+    return command_call(&cmd);
+}
+
+esp_err_t player_volume_set(int volume)
+{
+    return request_post(&volume_request, CMD_VOLUME_SET, volume);
+}
+
+esp_err_t player_volume_get(int *volume)
+{
+    // a volume not applied yet is the one to step from
+    taskENTER_CRITICAL(&request_lock);
+    bool queued = volume_request.queued;
+    *volume = volume_request.value;
+    taskEXIT_CRITICAL(&request_lock);
+    if (!queued)
+    {
+        player_snapshot_t snapshot;
+        player_snapshot_get(&snapshot);
+        *volume = snapshot.volume;
+    }
+    return ESP_OK;
+}
+
+bool player_mute_get(void)
+{
+    player_snapshot_t snapshot;
+    player_snapshot_get(&snapshot);
+    return snapshot.muted;
+}
+
+esp_err_t player_mute_set(bool mute)
+{
+    player_cmd_t cmd = {.type = CMD_MUTE_SET, .arg.mute = mute};
+    return command_post(&cmd) ? ESP_OK : ESP_FAIL;
+}
+
 esp_err_t player_audio_time_get(int *sec)
 {
-    int time = 0;
-    esp_audio_time_get(player, &time);
-    *sec = time / 1000;
+    player_snapshot_t snapshot;
+    player_snapshot_get(&snapshot);
+    *sec = snapshot.time;
     return ESP_OK;
 }
 
 esp_err_t player_audio_duration_get(int *sec)
 {
-    int duration = 0;
-    esp_audio_duration_get(player, &duration);
-    duration /= 1000;
-    *sec = duration;
+    player_snapshot_t snapshot;
+    player_snapshot_get(&snapshot);
+    *sec = snapshot.duration;
     return ESP_OK;
 }
 
 esp_err_t player_audio_position_get(int *position)
 {
-    return esp_audio_pos_get(player, position);
+    player_snapshot_t snapshot;
+    player_snapshot_get(&snapshot);
+    *position = snapshot.position;
+    return ESP_OK;
 }
 
+// called from the esp_audio task which the player task may be waiting for, only the latest status counts
 static void esp_audio_callback(esp_audio_state_t *state, void *ctx)
 {
-    ESP_LOGD(TAG, "Audio event recieved, status = %s", esp_audio_status_names[state->status]);
-    switch (state->status)
+    taskENTER_CRITICAL(&request_lock);
+    status_request.value = state->status;
+    bool queued = status_request.queued;
+    status_request.queued = true;
+    taskEXIT_CRITICAL(&request_lock);
+    player_cmd_t cmd = {.type = CMD_STATUS};
+    // if the queue is full the player task finds the status after running the queued commands
+    if (!queued)
+        command_post(&cmd);
+}
+
+// asks the source of the current track for the next one, called from the reader task
+static int gapless_next(char *url, int url_size)
+{
+    player_next_track_cb next_track = gapless_next_track[player_source_type_get()];
+    if (next_track == NULL)
+        return ESP_FAIL;
+    // the source still has the previous track as the current one
+    if (__atomic_load_n(&track_pending, __ATOMIC_RELAXED))
     {
-    case AUDIO_STATUS_RUNNING:
-        player_state = MP_STATE_PLAYING;
-        break;
-    case AUDIO_STATUS_PAUSED:
-        player_state = MP_STATE_PAUSED;
-        break;
-    case AUDIO_STATUS_STOPPED:
-        player_state = MP_STATE_STOPPED;
-        break;
-    case AUDIO_STATUS_FINISHED:
-        player_state = MP_STATE_FINISHED;
-        break;
-    case AUDIO_STATUS_ERROR:
-        player_state = MP_STATE_ERROR;
-        break;
-    default:
-        player_state = MP_STATE_TRANSITIONING;
-        break;
+        ESP_LOGI(TAG, "Previous gapless track not heard yet, no gapless playback");
+        return ESP_FAIL;
     }
-    fire_event(MP_EVENT_STATE, &player_state);
+    return next_track(url, url_size) ? ESP_OK : ESP_FAIL;
+}
+
+// the switch is made by the player task once the audio the reader wrote before it has been played
+static int gapless_changed(audio_element_handle_t reader, const char *changed_url)
+{
+    uint32_t delay_ms = player_buffer_delay_ms(reader);
+    player_cmd_t cmd = {
+        .type = CMD_TRACK_CHANGED,
+        .arg.track.url = strdup(changed_url),
+        .arg.track.due = xTaskGetTickCount() + pdMS_TO_TICKS(delay_ms),
+    };
+    ESP_RETURN_ON_FALSE(cmd.arg.track.url != NULL, ESP_ERR_NO_MEM, TAG, "Not enough memmory for track url");
+    ESP_LOGD(TAG, "Gapless track heard in %lu ms: %s", delay_ms, changed_url);
+    __atomic_store_n(&track_pending, true, __ATOMIC_RELAXED);
+    if (!command_post(&cmd))
+        __atomic_store_n(&track_pending, false, __ATOMIC_RELAXED);
+    return ESP_OK;
 }
 
 static int esp_http_stream_callback(http_stream_event_msg_t *msg)
@@ -290,7 +754,7 @@ static int esp_http_stream_callback(http_stream_event_msg_t *msg)
     }
     if (msg->event_id == HTTP_STREAM_ICY_METADATA)
     {
-        ESP_LOGI(TAG, "ICY metadata found in http stream[%d] = [%s]", msg->buffer_len, (char *)msg->buffer);
+        ESP_LOGD(TAG, "ICY metadata found in http stream[%d] = [%s]", msg->buffer_len, (char *)msg->buffer);
         metadata_set_icy_str(msg->buffer);
     }
     if (msg->event_id == HTTP_STREAM_ICY_HEADER)
@@ -298,6 +762,33 @@ static int esp_http_stream_callback(http_stream_event_msg_t *msg)
         ESP_LOGI(TAG, "ICY header found in http stream[%d] = [%s]", msg->buffer_len, (char *)msg->buffer);
         // fire_event(MP_EVENT_ICY_HEADER, msg->buffer);
     }
+    if (msg->event_id == HTTP_STREAM_NEXT_TRACK)
+    {
+        return gapless_next((char *)msg->buffer, msg->buffer_len);
+    }
+    if (msg->event_id == HTTP_STREAM_TRACK_CHANGED)
+    {
+        return gapless_changed(msg->el, (char *)msg->buffer);
+    }
+    return ESP_OK;
+}
+
+void player_gapless_set(media_sourece_type_t type, player_next_track_cb next_track, player_track_changed_cb track_changed)
+{
+    gapless_next_track[type] = next_track;
+    gapless_track_changed[type] = track_changed;
+}
+
+static int esp_fatfs_stream_callback(fatfs_stream_event_msg_t *msg)
+{
+    if (msg->event_id == FATFS_STREAM_NEXT_TRACK)
+    {
+        return gapless_next((char *)msg->buffer, msg->buffer_len);
+    }
+    if (msg->event_id == FATFS_STREAM_TRACK_CHANGED)
+    {
+        return gapless_changed(msg->el, (char *)msg->buffer);
+    }
     return ESP_OK;
 }
 
@@ -323,7 +814,7 @@ esp_audio_handle_t player_init(void)
     // i2s_writer.i2s_config.tx_desc_auto_clear = true;
     // i2s_writer.i2s_config.fixed_mclk = I2S_PIN_NO_CHANGE;
     // i2s_writer.i2s_config.bits_per_chan = I2S_BITS_PER_CHAN_DEFAULT;
-    i2s_writer.out_rb_size = AUDIO_RINGBUFFER_SIZE; // mod
+    i2s_writer.out_rb_size = I2S_STREAM_RINGBUFFER_SIZE; // last element, only a multi output would use it
     i2s_writer.buffer_len = 12 * 1024;              // mod
     i2s_writer.task_prio = 4;                       // mod
 
@@ -342,7 +833,7 @@ esp_audio_handle_t player_init(void)
     // Create readers and add to esp_audio
     http_stream_cfg_t http_cfg = HTTP_STREAM_CFG_DEFAULT();
     http_cfg.event_handle = esp_http_stream_callback;
-    http_cfg.out_rb_size = AUDIO_RINGBUFFER_SIZE; // esp-adf = HTTP_STREAM_RINGBUFFER_SIZE; // 20*1024
+    http_cfg.out_rb_size = PLAYER_BUFFER_NET_INITIAL_SIZE; // esp-adf = HTTP_STREAM_RINGBUFFER_SIZE; // 20*1024, adapted by player_buffer
     http_cfg.type = AUDIO_STREAM_READER;
     http_cfg.enable_playlist_parser = true;
     http_cfg.stack_in_ext = true;
@@ -362,20 +853,30 @@ esp_audio_handle_t player_init(void)
         DEFAULT_ESP_TS_DECODER_CONFIG(),
     };
     esp_decoder_cfg_t auto_dec_cfg = DEFAULT_ESP_DECODER_CONFIG();
-    auto_dec_cfg.out_rb_size = AUDIO_RINGBUFFER_SIZE;
-    esp_audio_codec_lib_add(player, AUDIO_CODEC_TYPE_DECODER, esp_decoder_init(&auto_dec_cfg, auto_decode, 10));
+    auto_dec_cfg.out_rb_size = PLAYER_BUFFER_PCM_SIZE;
+    audio_element_handle_t auto_decoder = esp_decoder_init(&auto_dec_cfg, auto_decode, 10);
+    esp_audio_codec_lib_add(player, AUDIO_CODEC_TYPE_DECODER, auto_decoder);
 
     esp_audio_output_stream_add(player, i2s_stream_handle);
 
     // SD card
     fatfs_stream_cfg_t fatfs_cfg = FATFS_STREAM_CFG_DEFAULT();
     fatfs_cfg.type = AUDIO_STREAM_READER;
+    fatfs_cfg.event_handle = esp_fatfs_stream_callback;
     audio_element_handle_t fatfs_stream_reader = fatfs_stream_init(&fatfs_cfg);
 
     esp_audio_input_stream_add(player, fatfs_stream_reader);
 
+    commands = xQueueCreate(PLAYER_COMMAND_QUEUE_LENGTH, sizeof(player_cmd_t));
+    call_lock = xSemaphoreCreateMutex();
+    call_done = xSemaphoreCreateBinary();
+    if (commands == NULL || call_lock == NULL || call_done == NULL ||
+        xTaskCreatePinnedToCore(&player_task, "player", PLAYER_TASK_STACK, NULL, PLAYER_TASK_PRIORITY, &th_player, 0) != pdPASS)
+        ESP_LOGE(TAG, "Cannot create player task");
     esp_audio_callback_set(player, esp_audio_callback, NULL);
 
+    player_buffer_init(http_stream_reader, auto_decoder, i2s_stream_handle);
+
     // Set default volume
     esp_audio_vol_set(player, config_get_audio_volume());
 
@@ -0,0 +1,276 @@
+#include "player_buffer.h"
+
+#include <math.h>
+#include <string.h>
+#include <strings.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_check.h"
+#include "esp_timer.h"
+#include "i2s_stream.h"
+
+static const char *TAG = "PLAYER_BUFFER";
+
+static audio_element_handle_t net_reader = NULL;
+static audio_element_handle_t decoder = NULL;
+static audio_element_handle_t i2s_writer = NULL;
+static SemaphoreHandle_t lock = NULL;
+static player_buffer_stats_t stats = {0};
+
+// moving averages, updated with 1/8 weight
+static float bitrate = 0;
+static float throughput = 0;
+static float throughput_var = 0;
+
+// previous sample of the current stream
+static int64_t last_time = 0;
+static int64_t last_pos = 0;
+static int last_fill = 0;
+
+static uint32_t watermark_ms = PLAYER_BUFFER_FAST_START_MS;
+static uint32_t applied_size = 0; // set by player_buffer_apply(), checked once the stream runs
+
+static uint32_t align_size(float size)
+{
+    uint32_t aligned = ((uint32_t)size + PLAYER_BUFFER_NET_ALIGN - 1) / PLAYER_BUFFER_NET_ALIGN * PLAYER_BUFFER_NET_ALIGN;
+    if (aligned < PLAYER_BUFFER_NET_MIN_SIZE)
+        return PLAYER_BUFFER_NET_MIN_SIZE;
+    if (aligned > PLAYER_BUFFER_NET_MAX_SIZE)
+        return PLAYER_BUFFER_NET_MAX_SIZE;
+    return aligned;
+}
+
+// must be called with lock held
+static void target_update(void)
+{
+    if (bitrate <= 0)
+    {
+        stats.target_size = PLAYER_BUFFER_NET_INITIAL_SIZE;
+        return;
+    }
+    // the more the throughput varies the longer the buffer has to bridge the gaps
+    float seconds = PLAYER_BUFFER_MAX_SECONDS;
+    if (throughput > bitrate * 1.25f)
+    {
+        float jitter = sqrtf(throughput_var) / throughput;
+        seconds = PLAYER_BUFFER_MIN_SECONDS + (PLAYER_BUFFER_MAX_SECONDS - PLAYER_BUFFER_MIN_SECONDS) * (jitter < 1 ? jitter : 1);
+    }
+    seconds += stats.stream_underruns * PLAYER_BUFFER_UNDERRUN_SECONDS;
+    stats.target_size = align_size(bitrate * seconds);
+}
+
+// must be called with lock held
+static void watermark_update(void)
+{
+    if (bitrate > 0)
+        stats.steady_ms = stats.target_size / bitrate * 1000 / 2;
+    else
+        stats.steady_ms = PLAYER_BUFFER_STEADY_DEFAULT_MS;
+    if (audio_element_get_state(i2s_writer) == AEL_STATE_RUNNING && watermark_ms < stats.steady_ms)
+    {
+        watermark_ms += PLAYER_BUFFER_RAMP_MS_PER_S * PLAYER_BUFFER_SAMPLE_MS / 1000;
+        if (watermark_ms > stats.steady_ms)
+            watermark_ms = stats.steady_ms;
+    }
+    stats.watermark_ms = watermark_ms;
+}
+
+// called from the i2s task, lock-free reads are good enough here
+static bool prefill_ready(audio_element_handle_t i2s, void *ctx)
+{
+    // everything left is decoded already
+    if (audio_element_get_state(decoder) == AEL_STATE_FINISHED)
+        return true;
+    ringbuf_handle_t pcm_rb = audio_element_get_output_ringbuf(decoder);
+    if (pcm_rb == NULL)
+        return false;
+    int pcm_fill = rb_bytes_filled(pcm_rb);
+    audio_element_info_t info = {0};
+    audio_element_getinfo(i2s, &info);
+    int pcm_bytes_per_ms = info.sample_rates * info.channels * info.bits / 8 / 1000;
+    uint32_t buffered_ms = pcm_bytes_per_ms > 0 ? pcm_fill / pcm_bytes_per_ms : 0;
+
+    ringbuf_handle_t net_rb = audio_element_get_output_ringbuf(net_reader);
+    if (net_rb != NULL && audio_element_get_state(net_reader) == AEL_STATE_RUNNING)
+    {
+        int net_fill = rb_bytes_filled(net_rb);
+        // nothing more fits
+        if (net_fill >= rb_get_size(net_rb) * 9 / 10)
+            return true;
+        float rate = bitrate > 0 ? bitrate : PLAYER_BUFFER_DEFAULT_BITRATE;
+        buffered_ms += net_fill * 1000 / rate;
+    }
+    else if (pcm_fill >= rb_get_size(pcm_rb) * 3 / 4)
+    {
+        // a local file, only the pcm buffer fills up
+        return true;
+    }
+    return buffered_ms >= watermark_ms;
+}
+
+// must be called with lock held
+static void sample(void)
+{
+    ringbuf_handle_t net_rb = audio_element_get_output_ringbuf(net_reader);
+    ringbuf_handle_t pcm_rb = audio_element_get_output_ringbuf(decoder);
+    stats.net_fill = net_rb != NULL ? rb_bytes_filled(net_rb) : 0;
+    stats.net_size = net_rb != NULL ? rb_get_size(net_rb) : 0;
+    stats.pcm_fill = pcm_rb != NULL ? rb_bytes_filled(pcm_rb) : 0;
+    stats.pcm_size = pcm_rb != NULL ? rb_get_size(pcm_rb) : 0;
+
+    uint32_t underruns = i2s_stream_get_underruns(i2s_writer);
+    if (underruns != stats.underruns)
+    {
+        stats.stream_underruns += underruns - stats.underruns;
+        if (watermark_ms < stats.steady_ms)
+            stats.ramp_underruns += underruns - stats.underruns;
+        else
+            stats.steady_underruns += underruns - stats.underruns;
+        stats.underruns = underruns;
+        ESP_LOGW(TAG, "Underrun, network buffer %lu/%lu, pcm buffer %lu/%lu, watermark %lu/%lu ms", stats.net_fill, stats.net_size, stats.pcm_fill, stats.pcm_size, stats.watermark_ms, stats.steady_ms);
+        target_update();
+    }
+    watermark_update();
+
+    if (net_rb == NULL || audio_element_get_state(net_reader) != AEL_STATE_RUNNING)
+    {
+        last_time = 0;
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    audio_element_info_t info = {0};
+    audio_element_getinfo(net_reader, &info);
+    int fill = stats.net_fill;
+    int64_t downloaded = info.byte_pos - last_pos;
+    // a new stream, or a seek
+    if (last_time == 0 || downloaded < 0 || downloaded > 2 * (int64_t)stats.net_size)
+    {
+        // the ring buffer is created by esp_audio when the stream starts, it has to be the size applied
+        if (applied_size != 0 && stats.net_size != applied_size)
+            ESP_LOGW(TAG, "Network buffer is %lu KB, %lu KB were applied", stats.net_size / 1024, applied_size / 1024);
+        applied_size = 0;
+        last_time = now;
+        last_pos = info.byte_pos;
+        last_fill = fill;
+        return;
+    }
+    float dt = (now - last_time) / 1000000.0f;
+    int64_t consumed = downloaded - (fill - last_fill);
+    if (consumed > 0)
+    {
+        float rate = consumed / dt;
+        bitrate = bitrate > 0 ? bitrate + (rate - bitrate) / 8 : rate;
+    }
+    // a nearly full buffer throttles the download, the throughput of the connection is not known then
+    int high = stats.net_size * 3 / 4;
+    if (last_fill < high && fill < high)
+    {
+        float rate = downloaded / dt;
+        if (throughput > 0)
+        {
+            float diff = rate - throughput;
+            throughput += diff / 8;
+            throughput_var = throughput_var * 7 / 8 + diff * diff / 8;
+        }
+        else
+        {
+            throughput = rate;
+        }
+    }
+    stats.bitrate = bitrate;
+    stats.throughput = throughput;
+    stats.throughput_dev = sqrtf(throughput_var);
+    target_update();
+
+    last_time = now;
+    last_pos = info.byte_pos;
+    last_fill = fill;
+}
+
+static void buffer_task(void *p)
+{
+    while (true)
+    {
+        xSemaphoreTake(lock, portMAX_DELAY);
+        sample();
+        xSemaphoreGive(lock);
+        vTaskDelay(pdMS_TO_TICKS(PLAYER_BUFFER_SAMPLE_MS));
+    }
+}
+
+void player_buffer_apply(void)
+{
+    if (lock == NULL)
+        return;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    stats.stream_underruns = 0;
+    last_time = 0;
+    watermark_ms = PLAYER_BUFFER_FAST_START_MS;
+    target_update();
+    watermark_update();
+    if (audio_element_get_output_ringbuf_size(net_reader) != stats.target_size)
+    {
+        ESP_LOGI(TAG, "Network buffer %lu KB, bitrate %lu B/s, throughput %lu +- %lu B/s", stats.target_size / 1024, stats.bitrate, stats.throughput, stats.throughput_dev);
+        audio_element_set_output_ringbuf_size(net_reader, stats.target_size);
+    }
+    applied_size = stats.target_size;
+    xSemaphoreGive(lock);
+}
+
+// lock-free reads like prefill_ready(), called from the reader tasks
+uint32_t player_buffer_delay_ms(audio_element_handle_t reader)
+{
+    if (lock == NULL)
+        return 0;
+    audio_element_info_t info = {0};
+    audio_element_getinfo(i2s_writer, &info);
+    int pcm_bytes_per_ms = info.sample_rates * info.channels * info.bits / 8 / 1000;
+    if (pcm_bytes_per_ms <= 0)
+        return 0;
+    ringbuf_handle_t pcm_rb = audio_element_get_output_ringbuf(decoder);
+    uint32_t delay_ms = pcm_rb != NULL ? rb_bytes_filled(pcm_rb) / pcm_bytes_per_ms : 0;
+    ringbuf_handle_t reader_rb = audio_element_get_output_ringbuf(reader);
+    if (reader_rb != NULL)
+    {
+        // the bitrate is only measured for the network reader, a WAV file is read at the rate it is played
+        char *uri = audio_element_get_uri(reader);
+        char *ext = uri != NULL ? strrchr(uri, '.') : NULL;
+        float rate = PLAYER_BUFFER_DEFAULT_BITRATE;
+        if (reader == net_reader && bitrate > 0)
+            rate = bitrate;
+        else if (ext != NULL && strcasecmp(ext, ".wav") == 0)
+            rate = pcm_bytes_per_ms * 1000;
+        delay_ms += rb_bytes_filled(reader_rb) * 1000 / rate;
+    }
+    return delay_ms;
+}
+
+void player_buffer_stats_get(player_buffer_stats_t *buffer_stats)
+{
+    if (lock == NULL)
+    {
+        memset(buffer_stats, 0, sizeof(player_buffer_stats_t));
+        return;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    *buffer_stats = stats;
+    xSemaphoreGive(lock);
+}
+
+esp_err_t player_buffer_init(audio_element_handle_t net, audio_element_handle_t dec, audio_element_handle_t i2s)
+{
+    ESP_RETURN_ON_FALSE(lock == NULL, ESP_OK, TAG, "Player buffer already initialized");
+    ESP_RETURN_ON_FALSE(net && dec && i2s, ESP_ERR_INVALID_ARG, TAG, "Missing pipeline element");
+    net_reader = net;
+    decoder = dec;
+    i2s_writer = i2s;
+    stats.target_size = PLAYER_BUFFER_NET_INITIAL_SIZE;
+    lock = xSemaphoreCreateMutex();
+    ESP_RETURN_ON_FALSE(lock != NULL, ESP_ERR_NO_MEM, TAG, "Cannot create player buffer lock");
+    ESP_RETURN_ON_ERROR(i2s_stream_set_prefill_cb(i2s_writer, prefill_ready, NULL, PLAYER_BUFFER_PREFILL_MAX_WAIT_MS), TAG, "Cannot set prefill callback");
+    BaseType_t ret = xTaskCreatePinnedToCore(&buffer_task, "player_buffer", 3 * 1024, NULL, 1, NULL, 0);
+    ESP_RETURN_ON_FALSE(ret == pdPASS, ESP_FAIL, TAG, "Cannot create player_buffer task, error code: %d", ret);
+    return ESP_OK;
+}
@@ -0,0 +1,202 @@
+#include "station_list.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "esp_log.h"
+#include "esp_check.h"
+
+static const char *TAG = "STATION_LIST";
+
+static const uint32_t *offsets_get(const station_list_t *list)
+{
+    return (const uint32_t *)(list + 1);
+}
+
+static const char *pool_get(const station_list_t *list)
+{
+    return (const char *)(offsets_get(list) + STATION_FIELD_COUNT * list->count);
+}
+
+void station_list_builder_init(station_list_builder_t *builder)
+{
+    memset(builder, 0, sizeof(station_list_builder_t));
+}
+
+void station_list_builder_free(station_list_builder_t *builder)
+{
+    if (builder->pool != NULL)
+        free(builder->pool);
+    if (builder->offsets != NULL)
+        free(builder->offsets);
+    station_list_builder_init(builder);
+}
+
+esp_err_t station_list_builder_add(station_list_builder_t *builder)
+{
+    ESP_RETURN_ON_FALSE(builder->count < UINT16_MAX, ESP_ERR_INVALID_SIZE, TAG, "Too many stations");
+    if (builder->count == builder->capacity)
+    {
+        int capacity = builder->capacity > 0 ? builder->capacity * 2 : 32;
+        uint32_t *offsets = (uint32_t *)realloc(builder->offsets, capacity * STATION_FIELD_COUNT * sizeof(uint32_t));
+        ESP_RETURN_ON_FALSE(offsets != NULL, ESP_ERR_NO_MEM, TAG, "Not enough memmory for station list");
+        builder->offsets = offsets;
+        builder->capacity = capacity;
+    }
+    uint32_t *station = &builder->offsets[builder->count * STATION_FIELD_COUNT];
+    for (int i = 0; i < STATION_FIELD_COUNT; i++)
+        station[i] = STATION_FIELD_NONE;
+    builder->count++;
+    return ESP_OK;
+}
+
+esp_err_t station_list_builder_set(station_list_builder_t *builder, station_field_t field, const char *value, int len)
+{
+    ESP_RETURN_ON_FALSE(builder->count > 0 && field < STATION_FIELD_COUNT, ESP_ERR_INVALID_ARG, TAG, "No station to set");
+    if (builder->pool_size + len + 1 > builder->pool_capacity)
+    {
+        uint32_t capacity = builder->pool_capacity > 0 ? builder->pool_capacity * 2 : 4096;
+        while (capacity < builder->pool_size + len + 1)
+            capacity *= 2;
+        char *pool = (char *)realloc(builder->pool, capacity);
+        ESP_RETURN_ON_FALSE(pool != NULL, ESP_ERR_NO_MEM, TAG, "Not enough memmory for station strings");
+        builder->pool = pool;
+        builder->pool_capacity = capacity;
+    }
+    memcpy(builder->pool + builder->pool_size, value, len);
+    builder->pool[builder->pool_size + len] = 0;
+    builder->offsets[(builder->count - 1) * STATION_FIELD_COUNT + field] = builder->pool_size;
+    builder->pool_size += len + 1;
+    return ESP_OK;
+}
+
+esp_err_t station_list_builder_finish(station_list_builder_t *builder, station_list_t **list)
+{
+    uint32_t offsets_size = STATION_FIELD_COUNT * builder->count * sizeof(uint32_t);
+    uint32_t size = sizeof(station_list_t) + offsets_size + builder->pool_size;
+    station_list_t *block = (station_list_t *)malloc(size);
+    if (block == NULL)
+    {
+        station_list_builder_free(builder);
+        ESP_LOGE(TAG, "Not enough memmory for station list");
+        return ESP_ERR_NO_MEM;
+    }
+    block->magic = STATION_LIST_MAGIC;
+    block->version = STATION_LIST_VERSION;
+    block->count = builder->count;
+    block->pool_size = builder->pool_size;
+    block->size = size;
+
+    // built station by station, stored field by field
+    uint32_t *offsets = (uint32_t *)(block + 1);
+    for (int field = 0; field < STATION_FIELD_COUNT; field++)
+    {
+        for (int i = 0; i < builder->count; i++)
+            offsets[field * builder->count + i] = builder->offsets[i * STATION_FIELD_COUNT + field];
+    }
+    if (builder->pool_size > 0)
+        memcpy((char *)pool_get(block), builder->pool, builder->pool_size);
+    station_list_builder_free(builder);
+    *list = block;
+    return ESP_OK;
+}
+
+const char *station_list_get(const station_list_t *list, int index, station_field_t field)
+{
+    if (list == NULL || index < 0 || index >= list->count || field >= STATION_FIELD_COUNT)
+        return NULL;
+    uint32_t offset = offsets_get(list)[field * list->count + index];
+    return offset == STATION_FIELD_NONE ? NULL : pool_get(list) + offset;
+}
+
+int station_list_find(const station_list_t *list, const char *guide_id)
+{
+    if (list == NULL || guide_id == NULL)
+        return -1;
+    for (int i = 0; i < list->count; i++)
+    {
+        const char *id = station_list_get(list, i, STATION_GUIDE_ID);
+        if (id != NULL && strcmp(id, guide_id) == 0)
+            return i;
+    }
+    return -1;
+}
+
+bool station_list_equal(const station_list_t *a, const station_list_t *b)
+{
+    if (a == NULL || b == NULL)
+        return a == b;
+    return a->size == b->size && memcmp(a, b, a->size) == 0;
+}
+
+static bool station_list_valid(const station_list_t *list, uint32_t size)
+{
+    if (size < sizeof(station_list_t) || list->magic != STATION_LIST_MAGIC || list->version != STATION_LIST_VERSION || list->size != size)
+        return false;
+    if (sizeof(station_list_t) + STATION_FIELD_COUNT * list->count * sizeof(uint32_t) + list->pool_size != size)
+        return false;
+    if (list->pool_size > 0 && pool_get(list)[list->pool_size - 1] != 0)
+        return false;
+    const uint32_t *offsets = offsets_get(list);
+    for (int i = 0; i < STATION_FIELD_COUNT * list->count; i++)
+    {
+        if (offsets[i] != STATION_FIELD_NONE && offsets[i] >= list->pool_size)
+            return false;
+    }
+    return true;
+}
+
+esp_err_t station_list_save(const station_list_t *list, const char *path)
+{
+    char tmp_path[128];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *f = fopen(tmp_path, "wb");
+    ESP_RETURN_ON_FALSE(f != NULL, ESP_FAIL, TAG, "Cannot create %s", tmp_path);
+    bool ok = fwrite(list, list->size, 1, f) == 1;
+    ok = fflush(f) == 0 && ok;
+    fsync(fileno(f));
+    fclose(f);
+    if (!ok)
+    {
+        unlink(tmp_path);
+        ESP_LOGE(TAG, "Cannot write %s", tmp_path);
+        return ESP_FAIL;
+    }
+    // FAT cannot rename over an existing file, station_list_load() falls back to the tmp file if we stop in between
+    unlink(path);
+    ESP_RETURN_ON_FALSE(rename(tmp_path, path) == 0, ESP_FAIL, TAG, "Cannot rename %s", tmp_path);
+    ESP_LOGI(TAG, "%d stations saved to %s", list->count, path);
+    return ESP_OK;
+}
+
+esp_err_t station_list_load(const char *path, station_list_t **list)
+{
+    esp_err_t ret = ESP_OK;
+    station_list_t *block = NULL;
+    *list = NULL;
+
+    struct stat st;
+    char tmp_path[128];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    if (stat(path, &st) != 0 && stat(tmp_path, &st) == 0)
+    {
+        ESP_LOGW(TAG, "Station list update was interrupted, using %s", tmp_path);
+        rename(tmp_path, path);
+    }
+    ESP_RETURN_ON_FALSE(stat(path, &st) == 0, ESP_ERR_NOT_FOUND, TAG, "No saved station list");
+    FILE *f = fopen(path, "rb");
+    ESP_RETURN_ON_FALSE(f != NULL, ESP_ERR_NOT_FOUND, TAG, "Cannot open %s", path);
+    block = (station_list_t *)malloc(st.st_size);
+    ESP_GOTO_ON_FALSE(block != NULL, ESP_ERR_NO_MEM, err, TAG, "Not enough memmory for station list");
+    ESP_GOTO_ON_FALSE(fread(block, st.st_size, 1, f) == 1, ESP_FAIL, err, TAG, "Cannot read %s", path);
+    ESP_GOTO_ON_FALSE(station_list_valid(block, st.st_size), ESP_ERR_INVALID_VERSION, err, TAG, "Invalid station list in %s", path);
+    *list = block;
+    block = NULL;
+err:
+    fclose(f);
+    if (block != NULL)
+        free(block);
+    return ret;
+}
@@ -0,0 +1,364 @@
+#include "tunein_resolver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_check.h"
+#include "esp_timer.h"
+
+#include "http_client.h"
+
+#define M3U_LINE_MAX_SIZE 512
+
+typedef struct
+{
+    char *guide_id;
+    char *url;
+    int64_t resolved_at; // esp_timer time, 0 if unknown, negative if resolved before the boot
+    int64_t retry_at;    // esp_timer time of the next try if there is no url
+} resolver_entry_t;
+
+typedef struct
+{
+    char line[M3U_LINE_MAX_SIZE];
+    int len;
+    bool complete;
+} m3u_line_reader_t;
+
+static const char *TAG = "TUNEIN_RESOLVER";
+static const char *URL_BASE = "https://opml.radiotime.com/Tune.ashx?id=";
+
+static resolver_entry_t entries[TUNEIN_RESOLVER_MAX_ENTRIES];
+static int entry_count = 0;
+static bool cache_dirty = false;
+static SemaphoreHandle_t lock = NULL;
+static TaskHandle_t th_resolver = NULL;
+
+// collects the first line of the m3u file, stops the download at its end
+static bool m3u_first_line_cb(const char *chunk, int len, void *user_data)
+{
+    m3u_line_reader_t *reader = (m3u_line_reader_t *)user_data;
+    for (int i = 0; i < len; i++)
+    {
+        if (chunk[i] == '\r' || chunk[i] == '\n')
+        {
+            reader->complete = true;
+            return false;
+        }
+        if (reader->len == M3U_LINE_MAX_SIZE - 1)
+            return false;
+        reader->line[reader->len++] = chunk[i];
+    }
+    return true;
+}
+
+static esp_err_t stream_url_resolve(const char *guide_id, char **stream_url)
+{
+    esp_err_t ret = ESP_OK;
+    char *download_url = NULL;
+    char *chunk_buffer = NULL;
+    m3u_line_reader_t *reader = NULL;
+    *stream_url = NULL;
+    int64_t start = esp_timer_get_time();
+
+    int url_length = strlen(URL_BASE) + strlen(guide_id) + 1;
+    download_url = (char *)malloc(url_length);
+    chunk_buffer = (char *)malloc(M3U_LINE_MAX_SIZE);
+    reader = (m3u_line_reader_t *)calloc(1, sizeof(m3u_line_reader_t));
+    ESP_GOTO_ON_FALSE(download_url && chunk_buffer && reader, ESP_ERR_NO_MEM, err, TAG, "Not enough memmory for m3u download");
+    strcpy(download_url, URL_BASE);
+    strcat(download_url, guide_id);
+
+    ret = http_client_get_stream(download_url, chunk_buffer, M3U_LINE_MAX_SIZE, m3u_first_line_cb, reader);
+    ESP_GOTO_ON_ERROR(ret, err, TAG, "Cannot download m3u file");
+    ESP_GOTO_ON_FALSE((reader->complete || (reader->len > 0 && reader->len < M3U_LINE_MAX_SIZE - 1)), ESP_FAIL, err, TAG, "Cannot determine first EOL of m3u file");
+    reader->line[reader->len] = 0;
+
+    // cut s from https protocol
+    if (strncmp(reader->line, "https://", 8) == 0)
+        memmove(reader->line + 4, reader->line + 5, reader->len - 4);
+
+    ESP_LOGI(TAG, "%s resolved in %lld ms: %s", guide_id, (esp_timer_get_time() - start) / 1000, reader->line);
+
+    *stream_url = strdup(reader->line);
+    ESP_GOTO_ON_FALSE(*stream_url, ESP_ERR_NO_MEM, err, TAG, "Not enough memmory for stream url");
+
+err:
+    if (download_url)
+        free(download_url);
+    if (chunk_buffer)
+        free(chunk_buffer);
+    if (reader)
+        free(reader);
+    return ret;
+}
+
+// must be called with lock held
+static resolver_entry_t *entry_find(const char *guide_id)
+{
+    for (int i = 0; i < entry_count; i++)
+    {
+        if (strcmp(entries[i].guide_id, guide_id) == 0)
+            return &entries[i];
+    }
+    return NULL;
+}
+
+// must be called with lock held
+static resolver_entry_t *entry_add(const char *guide_id)
+{
+    if (entry_count == TUNEIN_RESOLVER_MAX_ENTRIES)
+        return NULL;
+    char *id = strdup(guide_id);
+    if (id == NULL)
+        return NULL;
+    resolver_entry_t *entry = &entries[entry_count++];
+    memset(entry, 0, sizeof(resolver_entry_t));
+    entry->guide_id = id;
+    return entry;
+}
+
+// must be called with lock held
+static void entry_remove(int index)
+{
+    free(entries[index].guide_id);
+    if (entries[index].url != NULL)
+        free(entries[index].url);
+    entries[index] = entries[--entry_count];
+    cache_dirty = true;
+}
+
+static void entry_update(const char *guide_id, esp_err_t ret, char *url, bool add)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    int64_t now = esp_timer_get_time();
+    resolver_entry_t *entry = entry_find(guide_id);
+    if (entry == NULL && add)
+        entry = entry_add(guide_id);
+    if (entry != NULL && ret == ESP_OK)
+    {
+        cache_dirty = true; // the saved age restarts too
+        if (entry->url != NULL)
+            free(entry->url);
+        entry->url = url;
+        url = NULL;
+        entry->resolved_at = now;
+    }
+    else if (entry != NULL)
+    {
+        // a stale url is still better than none, it is tried again later
+        if (entry->url != NULL)
+            entry->resolved_at = now - TUNEIN_RESOLVER_TTL_MS * 1000LL + TUNEIN_RESOLVER_RETRY_MS * 1000LL;
+        entry->retry_at = now + TUNEIN_RESOLVER_RETRY_MS * 1000LL;
+    }
+    xSemaphoreGive(lock);
+    if (url != NULL)
+        free(url);
+}
+
+/* Next station whose url is missing or expired, wait is set to the time until the next one is due */
+static char *entry_next_due(TickType_t *wait)
+{
+    char *guide_id = NULL;
+    int64_t next = INT64_MAX;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    int64_t now = esp_timer_get_time();
+    for (int i = 0; i < entry_count && guide_id == NULL; i++)
+    {
+        resolver_entry_t *entry = &entries[i];
+        int64_t due = entry->url == NULL ? entry->retry_at : entry->resolved_at + (entry->resolved_at != 0 ? TUNEIN_RESOLVER_TTL_MS * 1000LL : 0);
+        if (due <= now)
+            guide_id = strdup(entry->guide_id);
+        else if (due < next)
+            next = due;
+    }
+    xSemaphoreGive(lock);
+    *wait = next == INT64_MAX ? portMAX_DELAY : pdMS_TO_TICKS((next - now) / 1000 + 1);
+    return guide_id;
+}
+
+/*
+ * Cache file: one "guide_id age url" line per station, age in seconds when the file was written.
+ * There is no wall clock, the time the device was off does not count.
+ */
+static void cache_save(void)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (!cache_dirty)
+    {
+        xSemaphoreGive(lock);
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    FILE *f = fopen(TUNEIN_RESOLVER_CACHE_FILE ".tmp", "w");
+    if (f != NULL)
+    {
+        for (int i = 0; i < entry_count; i++)
+        {
+            // an unknown age is saved as expired
+            int64_t age = entries[i].resolved_at != 0 ? (now - entries[i].resolved_at) / 1000000 : TUNEIN_RESOLVER_TTL_MS / 1000;
+            if (entries[i].url != NULL)
+                fprintf(f, "%s %lld %s\n", entries[i].guide_id, age, entries[i].url);
+        }
+        fclose(f);
+        unlink(TUNEIN_RESOLVER_CACHE_FILE);
+        rename(TUNEIN_RESOLVER_CACHE_FILE ".tmp", TUNEIN_RESOLVER_CACHE_FILE);
+        cache_dirty = false;
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Cannot save %s", TUNEIN_RESOLVER_CACHE_FILE);
+    }
+    xSemaphoreGive(lock);
+}
+
+static void cache_load(void)
+{
+    FILE *f = fopen(TUNEIN_RESOLVER_CACHE_FILE, "r");
+    if (f == NULL)
+        return;
+    char line[M3U_LINE_MAX_SIZE + 64];
+    int64_t now = esp_timer_get_time();
+    xSemaphoreTake(lock, portMAX_DELAY);
+    while (fgets(line, sizeof(line), f))
+    {
+        line[strcspn(line, "\r\n")] = 0;
+        char *url = strchr(line, ' ');
+        if (url == NULL)
+            continue;
+        *url++ = 0;
+        // files without the age are refreshed right away
+        char *end = NULL;
+        long long age = strtoll(url, &end, 10);
+        bool aged = end != url && *end == ' ';
+        if (aged)
+            url = end + 1;
+        resolver_entry_t *entry = entry_add(line);
+        if (entry == NULL)
+            continue;
+        entry->url = strdup(url);
+        if (aged)
+            entry->resolved_at = now - age * 1000000LL != 0 ? now - age * 1000000LL : -1;
+    }
+    xSemaphoreGive(lock);
+    fclose(f);
+    ESP_LOGI(TAG, "%d stream urls loaded from %s", entry_count, TUNEIN_RESOLVER_CACHE_FILE);
+}
+
+static void resolver_task(void *p)
+{
+    while (true)
+    {
+        TickType_t wait;
+        char *guide_id;
+        // one station at a time, the lock is not held during the download
+        while ((guide_id = entry_next_due(&wait)) != NULL)
+        {
+            char *url = NULL;
+            esp_err_t ret = stream_url_resolve(guide_id, &url);
+            entry_update(guide_id, ret, url, false);
+            free(guide_id);
+        }
+        cache_save();
+        ulTaskNotifyTake(pdTRUE, wait);
+    }
+}
+
+void tunein_resolver_prefetch(const station_list_t *list)
+{
+    if (lock == NULL || list == NULL)
+        return;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    // forget the stations which are not favorites anymore
+    int i = 0;
+    while (i < entry_count)
+    {
+        if (station_list_find(list, entries[i].guide_id) < 0)
+            entry_remove(i);
+        else
+            i++;
+    }
+    for (i = 0; i < list->count; i++)
+    {
+        const char *guide_id = station_list_get(list, i, STATION_GUIDE_ID);
+        if (guide_id != NULL && entry_find(guide_id) == NULL)
+            entry_add(guide_id);
+    }
+    xSemaphoreGive(lock);
+    xTaskNotifyGive(th_resolver);
+}
+
+esp_err_t tunein_resolver_cached_get(const char *guide_id, char **url)
+{
+    ESP_RETURN_ON_FALSE(guide_id != NULL, ESP_ERR_INVALID_ARG, TAG, "Radio station has no guide_id");
+    *url = NULL;
+    if (lock == NULL)
+        return ESP_ERR_NOT_FOUND;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    resolver_entry_t *entry = entry_find(guide_id);
+    if (entry != NULL && entry->url != NULL)
+        *url = strdup(entry->url);
+    xSemaphoreGive(lock);
+    return *url != NULL ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t tunein_resolver_get(const char *guide_id, char **url, bool *cached)
+{
+    *cached = false;
+    esp_err_t ret = tunein_resolver_cached_get(guide_id, url);
+    if (ret != ESP_ERR_NOT_FOUND)
+    {
+        *cached = ret == ESP_OK;
+        return ret;
+    }
+
+    char *resolved = NULL;
+    ret = stream_url_resolve(guide_id, &resolved);
+    ESP_RETURN_ON_ERROR(ret, TAG, "Cannot resolve stream url of %s", guide_id);
+    *url = strdup(resolved);
+    if (lock != NULL)
+    {
+        entry_update(guide_id, ESP_OK, resolved, true);
+        xTaskNotifyGive(th_resolver); // persist it
+    }
+    else
+    {
+        free(resolved);
+    }
+    ESP_RETURN_ON_FALSE(*url != NULL, ESP_ERR_NO_MEM, TAG, "Not enough memmory for stream url");
+    return ESP_OK;
+}
+
+void tunein_resolver_invalidate(const char *guide_id)
+{
+    if (lock == NULL || guide_id == NULL)
+        return;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    resolver_entry_t *entry = entry_find(guide_id);
+    if (entry != NULL && entry->url != NULL)
+    {
+        ESP_LOGI(TAG, "Stream url of %s invalidated", guide_id);
+        free(entry->url);
+        entry->url = NULL;
+        entry->retry_at = 0;
+        cache_dirty = true;
+    }
+    xSemaphoreGive(lock);
+    xTaskNotifyGive(th_resolver);
+}
+
+esp_err_t tunein_resolver_init(void)
+{
+    ESP_RETURN_ON_FALSE(lock == NULL, ESP_OK, TAG, "Resolver already initialized");
+    lock = xSemaphoreCreateMutex();
+    ESP_RETURN_ON_FALSE(lock != NULL, ESP_ERR_NO_MEM, TAG, "Cannot create resolver lock");
+    cache_load();
+    BaseType_t ret = xTaskCreatePinnedToCore(&resolver_task, "tunein_resolver", 8 * 1024, NULL, 2, &th_resolver, 0);
+    ESP_RETURN_ON_FALSE(ret == pdPASS, ESP_FAIL, TAG, "Cannot create tunein_resolver task, error code: %d", ret);
+    return ESP_OK;
+}
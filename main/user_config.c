@@ -1,9 +1,14 @@
 #include "user_config.h"
+
+#include <string.h>
 #include "esp_log.h"
 #include "esp_err.h"
 #include "esp_check.h"
 #include "nvs_flash.h"
 #include "nvs.h"
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
 #define CONF_NAMESPACE "config"
 #define CONF_KEY_I2S_OUT "i2s_output"
@@ -20,94 +25,232 @@
 #define CONF_DEF_VAL_BACKLIGHT_TIMER 1000 * 60 * 5
 #define CONF_DEF_VAL_SCAN_SD_ON_BOOT 0
 
-static esp_err_t config_set_u8(char *key, uint8_t value)
+typedef enum
+{
+    CONF_I2S_OUT,
+    CONF_AUDIO_VOL,
+    CONF_BACKLIGHT_FULL,
+    CONF_BACKLIGHT_DIMM,
+    CONF_BACKLIGHT_TIMER,
+    CONF_SCAN_SD_ON_BOOT,
+    CONF_COUNT,
+} config_key_t;
+
+typedef struct
+{
+    const char *key;
+    bool u32; // stored as u8 otherwise
+    uint32_t default_value;
+} config_entry_t;
+
+static const config_entry_t entries[CONF_COUNT] = {
+    [CONF_I2S_OUT] = {CONF_KEY_I2S_OUT, false, CONF_DEF_VAL_I2S_OUT},
+    [CONF_AUDIO_VOL] = {CONF_KEY_AUDIO_VOL, false, CONF_DEF_VAL_AUDIO_VOL},
+    [CONF_BACKLIGHT_FULL] = {CONF_KEY_BACKLIGHT_FULL, false, CONF_DEF_VAL_BACKLIGHT_FULL},
+    [CONF_BACKLIGHT_DIMM] = {CONF_KEY_BACKLIGHT_DIMM, false, CONF_DEF_VAL_BACKLIGHT_DIMM},
+    [CONF_BACKLIGHT_TIMER] = {CONF_KEY_BACKLIGHT_TIMER, true, CONF_DEF_VAL_BACKLIGHT_TIMER},
+    [CONF_SCAN_SD_ON_BOOT] = {CONF_KEY_SCAN_SD_ON_BOOT, false, CONF_DEF_VAL_SCAN_SD_ON_BOOT},
+};
+
+static const char *TAG = "USER_CONFIG";
+
+/* the values in RAM, the dirty ones are not in flash yet */
+static uint32_t values[CONF_COUNT];
+static uint32_t dirty = 0;
+static bool loaded = false;
+static config_stats_t stats = {0};
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t th_flush = NULL;
+
+static esp_err_t config_load(void)
 {
+    for (int i = 0; i < CONF_COUNT; i++)
+        values[i] = entries[i].default_value;
+    loaded = true;
+
     nvs_handle_t nvs_handle;
-    nvs_open(CONF_NAMESPACE, NVS_READWRITE, &nvs_handle);
-    nvs_set_u8(nvs_handle, key, value);
-    nvs_commit(nvs_handle);
+    esp_err_t ret = nvs_open(CONF_NAMESPACE, NVS_READONLY, &nvs_handle);
+    if (ret == ESP_ERR_NVS_NOT_FOUND)
+        return ESP_OK; // nothing saved yet
+    ESP_RETURN_ON_ERROR(ret, TAG, "Cannot open config, using the defaults");
+    for (int i = 0; i < CONF_COUNT; i++)
+    {
+        if (entries[i].u32)
+        {
+            nvs_get_u32(nvs_handle, entries[i].key, &values[i]);
+        }
+        else
+        {
+            uint8_t value = 0;
+            if (nvs_get_u8(nvs_handle, entries[i].key, &value) == ESP_OK)
+                values[i] = value;
+        }
+    }
     nvs_close(nvs_handle);
     return ESP_OK;
 }
 
-static uint8_t config_get_u8(char *key, uint8_t default_value)
+esp_err_t config_flush(void)
 {
-    nvs_handle_t nvs_handle;
-    nvs_open(CONF_NAMESPACE, NVS_READWRITE, &nvs_handle);
-    uint8_t value = default_value;
-    nvs_get_u8(nvs_handle, key, &value);
-    return value;
-}
+    uint32_t flushed;
+    uint32_t flushed_values[CONF_COUNT];
+    taskENTER_CRITICAL(&lock);
+    flushed = dirty;
+    dirty = 0;
+    memcpy(flushed_values, values, sizeof(values));
+    taskEXIT_CRITICAL(&lock);
+    if (flushed == 0)
+        return ESP_OK;
 
-static esp_err_t config_set_u32(char *key, uint32_t value)
-{
     nvs_handle_t nvs_handle;
-    nvs_open(CONF_NAMESPACE, NVS_READWRITE, &nvs_handle);
-    nvs_set_u32(nvs_handle, key, value);
-    nvs_commit(nvs_handle);
+    esp_err_t ret = nvs_open(CONF_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    ESP_GOTO_ON_ERROR(ret, err, TAG, "Cannot open config for writing");
+    for (int i = 0; i < CONF_COUNT && ret == ESP_OK; i++)
+    {
+        if (!(flushed & (1 << i)))
+            continue;
+        if (entries[i].u32)
+            ret = nvs_set_u32(nvs_handle, entries[i].key, flushed_values[i]);
+        else
+            ret = nvs_set_u8(nvs_handle, entries[i].key, flushed_values[i]);
+    }
+    if (ret == ESP_OK)
+        ret = nvs_commit(nvs_handle);
     nvs_close(nvs_handle);
+    ESP_GOTO_ON_ERROR(ret, err, TAG, "Cannot save config");
+    taskENTER_CRITICAL(&lock);
+    stats.commits++;
+    taskEXIT_CRITICAL(&lock);
+    config_stats_t saved;
+    config_stats_get(&saved);
+    ESP_LOGI(TAG, "Config saved, keys 0x%lx, changes = %lu, commits = %lu, commits avoided = %lu",
+             flushed, saved.changes, saved.commits, saved.commits_avoided);
     return ESP_OK;
+err:
+    // kept for the next flush
+    taskENTER_CRITICAL(&lock);
+    dirty |= flushed;
+    taskEXIT_CRITICAL(&lock);
+    return ret;
 }
 
-static uint32_t config_get_u32(char *key, uint32_t default_value)
+/* Writes the changes once they stopped for CONFIG_FLUSH_DELAY_MS */
+static void flush_task(void *p)
 {
-    nvs_handle_t nvs_handle;
-    nvs_open(CONF_NAMESPACE, NVS_READWRITE, &nvs_handle);
-    uint32_t value = default_value;
-    nvs_get_u32(nvs_handle, key, &value);
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CONFIG_FLUSH_DELAY_MS)) > 0)
+            ;
+        config_flush();
+    }
+}
+
+static void shutdown_handler(void)
+{
+    config_flush();
+}
+
+esp_err_t config_init(void)
+{
+    ESP_RETURN_ON_FALSE(th_flush == NULL, ESP_OK, TAG, "Config already initialized");
+    esp_err_t ret = config_load();
+    BaseType_t task_ret = xTaskCreatePinnedToCore(&flush_task, "config_flush", CONFIG_FLUSH_TASK_STACK, NULL, CONFIG_FLUSH_TASK_PRIORITY, &th_flush, 0);
+    ESP_RETURN_ON_FALSE(task_ret == pdPASS, ESP_FAIL, TAG, "Cannot create config_flush task, error code: %d", task_ret);
+    esp_register_shutdown_handler(shutdown_handler);
+    return ret;
+}
+
+void config_stats_get(config_stats_t *out)
+{
+    taskENTER_CRITICAL(&lock);
+    *out = stats;
+    taskEXIT_CRITICAL(&lock);
+    // each change used to be committed on its own
+    out->commits_avoided = out->changes > out->commits ? out->changes - out->commits : 0;
+}
+
+static uint32_t config_get(config_key_t key)
+{
+    if (!loaded)
+        config_load();
+    taskENTER_CRITICAL(&lock);
+    uint32_t value = values[key];
+    taskEXIT_CRITICAL(&lock);
     return value;
 }
 
+static esp_err_t config_set(config_key_t key, uint32_t value)
+{
+    if (!loaded)
+        config_load();
+    taskENTER_CRITICAL(&lock);
+    bool changed = values[key] != value;
+    if (changed)
+    {
+        values[key] = value;
+        dirty |= 1 << key;
+        stats.changes++;
+    }
+    taskEXIT_CRITICAL(&lock);
+    if (!changed)
+        return ESP_OK;
+    if (th_flush == NULL)
+        return config_flush();
+    xTaskNotifyGive(th_flush);
+    return ESP_OK;
+}
+
 uint8_t config_get_i2s_output()
 {
-    return config_get_u8(CONF_KEY_I2S_OUT, CONF_DEF_VAL_I2S_OUT);
+    return config_get(CONF_I2S_OUT);
 }
 esp_err_t config_set_i2s_output(uint8_t value)
 {
-    return config_set_u8(CONF_KEY_I2S_OUT, value);
+    return config_set(CONF_I2S_OUT, value);
 }
 
 uint8_t config_get_audio_volume()
 {
-    return config_get_u8(CONF_KEY_AUDIO_VOL, CONF_DEF_VAL_AUDIO_VOL);
+    return config_get(CONF_AUDIO_VOL);
 }
 esp_err_t config_set_audio_volume(uint8_t value)
 {
-    return config_set_u8(CONF_KEY_AUDIO_VOL, value);
+    return config_set(CONF_AUDIO_VOL, value);
 }
 
 uint8_t config_get_backlight_full()
 {
-    return config_get_u8(CONF_KEY_BACKLIGHT_FULL, CONF_DEF_VAL_BACKLIGHT_FULL);
+    return config_get(CONF_BACKLIGHT_FULL);
 }
 esp_err_t config_set_backlight_full(uint8_t value)
 {
-    return config_set_u8(CONF_KEY_BACKLIGHT_FULL, value);
+    return config_set(CONF_BACKLIGHT_FULL, value);
 }
 
 uint8_t config_get_backlight_dimm()
 {
-    return config_get_u8(CONF_KEY_BACKLIGHT_DIMM, CONF_DEF_VAL_BACKLIGHT_DIMM);
+    return config_get(CONF_BACKLIGHT_DIMM);
 }
 esp_err_t config_set_backlight_dimm(uint8_t value)
 {
-    return config_set_u8(CONF_KEY_BACKLIGHT_DIMM, value);
+    return config_set(CONF_BACKLIGHT_DIMM, value);
 }
 
 uint32_t config_get_backlight_timer()
 {
-    return config_get_u32(CONF_KEY_BACKLIGHT_TIMER, CONF_DEF_VAL_BACKLIGHT_TIMER);
+    return config_get(CONF_BACKLIGHT_TIMER);
 }
 esp_err_t config_set_backlight_timer(uint32_t value)
 {
-    return config_set_u32(CONF_KEY_BACKLIGHT_TIMER, value);
+    return config_set(CONF_BACKLIGHT_TIMER, value);
 }
 
 bool config_get_scan_card_on_boot()
 {
-    return config_get_u8(CONF_KEY_SCAN_SD_ON_BOOT, CONF_DEF_VAL_SCAN_SD_ON_BOOT) == 1;
+    return config_get(CONF_SCAN_SD_ON_BOOT) == 1;
 }
 esp_err_t config_set_scan_card_on_boot(bool value)
 {
-    return config_set_u8(CONF_KEY_SCAN_SD_ON_BOOT, value ? 1 : 0);
+    return config_set(CONF_SCAN_SD_ON_BOOT, value ? 1 : 0);
 }
\ No newline at end of file